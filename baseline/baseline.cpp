@@ -824,30 +824,54 @@ class _spotfind_context {
     af::ref<internal_T, af::c_grid<2>> src_converted;
     internal_T *_src_converted_store;
 
+    af::ref<double, af::c_grid<2>> gain_converted;
+    double *_gain_converted_store;
+
     baseline::DispersionThreshold algo;
 
-    _spotfind_context(size_t width, size_t height)
+    _spotfind_context(size_t width, size_t height, const spotfinder_params &params)
         : size(height, width),
-          algo(size, kernel_size_, nsig_b_, nsig_s_, threshold_, min_count_) {
+          algo(size,
+               af::tiny<int, 2>(params.kernel_size[0], params.kernel_size[1]),
+               params.nsig_b,
+               params.nsig_s,
+               params.threshold,
+               params.min_count) {
         _dest_store = new bool[width * height];
         dst = af::ref<bool, af::c_grid<2>>(_dest_store, af::c_grid<2>(height, width));
         // Make a place to convert sources to the internal type
         _src_converted_store = new internal_T[width * height];
         src_converted = af::ref<internal_T, af::c_grid<2>>(
           _src_converted_store, af::c_grid<2>(height, width));
+        // DIALS takes the gain as double
+        _gain_converted_store = new double[width * height];
+        gain_converted = af::ref<double, af::c_grid<2>>(_gain_converted_store,
+                                                        af::c_grid<2>(height, width));
     }
     ~_spotfind_context() {
         delete[] _dest_store;
         delete[] _src_converted_store;
+        delete[] _gain_converted_store;
     }
     void threshold(const af::const_ref<internal_T, af::c_grid<2>> &src,
                    const af::const_ref<bool, af::c_grid<2>> &mask) {
         algo.threshold(src_converted, mask, dst);
     }
+    void threshold_w_gain(const af::const_ref<internal_T, af::c_grid<2>> &src,
+                          const af::const_ref<bool, af::c_grid<2>> &mask) {
+        algo.threshold_w_gain(src, mask, gain_converted, dst);
+    }
 };
 
 void *spotfinder_create(size_t width, size_t height) {
-    return new _spotfind_context<image_t_type, double>(width, height);
+    spotfinder_params params;
+    spotfinder_default_params(&params);
+    return spotfinder_create_with_params(width, height, &params);
+}
+void *spotfinder_create_with_params(size_t width,
+                                    size_t height,
+                                    const spotfinder_params *params) {
+    return new _spotfind_context<image_t_type, double>(width, height, *params);
 }
 void spotfinder_free(void *context) {
     delete reinterpret_cast<_spotfind_context<image_t_type, double> *>(context);
@@ -879,3 +903,29 @@ uint32_t spotfinder_standard_dispersion(void *context,
 
     return pixel_count;
 }
+
+uint32_t spotfinder_standard_dispersion_gain(void *context,
+                                             image_t *image,
+                                             const float *gain,
+                                             bool **destination) {
+    auto ctx = reinterpret_cast<_spotfind_context<image_t_type, double> *>(context);
+
+    auto mask = af::const_ref<bool, af::c_grid<2>>(
+      reinterpret_cast<bool *>(image->mask), af::c_grid<2>(ctx->size[0], ctx->size[1]));
+
+    for (int i = 0; i < (ctx->size[0] * ctx->size[1]); ++i) {
+        ctx->src_converted[i] = image->data[i];
+        ctx->gain_converted[i] = gain[i];
+    }
+
+    ctx->threshold_w_gain(ctx->src_converted, mask);
+
+    uint32_t pixel_count = 0;
+    for (int i = 0; i < (ctx->size[0] * ctx->size[1]); ++i) {
+        pixel_count += ctx->dst[i];
+    }
+
+    if (destination != nullptr) *destination = &ctx->dst.front();
+
+    return pixel_count;
+}
@@ -2,15 +2,25 @@
 #define BASELINE_H
 
 #include "h5read.h"
+#include "spotfinder_params.h"
 
 #ifdef __cplusplus
 extern "C" {
 #endif
+/// Create a spotfinder with the default parameters
 void* spotfinder_create(size_t width, size_t height);
+void* spotfinder_create_with_params(size_t width,
+                                    size_t height,
+                                    const spotfinder_params* params);
 void spotfinder_free(void* context);
 uint32_t spotfinder_standard_dispersion(void* context,
                                         image_t* image,
                                         bool** destination = nullptr);
+/// As spotfinder_standard_dispersion, with a per-pixel detector gain map
+uint32_t spotfinder_standard_dispersion_gain(void* context,
+                                             image_t* image,
+                                             const float* gain,
+                                             bool** destination = nullptr);
 #ifdef __cplusplus
 }
 #endif
@@ -1,7 +1,12 @@
 #include <benchmark/benchmark.h>
 
+#include <algorithm>
 #include <cassert>
+#include <cmath>
+#include <cstdlib>
 #include <iostream>
+#include <numeric>
+#include <random>
 #include <type_traits>
 #include <vector>
 
@@ -34,12 +39,11 @@ class ImageSource {
     H5Read reader;
 
     ImageSource(const int sample_image_number = 5) {
-        size_t num_pixels = reader.get_image_fast() * reader.get_image_slow();
-        auto data_store = std::vector<H5Read::image_type>(num_pixels);
-        reader.get_image_into(sample_image_number, data_store.data());
-        // Convert to our internal store type
-        _source = std::vector<T>(data_store.begin(), data_store.end());
-        _result = std::vector<uint8_t>(num_pixels);
+        load(sample_image_number);
+    }
+    /// Use the first frame of a synthetic dataset
+    ImageSource(const h5read_synthetic_params& params) : reader(params) {
+        load(0);
     }
 
     auto image_data() const -> const span<const T> {
@@ -87,10 +91,27 @@ class ImageSource {
     };
 #endif
   private:
+    void load(int image_number) {
+        size_t num_pixels = reader.get_image_fast() * reader.get_image_slow();
+        auto data_store = std::vector<H5Read::image_type>(num_pixels);
+        reader.get_image_into(image_number, data_store.data());
+        // Convert to our internal store type
+        _source = std::vector<T>(data_store.begin(), data_store.end());
+        _result = std::vector<uint8_t>(num_pixels);
+    }
+
     std::vector<T> _source;
     std::vector<uint8_t> _result;
 };
 
+/// Synthetic data with realistic spot density, in a 4M (0) or 16M (1) geometry
+static auto synthetic_params(int detector) -> h5read_synthetic_params {
+    h5read_synthetic_params params;
+    h5read_synthetic_default_params(&params);
+    params.detector = detector ? H5READ_EIGER2XE_16M : H5READ_EIGER2XE_4M;
+    return params;
+}
+
 #ifdef HAVE_DIALS
 template <class T>
 static void BM_standard_dispersion(benchmark::State& state) {
@@ -164,4 +185,372 @@ static void BM_Standalone_dispersion(benchmark::State& state) {
 }
 BENCHMARK(BM_Standalone_dispersion)->Unit(benchmark::kMillisecond);
 
+static void BM_Standalone_dispersion_synthetic(benchmark::State& state) {
+    ImageSource<uint16_t> src(synthetic_params(state.range(0)));
+    auto finder = StandaloneSpotfinder<double>(src.fast(), src.slow());
+    std::vector<double> converted_image(src.image_data().begin(),
+                                        src.image_data().end());
+    size_t strong = 0;
+    for (auto _ : state) {
+        auto result = finder.standard_dispersion(converted_image, src.mask_data());
+        strong = std::count(result.begin(), result.end(), true);
+    }
+    state.counters["strong"] = strong;
+}
+BENCHMARK(BM_Standalone_dispersion_synthetic)
+  ->Arg(0)
+  ->Arg(1)
+  ->Unit(benchmark::kMillisecond);
+
+/// Kernel sizes 1-5 use specialised kernels, others the generic runtime path
+static void BM_Standalone_dispersion_kernel(benchmark::State& state) {
+    ImageSource<uint16_t> src(synthetic_params(0));
+    auto params = StandaloneSpotfinder<double>::default_params();
+    params.kernel_size[0] = params.kernel_size[1] = state.range(0);
+    auto finder = StandaloneSpotfinder<double>(src.fast(), src.slow(), params);
+    std::vector<double> converted_image(src.image_data().begin(),
+                                        src.image_data().end());
+    size_t strong = 0;
+    for (auto _ : state) {
+        auto result = finder.standard_dispersion(converted_image, src.mask_data());
+        strong = std::count(result.begin(), result.end(), true);
+    }
+    state.counters["strong"] = strong;
+}
+BENCHMARK(BM_Standalone_dispersion_kernel)
+  ->DenseRange(1, 7)
+  ->Unit(benchmark::kMillisecond);
+
+/// Spotfinding in an annulus from r/2 to r pixels around the centre of a
+/// synthetic 4M frame
+static void BM_Standalone_dispersion_region(benchmark::State& state) {
+    ImageSource<uint16_t> src(synthetic_params(0));
+    auto finder = StandaloneSpotfinder<double>(src.fast(), src.slow());
+    std::vector<double> converted_image(src.image_data().begin(),
+                                        src.image_data().end());
+    SpotfinderRegion region(src.fast(), src.slow());
+    double radius = state.range(0);
+    region.add_annulus(src.fast() / 2.0, src.slow() / 2.0, radius / 2, radius);
+
+    size_t strong = 0;
+    for (auto _ : state) {
+        auto result =
+          finder.standard_dispersion(converted_image, src.mask_data(), region);
+        strong = std::count(result.begin(), result.end(), true);
+    }
+    size_t pixels = 0;
+    for (auto& row : region.spans()) {
+        pixels += row.x_end - row.x_begin;
+    }
+    state.counters["strong"] = strong;
+    state.counters["fraction"] =
+      static_cast<double>(pixels) / (src.fast() * src.slow());
+}
+BENCHMARK(BM_Standalone_dispersion_region)
+  ->Arg(100)
+  ->Arg(400)
+  ->Arg(1600)
+  ->Unit(benchmark::kMillisecond);
+
+static void BM_Standalone_find_hit(benchmark::State& state) {
+    auto params = synthetic_params(0);
+    bool blank = state.range(1);
+    if (blank) params.spots_per_frame = 0;
+    ImageSource<uint16_t> src(params);
+    auto finder = StandaloneSpotfinder<double>(src.fast(), src.slow());
+    std::vector<double> converted_image(src.image_data().begin(),
+                                        src.image_data().end());
+    size_t stride = state.range(0);
+
+    HitResult result{};
+    for (auto _ : state) {
+        result = finder.find_hit(converted_image, src.mask_data(), 1000, stride);
+    }
+    state.counters["hit"] = result.hit;
+    state.counters["strong"] = result.strong_pixels;
+    state.counters["rows"] = result.rows;
+}
+BENCHMARK(BM_Standalone_find_hit)
+  ->ArgsProduct({{1, 4, 16}, {0, 1}})
+  ->ArgNames({"stride", "blank"})
+  ->Unit(benchmark::kMillisecond);
+
+/// Consecutive frames of a sweep, each thresholded on its own (0) or against
+/// the temporal background (1). The sweep is synthetic, unless BM_SWEEP_DATA
+/// is set to the path of a real (16-bit) dataset.
+static void BM_Standalone_sweep(benchmark::State& state) {
+    const char* path = getenv("BM_SWEEP_DATA");
+    auto reader = path ? H5Read(path) : H5Read(synthetic_params(0));
+    size_t num_frames = std::min<size_t>(20, reader.get_number_of_images());
+    size_t pixels = reader.get_image_fast() * reader.get_image_slow();
+    std::vector<uint16_t> frames(num_frames * pixels);
+    for (size_t i = 0; i < num_frames; ++i) {
+        auto status =
+          reader.try_get_image_into(i, {frames.data() + i * pixels, pixels});
+        if (status != H5READ_OK) {
+            state.SkipWithError(h5read_status_string(status));
+            return;
+        }
+    }
+    // Datasets without a mask have every pixel valid
+    std::vector<uint8_t> all_valid;
+    auto raw_mask = reader.get_mask();
+    if (!raw_mask) {
+        all_valid.assign(pixels, 1);
+        raw_mask = {{all_valid.data(), pixels}};
+    }
+    auto mask =
+      span<const bool>{reinterpret_cast<const bool*>(raw_mask->data()), pixels};
+    auto finder =
+      StandaloneSpotfinder<double>(reader.get_image_fast(), reader.get_image_slow());
+    std::vector<double> converted_image(pixels);
+    bool temporal = state.range(0);
+
+    size_t frame = 0, strong = 0;
+    for (auto _ : state) {
+        // Start the sweep again after the last frame
+        if (frame % num_frames == 0) finder.reset_temporal_background();
+        auto image = frames.begin() + (frame % num_frames) * pixels;
+        converted_image.assign(image, image + pixels);
+        auto result = temporal ? finder.temporal_dispersion(converted_image, mask)
+                               : finder.standard_dispersion(converted_image, mask);
+        strong += std::count(result.begin(), result.end(), true);
+        ++frame;
+    }
+    state.counters["strong"] =
+      benchmark::Counter(strong, benchmark::Counter::kAvgIterations);
+}
+BENCHMARK(BM_Standalone_sweep)->Arg(0)->Arg(1)->Unit(benchmark::kMillisecond);
+
+/// A smoothly varying gain map, or unit gain
+static auto gain_map(size_t fast, size_t slow, bool varying) -> std::vector<float> {
+    std::vector<float> gain(fast * slow, 1.0f);
+    if (varying) {
+        for (size_t y = 0; y < slow; ++y) {
+            for (size_t x = 0; x < fast; ++x) {
+                gain[y * fast + x] =
+                  1.0f + 0.2f * std::sin(x * 0.01f) * std::cos(y * 0.013f);
+            }
+        }
+    }
+    return gain;
+}
+
+/// Dispersion with a unit (0) or varying (1) gain map on a synthetic 4M frame.
+/// Fails if the result differs from DIALS, or without DIALS, from the per-pixel
+/// dispersion_w_gain (with unit gain, from no gain map).
+static void BM_Standalone_dispersion_gain(benchmark::State& state) {
+    ImageSource<uint16_t> src(synthetic_params(0));
+    auto finder = StandaloneSpotfinder<double>(src.fast(), src.slow());
+    std::vector<double> converted_image(src.image_data().begin(),
+                                        src.image_data().end());
+    auto gain = gain_map(src.fast(), src.slow(), state.range(0));
+
+    // What the result should be
+    std::vector<bool> expected;
+#ifdef HAVE_DIALS
+    auto image = src.h5read_image();
+    auto dials = spotfinder_create(src.fast(), src.slow());
+    bool* dials_result = nullptr;
+    spotfinder_standard_dispersion_gain(dials, &image, gain.data(), &dials_result);
+    expected.assign(dials_result, dials_result + src.fast() * src.slow());
+    spotfinder_free(dials);
+#else
+    if (state.range(0)) {
+        // Applies the gain map directly to each pixel's window moments
+        finder.set_gain(gain);
+        auto result = finder.dispersion_w_gain(converted_image, src.mask_data());
+        expected.assign(result.begin(), result.end());
+    } else {
+        auto result = finder.standard_dispersion(converted_image, src.mask_data());
+        expected.assign(result.begin(), result.end());
+    }
+#endif
+
+    finder.set_gain(gain);
+    span<const bool> result;
+    for (auto _ : state) {
+        result = finder.standard_dispersion(converted_image, src.mask_data());
+    }
+    if (!expected.empty()
+        && !std::equal(result.begin(), result.end(), expected.begin())) {
+        state.SkipWithError("Gain map result does not match reference");
+    }
+    state.counters["strong"] = std::count(result.begin(), result.end(), true);
+}
+BENCHMARK(BM_Standalone_dispersion_gain)->Arg(0)->Arg(1)->Unit(benchmark::kMillisecond);
+
+/// The other local threshold methods, with the parameters used for each
+enum LocalMethod { Niblack, Sauvola, IndexOfDispersion, Masked, DispersionWithGain };
+
+static auto standalone_local_threshold(StandaloneSpotfinder<double>& finder,
+                                       LocalMethod method,
+                                       const span<const double> image,
+                                       const span<const bool> mask)
+  -> span<const bool> {
+    switch (method) {
+    case Niblack:
+        return finder.niblack(image, nsig_s_);
+    case Sauvola:
+        return finder.sauvola(image, 0.5, 2.0);
+    case IndexOfDispersion:
+        return finder.index_of_dispersion(image, nsig_b_);
+    case Masked:
+        return finder.index_of_dispersion_masked(image, mask, nsig_b_);
+    default:
+        return finder.dispersion_w_gain(image, mask);
+    }
+}
+
+#ifdef HAVE_DIALS
+static auto dials_local_threshold(LocalMethod method,
+                                  ImageSource<double>& src,
+                                  const af::const_ref<double, af::c_grid<2>>& gain)
+  -> af::versa<bool, af::c_grid<2>> {
+    using namespace dials::algorithms;
+    auto image = src.image_data_ref();
+    auto mask = src.mask_data_ref();
+    switch (method) {
+    case Niblack:
+        return niblack(image, kernel_size_, nsig_s_);
+    case Sauvola:
+        return sauvola(image, kernel_size_, 0.5, 2.0);
+    case IndexOfDispersion:
+        return index_of_dispersion(image, kernel_size_, nsig_b_);
+    case Masked:
+        return index_of_dispersion_masked(
+          image, mask, kernel_size_, min_count_, nsig_b_);
+    default:
+        return dispersion_w_gain(
+          image, mask, gain, kernel_size_, nsig_b_, nsig_s_, min_count_);
+    }
+}
+
+static void BM_dials_local_threshold(benchmark::State& state) {
+    auto method = static_cast<LocalMethod>(state.range(0));
+    ImageSource<double> src(synthetic_params(0));
+    auto gain = gain_map(src.fast(), src.slow(), true);
+    std::vector<double> gain_double(gain.begin(), gain.end());
+    af::const_ref<double, af::c_grid<2>> gain_ref(
+      gain_double.data(), af::c_grid<2>(src.fast(), src.slow()));
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(dials_local_threshold(method, src, gain_ref));
+    }
+}
+BENCHMARK(BM_dials_local_threshold)->DenseRange(0, 4)->Unit(benchmark::kMillisecond);
+#endif
+
+/// The other local threshold methods, on a synthetic 4M frame. With DIALS,
+/// counts the pixels that differ from the DIALS implementation.
+static void BM_Standalone_local_threshold(benchmark::State& state) {
+    auto method = static_cast<LocalMethod>(state.range(0));
+    ImageSource<double> src(synthetic_params(0));
+    auto finder = StandaloneSpotfinder<double>(src.fast(), src.slow());
+    auto gain = gain_map(src.fast(), src.slow(), true);
+    finder.set_gain(gain);
+
+    span<const bool> result;
+    for (auto _ : state) {
+        result = standalone_local_threshold(
+          finder, method, src.image_data(), src.mask_data());
+    }
+    state.counters["strong"] = std::count(result.begin(), result.end(), true);
+#ifdef HAVE_DIALS
+    std::vector<double> gain_double(gain.begin(), gain.end());
+    af::const_ref<double, af::c_grid<2>> gain_ref(
+      gain_double.data(), af::c_grid<2>(src.fast(), src.slow()));
+    auto expected = dials_local_threshold(method, src, gain_ref);
+    size_t mismatches = 0;
+    for (size_t i = 0; i < result.size(); ++i) {
+        mismatches += result[i] != expected[i];
+    }
+    state.counters["mismatches"] = mismatches;
+#endif
+}
+BENCHMARK(BM_Standalone_local_threshold)
+  ->DenseRange(0, 4)
+  ->Unit(benchmark::kMillisecond);
+
+/// Synthetic 16M frame generation rate, with the given number of threads
+static void BM_synthetic_generate(benchmark::State& state) {
+    auto params = synthetic_params(1);
+    params.threads = state.range(0);
+    H5Read reader(params);
+    std::vector<uint16_t> image(reader.get_image_fast() * reader.get_image_slow());
+    size_t index = 0;
+    for (auto _ : state) {
+        reader.get_image_into(index++, image.data());
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_synthetic_generate)
+  ->Arg(1)
+  ->Arg(4)
+  ->Unit(benchmark::kMillisecond)
+  ->UseRealTime();
+
+// Huge pages: each pair of benchmarks below runs with them off (0) and on (1)
+
+static void BM_Standalone_dispersion_huge_pages(benchmark::State& state) {
+    h5read_set_huge_pages(state.range(0));
+    ImageSource<uint16_t> src;
+    auto finder = StandaloneSpotfinder<double>(src.fast(), src.slow());
+    std::vector<double, HugePageAllocator<double>> converted_image(src.fast()
+                                                                  * src.slow());
+    converted_image.assign(src.image_data().begin(), src.image_data().end());
+    h5read_set_huge_pages(true);
+
+    for (auto _ : state) {
+        finder.standard_dispersion({converted_image.data(), converted_image.size()},
+                                   src.mask_data());
+    }
+}
+BENCHMARK(BM_Standalone_dispersion_huge_pages)
+  ->Arg(0)
+  ->Arg(1)
+  ->Unit(benchmark::kMillisecond);
+
+/// A buffer the size of a few 16M images, too big for any cache
+static constexpr size_t page_test_size = 256 * 1024 * 1024;
+
+/// Dependent random reads across the buffer, one per cache line, so that
+/// every access is a TLB miss with small pages
+static void BM_random_access_tlb(benchmark::State& state) {
+    h5read_set_huge_pages(state.range(0));
+    size_t lines = page_test_size / 64;
+    auto buffer = make_huge_buffer<size_t>(page_test_size / sizeof(size_t));
+    h5read_set_huge_pages(true);
+    // Link the cache lines into a single random cycle
+    std::vector<size_t> order(lines);
+    std::iota(order.begin(), order.end(), 0);
+    std::shuffle(order.begin() + 1, order.end(), std::mt19937_64{42});
+    for (size_t i = 0; i < lines; ++i) {
+        buffer[order[i] * 8] = order[(i + 1) % lines] * 8;
+    }
+    size_t index = 0;
+    for (auto _ : state) {
+        for (size_t i = 0; i < 1 << 20; ++i) {
+            index = buffer[index];
+        }
+        benchmark::DoNotOptimize(index);
+    }
+    state.SetItemsProcessed(state.iterations() * (1 << 20));
+}
+BENCHMARK(BM_random_access_tlb)->Arg(0)->Arg(1)->Unit(benchmark::kMillisecond);
+
+/// Streaming read bandwidth over the whole buffer
+static void BM_sequential_bandwidth(benchmark::State& state) {
+    h5read_set_huge_pages(state.range(0));
+    size_t count = page_test_size / sizeof(uint64_t);
+    auto buffer = make_huge_buffer<uint64_t>(count);
+    h5read_set_huge_pages(true);
+    std::fill(buffer.get(), buffer.get() + count, 1);
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(
+          std::accumulate(buffer.get(), buffer.get() + count, uint64_t{0}));
+    }
+    state.SetBytesProcessed(state.iterations() * page_test_size);
+}
+BENCHMARK(BM_sequential_bandwidth)->Arg(0)->Arg(1)->Unit(benchmark::kMillisecond);
+
 BENCHMARK_MAIN();
@@ -115,6 +115,31 @@ int main(int argc, char **argv) {
             fmt::print("Standalone Spotfinder:\n");
             draw_image_data(
               standalone_strong_pixels, x, y, 12, 12, image_fast, image_slow);
+
+            // Show the standalone intermediate values, to find the test that differs
+            auto debug = standalone_spotfinder.standard_dispersion_intermediates(
+              image_double,
+              {reinterpret_cast<const bool *>(mask.data()), mask.size()},
+              x,
+              y,
+              12,
+              12);
+            auto draw = [&](const char *name, const auto &values) {
+                fmt::print("Standalone {} (offset from ({}, {})):\n", name, x, y);
+                draw_image_data(values.data(),
+                                0,
+                                0,
+                                debug.width,
+                                debug.height,
+                                debug.width,
+                                debug.height);
+            };
+            draw("count", debug.count);
+            draw("mean", debug.mean);
+            draw("variance", debug.variance);
+            draw("index of dispersion", debug.index_of_dispersion);
+            draw("index of dispersion test", debug.cv_mask);
+            draw("value test", debug.value_mask);
         }
     }
     spotfinder_free(spotfinder);
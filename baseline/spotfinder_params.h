@@ -0,0 +1,31 @@
+#ifndef SPOTFINDER_PARAMS_H
+#define SPOTFINDER_PARAMS_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/// Parameters of the dispersion spotfinding algorithm
+typedef struct spotfinder_params {
+    int kernel_size[2];  ///< Half-size of the local window, as {slow, fast}
+    int min_count;       ///< Fewest valid pixels in a window; 0 for the whole window
+    double threshold;    ///< Only pixels with more counts than this can be strong
+    double nsig_b;       ///< Background dispersion cutoff, in standard deviations
+    double nsig_s;       ///< Strong pixel cutoff, in standard deviations
+} spotfinder_params;
+
+/// Fill a spotfinder_params with the DIALS defaults
+static inline void spotfinder_default_params(spotfinder_params *params) {
+    params->kernel_size[0] = 3;
+    params->kernel_size[1] = 3;
+    params->min_count = 2;
+    params->threshold = 0.0;
+    params->nsig_b = 6.0;
+    params->nsig_s = 3.0;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -1,13 +1,16 @@
 
 #include "standalone.h"
+#include "standalone_c.h"
 
 #include <h5read.h>
 
+#include <algorithm>
 #include <array>
 #include <cassert>
 #include <cmath>
 #include <iostream>
 #include <memory>
+#include <utility>
 #include <vector>
 
 // We might be on an implementation that doesn't have <span>, so use a backport
@@ -19,14 +22,27 @@ using tcb::span;
 using std::span;
 #endif
 
-const std::array<int, 2> kernel_size_{3, 3};
-const int min_count_ = 2;
-const double threshold_ = 0.0;
-const double nsig_b_ = 6.0;
-const double nsig_s_ = 3.0;
-
 namespace no_tbx {
 
+/// The intermediate values of the dispersion threshold at one pixel
+struct PixelIntermediates {
+    double count;                ///< Valid pixels in the window
+    double mean;                 ///< Mean of the valid pixels
+    double variance;             ///< Sample variance of the valid pixels
+    double index_of_dispersion;  ///< variance / mean
+    bool cv;                     ///< Passes the index of dispersion test
+    bool value;                  ///< Passes the strong pixel value test
+    bool global;                 ///< Above the global threshold
+    bool strong;                 ///< Passes every test, and has a valid window
+};
+
+/// A sink for intermediate values that doesn't want them, so that none are
+/// computed
+struct NullSink {
+    static constexpr bool enabled = false;
+    void operator()(std::size_t, const PixelIntermediates &) {}
+};
+
 /**
  * A class to compute the threshold using index of dispersion
  */
@@ -72,6 +88,33 @@ class DispersionThreshold {
         table_.resize(image_size[0] * image_size[1]);
     }
 
+    /**
+     * Set a per-pixel gain map to use, or an empty span for unit gain.
+     *
+     * The gain terms are precomputed per-pixel, so that thresholding with
+     * a gain map costs no more divisions or square roots than without.
+     * @param gain The gain of each pixel. Must be positive.
+     */
+    void set_gain(const span<const float> gain) {
+        if (gain.empty()) {
+            gain_.clear();
+            nsig_s_sqrt_gain_.clear();
+            return;
+        }
+        assert(gain.size() == image_size_[0] * image_size_[1]);
+        gain_.assign(gain.begin(), gain.end());
+        nsig_s_sqrt_gain_.resize(gain.size());
+        for (std::size_t k = 0; k < gain.size(); ++k) {
+            assert(gain[k] > 0);
+            nsig_s_sqrt_gain_[k] = nsig_s_ * std::sqrt(static_cast<T>(gain[k]));
+        }
+    }
+
+    /// A rectangle of the image: columns [x0, x1) of rows [y0, y1)
+    struct Box {
+        int x0, y0, x1, y1;
+    };
+
     /**
      * Compute the summed area tables for the mask, src and src^2.
      * @param src The input array
@@ -80,103 +123,278 @@ class DispersionThreshold {
     void compute_sat(span<Data> table,
                      const span<const T> src,
                      const span<const bool> mask) {
+        compute_sat(table, src, mask, {0, 0, image_size_[1], image_size_[0]});
+    }
+
+    /**
+     * Compute the summed area tables over just a rectangle of the image.
+     * @param table The table, with one entry per pixel of the rectangle
+     * @param box The rectangle
+     */
+    void compute_sat(span<Data> table,
+                     const span<const T> src,
+                     const span<const bool> mask,
+                     Box box) {
         // Largest value to consider
         const T BIG = (1 << 24);  // About 16m counts
 
         // Get the size of the image
 
-        auto [ysize, xsize] = image_size_;
+        std::size_t xsize = image_size_[1];
+        std::size_t x0 = box.x0, x1 = box.x1, y0 = box.y0, y1 = box.y1;
+        std::size_t width = x1 - x0;
 
         // Create the summed area table
-        for (std::size_t j = 0, k = 0; j < ysize; ++j) {
+        for (std::size_t j = y0, t = 0; j < y1; ++j) {
             int m = 0;
             T x = 0;
             T y = 0;
-            for (std::size_t i = 0; i < xsize; ++i, ++k) {
+            std::size_t k = j * xsize + x0;
+            for (std::size_t i = x0; i < x1; ++i, ++k, ++t) {
                 int mm = (mask[k] && src[k] < BIG) ? 1 : 0;
                 m += mm;
                 x += mm * src[k];
                 y += mm * src[k] * src[k];
-                if (j == 0) {
-                    table[k].m = m;
-                    table[k].x = x;
-                    table[k].y = y;
+                if (j == y0) {
+                    table[t].m = m;
+                    table[t].x = x;
+                    table[t].y = y;
                 } else {
-                    table[k].m = table[k - xsize].m + m;
-                    table[k].x = table[k - xsize].x + x;
-                    table[k].y = table[k - xsize].y + y;
+                    table[t].m = table[t - width].m + m;
+                    table[t].x = table[t - width].x + x;
+                    table[t].y = table[t - width].y + y;
                 }
             }
         }
     }
 
+    /**
+     * Sum the window around a pixel, clipped at the edges of the table
+     * @param table - The summed area table, of width x height pixels
+     * @param i, j - The pixel position in the table
+     * @param m, x, y - Set to the number of valid pixels in the local area,
+     *                  the sum of the pixel values and the sum of the squared
+     *                  pixel values.
+     */
+    void window_sums(span<const Data> table,
+                     int width,
+                     int height,
+                     int i,
+                     int j,
+                     int kxsize,
+                     int kysize,
+                     double &m,
+                     double &x,
+                     double &y) const {
+        int i0 = i - kxsize - 1, i1 = i + kxsize;
+        int j0 = j - kysize - 1, j1 = j + kysize;
+        i1 = i1 < width ? i1 : width - 1;
+        j1 = j1 < height ? j1 : height - 1;
+        int k0 = j0 * width;
+        int k1 = j1 * width;
+
+        m = 0;
+        x = 0;
+        y = 0;
+        if (i0 >= 0 && j0 >= 0) {
+            const Data &d00 = table[k0 + i0];
+            const Data &d10 = table[k1 + i0];
+            const Data &d01 = table[k0 + i1];
+            m += d00.m - (d10.m + d01.m);
+            x += d00.x - (d10.x + d01.x);
+            y += d00.y - (d10.y + d01.y);
+        } else if (i0 >= 0) {
+            const Data &d10 = table[k1 + i0];
+            m -= d10.m;
+            x -= d10.x;
+            y -= d10.y;
+        } else if (j0 >= 0) {
+            const Data &d01 = table[k0 + i1];
+            m -= d01.m;
+            x -= d01.x;
+            y -= d01.y;
+        }
+        const Data &d11 = table[k1 + i1];
+        m += d11.m;
+        x += d11.x;
+        y += d11.y;
+    }
+
+    /**
+     * Decide whether a pixel is strong, from the sums over its local window
+     * @tparam use_gain - Whether to use the gain map
+     * @param k - The pixel index
+     * @param m - The number of valid pixels in the window
+     * @param x - The sum of the valid pixel values
+     * @param y - The sum of the squared valid pixel values
+     * @param sink - Passed the intermediate values, if it is enabled
+     */
+    template <bool use_gain, typename Sink>
+    bool is_strong(std::size_t k,
+                   double m,
+                   double x,
+                   double y,
+                   const span<const T> src,
+                   const span<const bool> mask,
+                   Sink &sink) const {
+        bool valid = mask[k] && m >= min_count_ && x >= 0;
+        bool global = src[k] > threshold_;
+        if (!Sink::enabled && !(valid && global)) {
+            return false;
+        }
+        double a, b, c, d;
+        if constexpr (use_gain) {
+            a = m * y - x * x;
+            b = m * src[k] - x;
+            c = gain_[k] * x * (m - 1 + nsig_b_ * std::sqrt(2 * (m - 1)));
+            d = nsig_s_sqrt_gain_[k] * std::sqrt(x * m);
+        } else {
+            a = m * y - x * x - x * (m - 1);
+            b = m * src[k] - x;
+            c = x * nsig_b_ * std::sqrt(2 * (m - 1));
+            d = nsig_s_ * std::sqrt(x * m);
+        }
+        bool strong = valid && global && a > c && b > d;
+        if constexpr (Sink::enabled) {
+            double mean = m > 0 ? x / m : 0;
+            double variance = m > 1 ? (y - x * x / m) / (m - 1) : 0;
+            sink(k,
+                 {.count = m,
+                  .mean = mean,
+                  .variance = variance,
+                  .index_of_dispersion = mean > 0 ? variance / mean : 0,
+                  .cv = valid && a > c,
+                  .value = valid && b > d,
+                  .global = global,
+                  .strong = strong});
+        }
+        return strong;
+    }
+
+    /**
+     * Compute the threshold for part of a row of the image
+     *
+     * Away from the edges of the table, every window corner is at a fixed
+     * offset from the pixel, so with the kernel size known at compile time
+     * the inner loop has no branches and constant offsets.
+     * @tparam use_gain - Whether to use the gain map
+     * @tparam KY, KX - The kernel size, or 0 to use the runtime kernel size
+     * @param table - The summed area table of a box of the image
+     * @param j - The image row
+     * @param begin, end - The range of image columns
+     * @param src - The input array
+     * @param mask - The mask array
+     * @param dst The output array
+     * @param sink - Passed the intermediate values at every pixel, if enabled
+     */
+    template <bool use_gain, int KY, int KX, typename Sink>
+    void threshold_row(span<const Data> table,
+                       Box box,
+                       int j,
+                       int begin,
+                       int end,
+                       const span<const T> src,
+                       const span<const bool> mask,
+                       span<bool> dst,
+                       Sink &sink) {
+        int xsize = image_size_[1];
+        int width = box.x1 - box.x0, height = box.y1 - box.y0;
+
+        // The kernel size
+        const int kxsize = KX ? KX : kernel_size_[1];
+        const int kysize = KY ? KY : kernel_size_[0];
+
+        // Threshold a pixel whose window may be clipped by the table edge
+        auto threshold_clipped = [&](int i) {
+            int k = j * xsize + i;
+            double m, x, y;
+            window_sums(
+              table, width, height, i - box.x0, j - box.y0, kxsize, kysize, m, x, y);
+            dst[k] = is_strong<use_gain>(k, m, x, y, src, mask, sink);
+        };
+
+        // Work in table coordinates from here
+        int tj = j - box.y0;
+        begin -= box.x0;
+        end -= box.x0;
+
+        // The part of the row where the window is inside the table
+        int interior_begin = end, interior_end = end;
+        if (tj - kysize - 1 >= 0 && tj + kysize < height) {
+            interior_begin = std::clamp(kxsize + 1, begin, end);
+            interior_end = std::clamp(width - kxsize, interior_begin, end);
+        }
+
+        for (int i = begin; i < interior_begin; ++i) {
+            threshold_clipped(i + box.x0);
+        }
+        const Data *row0 = table.data() + std::max(0, tj - kysize - 1) * width;
+        const Data *row1 = table.data() + std::min(height - 1, tj + kysize) * width;
+        for (int i = interior_begin; i < interior_end; ++i) {
+            const Data &d00 = row0[i - kxsize - 1];
+            const Data &d10 = row1[i - kxsize - 1];
+            const Data &d01 = row0[i + kxsize];
+            const Data &d11 = row1[i + kxsize];
+            // The same order of operations as window_sums, so that the
+            // results are identical
+            double m = d00.m - (d10.m + d01.m);
+            double x = d00.x - (d10.x + d01.x);
+            double y = d00.y - (d10.y + d01.y);
+            m += d11.m;
+            x += d11.x;
+            y += d11.y;
+
+            std::size_t k = j * xsize + i + box.x0;
+            dst[k] = is_strong<use_gain>(k, m, x, y, src, mask, sink);
+        }
+        for (int i = interior_end; i < end; ++i) {
+            threshold_clipped(i + box.x0);
+        }
+    }
+
     /**
      * Compute the threshold
+     * @tparam use_gain - Whether to use the gain map
+     * @tparam KY, KX - The kernel size, or 0 to use the runtime kernel size
      * @param src - The input array
      * @param mask - The mask array
      * @param dst The output array
+     * @param sink - Passed the intermediate values at every pixel, if enabled
      */
+    template <bool use_gain, int KY, int KX, typename Sink = NullSink>
     void compute_threshold(span<const Data> table,
                            const span<const T> src,
                            const span<const bool> mask,
-                           span<bool> dst) {
-        // Get the size of the image
+                           span<bool> dst,
+                           Sink sink = {}) {
         auto [ysize, xsize] = image_size_;
+        for (int j = 0; j < ysize; ++j) {
+            threshold_row<use_gain, KY, KX>(
+              table, {0, 0, xsize, ysize}, j, 0, xsize, src, mask, dst, sink);
+        }
+    }
 
-        // The kernel size
-        int kxsize = kernel_size_[1];
-        int kysize = kernel_size_[0];
-
-        // Calculate the local mean at every point
-        for (std::size_t j = 0, k = 0; j < ysize; ++j) {
-            for (std::size_t i = 0; i < xsize; ++i, ++k) {
-                int i0 = i - kxsize - 1, i1 = i + kxsize;
-                int j0 = j - kysize - 1, j1 = j + kysize;
-                i1 = i1 < xsize ? i1 : xsize - 1;
-                j1 = j1 < ysize ? j1 : ysize - 1;
-                int k0 = j0 * xsize;
-                int k1 = j1 * xsize;
-
-                // Compute the number of points valid in the local area,
-                // the sum of the pixel values and the sum of the squared pixel
-                // values.
-                double m = 0;
-                double x = 0;
-                double y = 0;
-                if (i0 >= 0 && j0 >= 0) {
-                    const Data &d00 = table[k0 + i0];
-                    const Data &d10 = table[k1 + i0];
-                    const Data &d01 = table[k0 + i1];
-                    m += d00.m - (d10.m + d01.m);
-                    x += d00.x - (d10.x + d01.x);
-                    y += d00.y - (d10.y + d01.y);
-                } else if (i0 >= 0) {
-                    const Data &d10 = table[k1 + i0];
-                    m -= d10.m;
-                    x -= d10.x;
-                    y -= d10.y;
-                } else if (j0 >= 0) {
-                    const Data &d01 = table[k0 + i1];
-                    m -= d01.m;
-                    x -= d01.x;
-                    y -= d01.y;
-                }
-                const Data &d11 = table[k1 + i1];
-                m += d11.m;
-                x += d11.x;
-                y += d11.y;
-
-                // Compute the thresholds
-                dst[k] = false;
-                if (mask[k] && m >= min_count_ && x >= 0 && src[k] > threshold_) {
-                    double a = m * y - x * x - x * (m - 1);
-                    double b = m * src[k] - x;
-                    double c = x * nsig_b_ * std::sqrt(2 * (m - 1));
-                    double d = nsig_s_ * std::sqrt(x * m);
-                    dst[k] = a > c && b > d;
-                }
+    /// Compute the threshold, specialised on the kernel size if it is common
+    template <bool use_gain>
+    void dispatch_threshold(span<const Data> table,
+                            const span<const T> src,
+                            const span<const bool> mask,
+                            span<bool> dst) {
+        if (kernel_size_[0] == kernel_size_[1]) {
+            switch (kernel_size_[0]) {
+            case 1:
+                return compute_threshold<use_gain, 1, 1>(table, src, mask, dst);
+            case 2:
+                return compute_threshold<use_gain, 2, 2>(table, src, mask, dst);
+            case 3:
+                return compute_threshold<use_gain, 3, 3>(table, src, mask, dst);
+            case 4:
+                return compute_threshold<use_gain, 4, 4>(table, src, mask, dst);
+            case 5:
+                return compute_threshold<use_gain, 5, 5>(table, src, mask, dst);
             }
         }
+        compute_threshold<use_gain, 0, 0>(table, src, mask, dst);
     }
 
     /**
@@ -198,7 +416,200 @@ class DispersionThreshold {
 
         // Compute the image threshold
         auto table_span = span<Data>{table_.data(), table_.size()};
-        compute_threshold(table_span, src, mask, dst);
+        if (gain_.empty()) {
+            dispatch_threshold<false>(table_span, src, mask, dst);
+        } else {
+            dispatch_threshold<true>(table_span, src, mask, dst);
+        }
+    }
+
+    /**
+     * Compute the threshold only for the pixels in a list of row spans, and
+     * mark every other pixel as not strong.
+     *
+     * The spans are split into bands of nearby rows, and the summed area
+     * table only covers the bounding box of each band plus the kernel, so a
+     * small region takes proportionally less time.
+     */
+    void threshold(const span<const T> src,
+                   const span<const bool> mask,
+                   span<bool> dst,
+                   const span<const SpotfinderRegion::Span> spans) {
+        assert(src.size() >= image_size_[0] * image_size_[1]);
+        assert(src.size() == mask.size());
+        assert(src.size() == dst.size());
+
+        std::fill(dst.begin(), dst.end(), false);
+
+        auto [ysize, xsize] = image_size_;
+        auto [kysize, kxsize] = kernel_size_;
+        spans_.assign(spans.begin(), spans.end());
+        std::sort(spans_.begin(), spans_.end(), [](const auto &a, const auto &b) {
+            return a.y < b.y;
+        });
+
+        for (auto band_begin = spans_.begin(); band_begin != spans_.end();) {
+            // Rows close enough to share a table, and that table's box
+            int first_row = band_begin->y;
+            Box box{xsize, first_row, 0, first_row + 1};
+            auto band_end = band_begin;
+            for (; band_end != spans_.end()
+                   && band_end->y <= static_cast<std::size_t>(box.y1 + 2 * kysize + 1);
+                 ++band_end) {
+                assert(band_end->y < ysize && band_end->x_end <= xsize);
+                box.x0 = std::min<int>(box.x0, band_end->x_begin);
+                box.x1 = std::max<int>(box.x1, band_end->x_end);
+                box.y1 = band_end->y + 1;
+            }
+            box.x0 = std::max(0, box.x0 - kxsize);
+            box.y0 = std::max(0, box.y0 - kysize);
+            box.x1 = std::min(xsize, box.x1 + kxsize);
+            box.y1 = std::min(ysize, box.y1 + kysize);
+
+            auto table = span<Data>{table_.data(),
+                                    static_cast<std::size_t>(box.x1 - box.x0)
+                                      * (box.y1 - box.y0)};
+            compute_sat(table, src, mask, box);
+            NullSink sink;
+            for (auto row = band_begin; row != band_end; ++row) {
+                int j = row->y, begin = row->x_begin, end = row->x_end;
+                if (gain_.empty()) {
+                    threshold_row<false, 0, 0>(
+                      table, box, j, begin, end, src, mask, dst, sink);
+                } else {
+                    threshold_row<true, 0, 0>(
+                      table, box, j, begin, end, src, mask, dst, sink);
+                }
+            }
+            band_begin = band_end;
+        }
+    }
+
+    /**
+     * Count the strong pixels in every stride-th row, stopping as soon as
+     * the count reaches a limit. Only the rows counted are written to dst.
+     *
+     * If the windows of neighbouring counted rows overlap, a block of rows
+     * shares a summed area table; otherwise each row has a table of just
+     * its window, so the image rows between them are never read.
+     * @param stride - Count rows 0, stride, 2 * stride...
+     * @param limit - Stop once this many strong pixels have been counted
+     * @returns The number of strong pixels, and the number of rows counted
+     */
+    auto count_strong(const span<const T> src,
+                      const span<const bool> mask,
+                      span<bool> dst,
+                      int stride,
+                      std::size_t limit) -> std::pair<std::size_t, int> {
+        assert(src.size() >= image_size_[0] * image_size_[1]);
+        assert(src.size() == mask.size());
+        assert(src.size() == dst.size());
+        assert(stride > 0);
+
+        auto [ysize, xsize] = image_size_;
+        auto kysize = kernel_size_[0];
+        // Rows per table, few enough that a hit stops soon after the limit
+        int block = stride > 2 * kysize + 1 ? 1 : std::max(1, 64 / stride);
+
+        std::size_t count = 0;
+        int rows = 0;
+        NullSink sink;
+        for (int first = 0; first < ysize; first += block * stride) {
+            int last = std::min(ysize - 1, first + (block - 1) * stride);
+            // Starting a row early puts the whole first window inside the
+            // table, so that the row takes the fast path
+            Box box{0,
+                    std::max(0, first - kysize - 1),
+                    xsize,
+                    std::min(ysize, last + kysize + 1)};
+            auto table = span<Data>{
+              table_.data(), static_cast<std::size_t>(xsize) * (box.y1 - box.y0)};
+            compute_sat(table, src, mask, box);
+            for (int j = first; j <= last; j += stride) {
+                if (gain_.empty()) {
+                    threshold_row<false, 0, 0>(
+                      table, box, j, 0, xsize, src, mask, dst, sink);
+                } else {
+                    threshold_row<true, 0, 0>(
+                      table, box, j, 0, xsize, src, mask, dst, sink);
+                }
+                auto row = dst.begin() + static_cast<std::size_t>(j) * xsize;
+                count += std::count(row, row + xsize, true);
+                ++rows;
+                if (count >= limit) {
+                    return {count, rows};
+                }
+            }
+        }
+        return {count, rows};
+    }
+
+    /**
+     * Compute the threshold, also passing the intermediate values at every
+     * pixel to a sink. This is a separate instantiation of the threshold,
+     * so the sink costs nothing when it isn't used.
+     */
+    template <typename Sink>
+    void threshold(const span<const T> src,
+                   const span<const bool> mask,
+                   span<bool> dst,
+                   Sink sink) {
+        assert(src.size() >= image_size_[0] * image_size_[1]);
+        assert(src.size() == mask.size());
+        assert(src.size() == dst.size());
+
+        compute_sat(table_, src, mask);
+        auto table_span = span<Data>{table_.data(), table_.size()};
+        if (gain_.empty()) {
+            compute_threshold<false, 0, 0>(table_span, src, mask, dst, sink);
+        } else {
+            compute_threshold<true, 0, 0>(table_span, src, mask, dst, sink);
+        }
+    }
+
+    /**
+     * Decide whether one pixel is strong, summing its window directly, for
+     * checking a few pixels. This makes the same decision as threshold, up
+     * to rounding.
+     */
+    bool is_strong_at(const span<const T> src,
+                      const span<const bool> mask,
+                      std::size_t k) const {
+        const T BIG = (1 << 24);
+        auto [ysize, xsize] = image_size_;
+        auto [kysize, kxsize] = kernel_size_;
+        int i = k % xsize, j = k / xsize;
+        int i0 = std::max(0, i - kxsize), i1 = std::min(xsize, i + kxsize + 1);
+        int j0 = std::max(0, j - kysize), j1 = std::min(ysize, j + kysize + 1);
+        double m = 0, x = 0, y = 0;
+        for (int jj = j0; jj < j1; ++jj) {
+            std::size_t row = static_cast<std::size_t>(jj) * xsize;
+            for (int ii = i0; ii < i1; ++ii) {
+                bool valid = mask[row + ii] & (src[row + ii] < BIG);
+                double value = valid ? src[row + ii] : 0;
+                m += valid;
+                x += value;
+                y += value * value;
+            }
+        }
+        NullSink sink;
+        if (gain_.empty()) {
+            return is_strong<false>(k, m, x, y, src, mask, sink);
+        } else {
+            return is_strong<true>(k, m, x, y, src, mask, sink);
+        }
+    }
+
+    auto image_size() const -> std::array<int, 2> {
+        return image_size_;
+    }
+
+    auto min_count() const -> int {
+        return min_count_;
+    }
+    /// The gain map, or empty for unit gain
+    auto gain() const -> span<const float> {
+        return {gain_.data(), gain_.size()};
     }
 
   private:
@@ -209,10 +620,406 @@ class DispersionThreshold {
     double threshold_;
     int min_count_;
     std::vector<Data> table_;
+    std::vector<SpotfinderRegion::Span> spans_;
+    // The gain of each pixel, and nsig_s * sqrt(gain). Empty for unit gain.
+    std::vector<float> gain_;
+    std::vector<T> nsig_s_sqrt_gain_;
+};
+
+/**
+ * Sums over the local window around every pixel, for the local threshold
+ * methods.
+ *
+ * The window sums are built a row at a time from running column sums, so
+ * each method is a single pass over the image with no intermediate images.
+ * The sums are accumulated in double, so are exact for integer counts.
+ */
+template <typename T>
+class LocalMoments {
+  public:
+    /// The number of valid pixels, and their sum and sum of squares
+    struct Moments {
+        double m = 0;
+        double x = 0;
+        double y = 0;
+    };
+
+    LocalMoments(std::array<int, 2> image_size, std::array<int, 2> kernel_size)
+        : image_size_(image_size), kernel_size_(kernel_size) {
+        assert(image_size[0] > 0 && image_size[1] > 0);
+        assert(kernel_size[0] > 0 && kernel_size[1] > 0);
+        columns_.resize(image_size[1]);
+    }
+
+    /// The number of pixels in a whole window
+    auto window_size() const -> int {
+        return (2 * kernel_size_[0] + 1) * (2 * kernel_size_[1] + 1);
+    }
+
+    /**
+     * Call visit(k, moments) for every pixel k, in order.
+     *
+     * Windows are clipped at the image edges.
+     * @param src - The input array
+     * @param mask - The pixels to include, or empty to include all of them
+     */
+    template <typename Visit>
+    void for_each(const span<const T> src, const span<const bool> mask, Visit &&visit) {
+        auto [ysize, xsize] = image_size_;
+        auto [kysize, kxsize] = kernel_size_;
+        assert(src.size() >= ysize * xsize);
+        assert(mask.empty() || mask.size() == src.size());
+
+        // Add (or with -1, remove) a row of the image to the column sums
+        auto add_row = [&](int j, double sign) {
+            std::size_t k = j * xsize;
+            for (int i = 0; i < xsize; ++i, ++k) {
+                double v = src[k];
+                double w = (mask.empty() || mask[k]) ? sign : 0;
+                columns_[i].m += w;
+                columns_[i].x += w * v;
+                columns_[i].y += w * v * v;
+            }
+        };
+
+        std::fill(columns_.begin(), columns_.end(), Moments{});
+        for (int j = 0; j <= kysize && j < ysize; ++j) {
+            add_row(j, 1);
+        }
+        for (int j = 0; j < ysize; ++j) {
+            // Slide the window along the row
+            Moments window;
+            for (int i = 0; i <= kxsize && i < xsize; ++i) {
+                window.m += columns_[i].m;
+                window.x += columns_[i].x;
+                window.y += columns_[i].y;
+            }
+            for (int i = 0; i < xsize; ++i) {
+                visit(static_cast<std::size_t>(j) * xsize + i, window);
+                if (i + kxsize + 1 < xsize) {
+                    const Moments &add = columns_[i + kxsize + 1];
+                    window.m += add.m;
+                    window.x += add.x;
+                    window.y += add.y;
+                }
+                if (i - kxsize >= 0) {
+                    const Moments &remove = columns_[i - kxsize];
+                    window.m -= remove.m;
+                    window.x -= remove.x;
+                    window.y -= remove.y;
+                }
+            }
+            // Move the band of rows down
+            if (j + kysize + 1 < ysize) add_row(j + kysize + 1, 1);
+            if (j - kysize >= 0) add_row(j - kysize, -1);
+        }
+    }
+
+  private:
+    std::array<int, 2> image_size_;
+    std::array<int, 2> kernel_size_;
+    std::vector<Moments> columns_;
+};
+
+/*
+ * The local threshold methods, as in DIALS local.h. The unmasked methods
+ * treat pixels outside the image as zero, so every window has the whole
+ * window size.
+ */
+
+/// pixel > mean + n_sigma * sdev
+template <typename T>
+void niblack(LocalMoments<T> &moments,
+             const span<const T> src,
+             double n_sigma,
+             span<bool> dst) {
+    assert(n_sigma >= 0);
+    double n = moments.window_size();
+    assert(n > 1);
+    moments.for_each(src, {}, [&](std::size_t k, const auto &w) {
+        double mean = w.x / n;
+        double var = (w.y - w.x * w.x / n) / (n - 1);
+        dst[k] = src[k] > mean + n_sigma * std::sqrt(var);
+    });
+}
+
+/// pixel > mean * (1 + k * (sdev / r - 1))
+template <typename T>
+void sauvola(LocalMoments<T> &moments,
+             const span<const T> src,
+             double k,
+             double r,
+             span<bool> dst) {
+    assert(k >= 0 && r > 1);
+    double n = moments.window_size();
+    assert(n > 1);
+    moments.for_each(src, {}, [&](std::size_t i, const auto &w) {
+        double mean = w.x / n;
+        double var = (w.y - w.x * w.x / n) / (n - 1);
+        dst[i] = src[i] > mean * (1.0 + k * (std::sqrt(var) / r - 1));
+    });
+}
+
+/// var / mean > 1 + n_sigma * sqrt(2 / (n - 1))
+template <typename T>
+void index_of_dispersion(LocalMoments<T> &moments,
+                         const span<const T> src,
+                         double n_sigma,
+                         span<bool> dst) {
+    assert(n_sigma >= 0);
+    double n = moments.window_size();
+    assert(n > 1);
+    double bound = 1.0 + n_sigma * std::sqrt(2.0 / (n - 1));
+    moments.for_each(src, {}, [&](std::size_t k, const auto &w) {
+        double mean = w.x / n;
+        double var = (w.y - w.x * w.x / n) / (n - 1);
+        dst[k] = mean > 0 && var / mean > bound;
+    });
+}
+
+/**
+ * var / mean > 1 + n_sigma * sqrt(2 / (n - 1)), over the masked pixels.
+ * Pixels with fewer than min_count valid pixels in their window are never
+ * strong.
+ */
+template <typename T>
+void index_of_dispersion_masked(LocalMoments<T> &moments,
+                                const span<const T> src,
+                                const span<const bool> mask,
+                                int min_count,
+                                double n_sigma,
+                                span<bool> dst) {
+    assert(n_sigma >= 0);
+    assert(min_count > 1);
+    moments.for_each(src, mask, [&](std::size_t k, const auto &w) {
+        double mean = w.x / w.m;
+        double var = (w.y - w.x * w.x / w.m) / (w.m - 1);
+        double bound = 1.0 + n_sigma * std::sqrt(2.0 / (w.m - 1));
+        dst[k] = mask[k] && w.m >= min_count && mean > 0 && var / mean > bound;
+    });
+}
+
+/**
+ * As in XDS, with a gain map:
+ *
+ * var / mean > g + nsig_b * g * sqrt(2 / (n - 1)) &&
+ * pixel > mean + nsig_s * sqrt(g * mean)
+ *
+ * @param gain - The gain map, or empty for unit gain
+ */
+template <typename T>
+void dispersion_w_gain(LocalMoments<T> &moments,
+                       const span<const T> src,
+                       const span<const bool> mask,
+                       const span<const float> gain,
+                       int min_count,
+                       double nsig_b,
+                       double nsig_s,
+                       span<bool> dst) {
+    assert(nsig_b >= 0 && nsig_s >= 0);
+    assert(min_count > 1);
+    assert(gain.empty() || gain.size() == src.size());
+    moments.for_each(src, mask, [&](std::size_t k, const auto &w) {
+        double g = gain.empty() ? 1.0 : gain[k];
+        double mean = w.x / w.m;
+        double var = (w.y - w.x * w.x / w.m) / (w.m - 1);
+        double bound_b = g + nsig_b * g * std::sqrt(2.0 / (w.m - 1));
+        double bound_s = mean + nsig_s * std::sqrt(g * mean);
+        dst[k] = mask[k] && w.m >= min_count && mean > 0 && var / mean > bound_b
+                 && src[k] > bound_s;
+    });
+}
+
+/**
+ * A per-pixel background that follows the images of a sweep, as an
+ * exponentially weighted mean of each pixel over the frames.
+ *
+ * The model is seeded from the local window means of a full dispersion
+ * threshold. After that, only pixels that are far enough above their own
+ * background to pass the strong pixel value test are candidates, and only
+ * the candidates are given the full test, so most pixels need no window
+ * sums. Strong pixels don't update the model, so spots don't leak into it.
+ */
+class TemporalBackground {
+  public:
+    /// A sink for DispersionThreshold that replaces the model
+    struct Seed {
+        static constexpr bool enabled = true;
+        TemporalBackground *model;
+
+        void operator()(std::size_t k, const PixelIntermediates &p) {
+            model->mean_[k] = p.mean;
+        }
+    };
+
+    /// Start a new model for an image of size pixels
+    auto seed(std::size_t size) -> Seed {
+        mean_.resize(size);
+        frames_ = 1;
+        return {this};
+    }
+
+    /// Frames since the model was seeded, or zero if it hasn't been
+    auto frames() const -> int {
+        return frames_;
+    }
+    void reset() {
+        frames_ = 0;
+    }
+
+    /**
+     * Threshold an image against the model, then add the image to it.
+     *
+     * A pixel is a candidate if it is more than nsig_s * sqrt(gain * mean)
+     * above its background mean, as in the dispersion value test.
+     * Candidates are confirmed once the rows below them have been read, so
+     * that their windows are still in cache.
+     * @param width - The image width
+     * @param kysize - The window half-height
+     * @param gain - The gain map, or empty for unit gain
+     * @param alpha - The weight of this image in the updated model
+     * @param confirm - Called as confirm(k) to decide if a candidate is strong
+     */
+    template <typename T, typename Confirm>
+    void threshold(const span<const T> src,
+                   const span<const bool> mask,
+                   std::size_t width,
+                   std::size_t kysize,
+                   const span<const float> gain,
+                   double nsig_s,
+                   double alpha,
+                   span<bool> dst,
+                   Confirm &&confirm) {
+        assert(frames_ > 0);
+        assert(src.size() == mean_.size() && mask.size() == src.size());
+        assert(gain.empty() || gain.size() == src.size());
+        assert(alpha > 0 && alpha <= 1);
+
+        const float nsig_s2 = nsig_s * nsig_s;
+        const float a = alpha;
+        // Strong candidates are left out of the model, unless not confirmed
+        auto check = [&](std::size_t k) {
+            dst[k] = confirm(k);
+            if (!dst[k]) mean_[k] += a * (static_cast<float>(src[k]) - mean_[k]);
+        };
+
+        candidates_.clear();
+        std::size_t next = 0;
+        std::size_t height = src.size() / width;
+        for (std::size_t j = 0, k = 0; j < height; ++j) {
+            for (std::size_t i = 0; i < width; ++i, ++k) {
+                float value = src[k];
+                float mean = mean_[k];
+                float poisson = gain.empty() ? mean : gain[k] * mean;
+                // Without branches (or a square root) for the common case, as
+                // there's no predicting which way the noise goes
+                float d = value - mean;
+                bool candidate = mask[k] & (d > 0) & (d * d > nsig_s2 * poisson);
+                if (candidate) candidates_.push_back(k);
+                dst[k] = false;
+                float w = a * static_cast<float>(mask[k] & !candidate);
+                mean_[k] = mean + w * d;
+            }
+            // Candidates whose windows end on this row
+            std::size_t done = (j + 1 > kysize ? j + 1 - kysize : 0) * width;
+            for (; next < candidates_.size() && candidates_[next] < done; ++next) {
+                check(candidates_[next]);
+            }
+        }
+        for (; next < candidates_.size(); ++next) {
+            check(candidates_[next]);
+        }
+        ++frames_;
+    }
+
+  private:
+    std::vector<float> mean_;
+    std::vector<std::size_t> candidates_;
+    int frames_ = 0;
+};
+
+/// Copies the intermediate values inside a rectangle into a
+/// DispersionIntermediates
+struct RoiSink {
+    static constexpr bool enabled = true;
+    DispersionIntermediates *out;
+    std::size_t image_width;
+
+    void operator()(std::size_t k, const PixelIntermediates &p) {
+        std::size_t x = k % image_width, y = k / image_width;
+        if (x < out->x || x >= out->x + out->width || y < out->y
+            || y >= out->y + out->height) {
+            return;
+        }
+        std::size_t i = (y - out->y) * out->width + (x - out->x);
+        out->count[i] = p.count;
+        out->mean[i] = p.mean;
+        out->variance[i] = p.variance;
+        out->index_of_dispersion[i] = p.index_of_dispersion;
+        out->cv_mask[i] = p.cv;
+        out->value_mask[i] = p.value;
+        out->global_mask[i] = p.global;
+        out->strong[i] = p.strong;
+    }
 };
 
 }  // namespace no_tbx
 
+void SpotfinderRegion::add_rectangle(size_t x,
+                                     size_t y,
+                                     size_t rect_width,
+                                     size_t rect_height) {
+    size_t x_end = std::min(width, x + rect_width);
+    if (x >= x_end) return;
+    for (size_t row = y; row < std::min(height, y + rect_height); ++row) {
+        _spans.push_back({row, x, x_end});
+    }
+}
+
+void SpotfinderRegion::add_annulus(double centre_x,
+                                   double centre_y,
+                                   double r_inner,
+                                   double r_outer) {
+    assert(r_inner >= 0 && r_outer >= r_inner);
+    // Add pixels [begin, end) of a row, after clipping to the image
+    auto add = [&](size_t row, double begin, double end) {
+        begin = std::clamp(begin, 0.0, static_cast<double>(width));
+        end = std::clamp(end, 0.0, static_cast<double>(width));
+        if (begin < end) {
+            _spans.push_back(
+              {row, static_cast<size_t>(begin), static_cast<size_t>(end)});
+        }
+    };
+    double first_row = std::max(0.0, std::floor(centre_y - r_outer));
+    double last_row =
+      std::min(static_cast<double>(height), std::ceil(centre_y + r_outer));
+    for (size_t row = first_row; row < last_row; ++row) {
+        double dy = row + 0.5 - centre_y;
+        if (std::abs(dy) >= r_outer) continue;
+        // Pixel centres x + 0.5 with |x + 0.5 - centre_x| < outer are inside
+        // the outer circle, and with |x + 0.5 - centre_x| < inner are
+        // inside the hole
+        double outer = std::sqrt(r_outer * r_outer - dy * dy);
+        double left = std::floor(centre_x - outer - 0.5) + 1;
+        double right = std::ceil(centre_x + outer - 0.5);
+        if (std::abs(dy) >= r_inner) {
+            add(row, left, right);
+        } else {
+            double inner = std::sqrt(r_inner * r_inner - dy * dy);
+            add(row, left, std::floor(centre_x - inner - 0.5) + 1);
+            add(row, std::ceil(centre_x + inner - 0.5), right);
+        }
+    }
+}
+
+auto SpotfinderRegion::resolution_radius(double d,
+                                         double wavelength,
+                                         double distance,
+                                         double pixel_size) -> double {
+    double two_theta = 2 * std::asin(wavelength / (2 * d));
+    return distance * std::tan(two_theta) / pixel_size;
+}
+
 template class StandaloneSpotfinder<float>;
 template class StandaloneSpotfinder<double>;
 
@@ -225,31 +1032,54 @@ void StandaloneSpotfinder<T>::StandaloneSpotfinderImplDeleter::operator()(
 template <typename T>
 class StandaloneSpotfinder<T>::StandaloneSpotfinderImpl {
   public:
-    StandaloneSpotfinderImpl(size_t width, size_t height)
+    StandaloneSpotfinderImpl(size_t width,
+                             size_t height,
+                             const spotfinder_params &params)
         : width(width),
           height(height),
           results(width * height),
+          params(params),
           algorithm({static_cast<int>(height), static_cast<int>(width)},
-                    kernel_size_,
-                    nsig_b_,
-                    nsig_s_,
-                    threshold_,
-                    min_count_) {}
+                    {params.kernel_size[0], params.kernel_size[1]},
+                    params.nsig_b,
+                    params.nsig_s,
+                    params.threshold,
+                    params.min_count),
+          moments({static_cast<int>(height), static_cast<int>(width)},
+                  {params.kernel_size[0], params.kernel_size[1]}) {}
+
+    auto results_span() -> span<bool> {
+        return {reinterpret_cast<bool *>(results.data()), results.size()};
+    }
 
     size_t width;
     size_t height;
-    std::vector<uint8_t> results;
+    std::vector<uint8_t, HugePageAllocator<uint8_t>> results;
+    spotfinder_params params;
     no_tbx::DispersionThreshold<T> algorithm;
+    no_tbx::LocalMoments<T> moments;
+    no_tbx::TemporalBackground background;
 };
 
 template <typename T>
-StandaloneSpotfinder<T>::StandaloneSpotfinder(size_t width, size_t height) {
+StandaloneSpotfinder<T>::StandaloneSpotfinder(size_t width, size_t height)
+    : StandaloneSpotfinder(width, height, default_params()) {}
+
+template <typename T>
+StandaloneSpotfinder<T>::StandaloneSpotfinder(size_t width,
+                                              size_t height,
+                                              const spotfinder_params &params) {
     // Can't use make_unique with custom deleter
-    auto obj = new StandaloneSpotfinderImpl(width, height);
+    auto obj = new StandaloneSpotfinderImpl(width, height, params);
     impl =
       std::unique_ptr<StandaloneSpotfinderImpl, StandaloneSpotfinderImplDeleter>(obj);
 }
 
+template <typename T>
+void StandaloneSpotfinder<T>::set_gain(const span<const float> gain) {
+    impl->algorithm.set_gain(gain);
+}
+
 template <typename T>
 auto StandaloneSpotfinder<T>::standard_dispersion(const span<const T> image,
                                                   const span<const bool> mask)
@@ -274,3 +1104,208 @@ auto StandaloneSpotfinder<T>::standard_dispersion(const span<const T> image,
 
     return results;
 }
+
+template <typename T>
+auto StandaloneSpotfinder<T>::niblack(const span<const T> image, double n_sigma)
+  -> span<const bool> {
+    no_tbx::niblack(impl->moments, image, n_sigma, impl->results_span());
+    return impl->results_span();
+}
+template <typename T>
+auto StandaloneSpotfinder<T>::sauvola(const span<const T> image, double k, double r)
+  -> span<const bool> {
+    no_tbx::sauvola(impl->moments, image, k, r, impl->results_span());
+    return impl->results_span();
+}
+template <typename T>
+auto StandaloneSpotfinder<T>::index_of_dispersion(const span<const T> image,
+                                                  double n_sigma)
+  -> span<const bool> {
+    no_tbx::index_of_dispersion(impl->moments, image, n_sigma, impl->results_span());
+    return impl->results_span();
+}
+template <typename T>
+auto StandaloneSpotfinder<T>::index_of_dispersion_masked(const span<const T> image,
+                                                         const span<const bool> mask,
+                                                         double n_sigma)
+  -> span<const bool> {
+    no_tbx::index_of_dispersion_masked(impl->moments,
+                                       image,
+                                       mask,
+                                       impl->algorithm.min_count(),
+                                       n_sigma,
+                                       impl->results_span());
+    return impl->results_span();
+}
+template <typename T>
+auto StandaloneSpotfinder<T>::dispersion_w_gain(const span<const T> image,
+                                                const span<const bool> mask)
+  -> span<const bool> {
+    no_tbx::dispersion_w_gain(impl->moments,
+                              image,
+                              mask,
+                              impl->algorithm.gain(),
+                              impl->algorithm.min_count(),
+                              impl->params.nsig_b,
+                              impl->params.nsig_s,
+                              impl->results_span());
+    return impl->results_span();
+}
+
+template <typename T>
+auto StandaloneSpotfinder<T>::standard_dispersion(const span<const T> image,
+                                                  const span<const bool> mask,
+                                                  const SpotfinderRegion &region)
+  -> span<const bool> {
+    impl->algorithm.threshold(image, mask, impl->results_span(), region.spans());
+    return impl->results_span();
+}
+
+template <typename T>
+auto StandaloneSpotfinder<T>::standard_dispersion_intermediates(
+  const span<const T> image,
+  const span<const bool> mask,
+  size_t x,
+  size_t y,
+  size_t width,
+  size_t height) -> DispersionIntermediates {
+    // Clip the rectangle to the image
+    x = std::min(x, impl->width);
+    y = std::min(y, impl->height);
+    width = std::min(width, impl->width - x);
+    height = std::min(height, impl->height - y);
+
+    DispersionIntermediates out;
+    out.x = x;
+    out.y = y;
+    out.width = width;
+    out.height = height;
+    size_t size = width * height;
+    for (auto *values :
+         {&out.count, &out.mean, &out.variance, &out.index_of_dispersion}) {
+        values->resize(size);
+    }
+    for (auto *masks : {&out.cv_mask, &out.value_mask, &out.global_mask, &out.strong}) {
+        masks->resize(size);
+    }
+    impl->algorithm.threshold(
+      image, mask, impl->results_span(), no_tbx::RoiSink{&out, impl->width});
+    return out;
+}
+
+template <typename T>
+auto StandaloneSpotfinder<T>::temporal_dispersion(
+  const span<const T> image,
+  const span<const bool> mask,
+  const TemporalBackgroundParams &params) -> span<const bool> {
+    assert(params.refresh_interval > 0);
+    auto &background = impl->background;
+    if (background.frames() == 0 || background.frames() >= params.refresh_interval) {
+        impl->algorithm.threshold(
+          image, mask, impl->results_span(), background.seed(image.size()));
+    } else {
+        auto &algorithm = impl->algorithm;
+        auto confirm = [&](size_t k) { return algorithm.is_strong_at(image, mask, k); };
+        background.threshold(image,
+                             mask,
+                             impl->width,
+                             impl->params.kernel_size[0],
+                             algorithm.gain(),
+                             impl->params.nsig_s,
+                             params.alpha,
+                             impl->results_span(),
+                             confirm);
+    }
+    return impl->results_span();
+}
+
+template <typename T>
+void StandaloneSpotfinder<T>::reset_temporal_background() {
+    impl->background.reset();
+}
+
+template <typename T>
+auto StandaloneSpotfinder<T>::find_hit(const span<const T> image,
+                                       const span<const bool> mask,
+                                       size_t min_strong_pixels,
+                                       size_t stride) -> HitResult {
+    assert(stride > 0);
+    // The count in the rows thresholded that scales up to the threshold
+    size_t limit = min_strong_pixels / stride + (min_strong_pixels % stride != 0);
+    auto [count, rows] = impl->algorithm.count_strong(
+      image, mask, impl->results_span(), static_cast<int>(stride), limit);
+    return {.hit = count >= limit,
+            .strong_pixels = count * stride,
+            .rows = static_cast<size_t>(rows)};
+}
+
+/// The state behind the standalone C API
+struct StandaloneContext {
+    StandaloneContext(size_t width, size_t height, const spotfinder_params &params)
+        : finder(width, height, params),
+          params(params),
+          width(width),
+          height(height),
+          converted(width * height) {}
+
+    /// Convert rows [y0, y1) of an image to double
+    void convert(const image_t *image, size_t y0, size_t y1) {
+        std::copy(image->data + y0 * width,
+                  image->data + y1 * width,
+                  converted.begin() + y0 * width);
+    }
+    auto mask(const image_t *image) const -> span<const bool> {
+        return {reinterpret_cast<const bool *>(image->mask), width * height};
+    }
+
+    StandaloneSpotfinder<double> finder;
+    spotfinder_params params;
+    size_t width, height;
+    std::vector<double, HugePageAllocator<double>> converted;
+};
+
+void *standalone_spotfinder_create(size_t width,
+                                   size_t height,
+                                   const spotfinder_params *params) {
+    auto defaults = StandaloneSpotfinder<double>::default_params();
+    return new StandaloneContext(width, height, params ? *params : defaults);
+}
+void standalone_spotfinder_free(void *context) {
+    delete reinterpret_cast<StandaloneContext *>(context);
+}
+
+void standalone_spotfinder_set_gain(void *context, const float *gain, size_t size) {
+    auto ctx = reinterpret_cast<StandaloneContext *>(context);
+    ctx->finder.set_gain(gain ? span<const float>{gain, size} : span<const float>{});
+}
+
+uint32_t standalone_spotfinder_standard_dispersion(void *context,
+                                                   image_t *image,
+                                                   bool **destination) {
+    auto ctx = reinterpret_cast<StandaloneContext *>(context);
+    ctx->convert(image, 0, ctx->height);
+    auto results = ctx->finder.standard_dispersion(ctx->converted, ctx->mask(image));
+    if (destination != nullptr) *destination = const_cast<bool *>(results.data());
+    return std::count(results.begin(), results.end(), true);
+}
+
+bool standalone_spotfinder_find_hit(void *context,
+                                    image_t *image,
+                                    uint32_t min_strong_pixels,
+                                    uint32_t stride,
+                                    uint32_t *strong_pixels) {
+    auto ctx = reinterpret_cast<StandaloneContext *>(context);
+    // C callers can't be relied on to pass a valid stride
+    stride = std::max<uint32_t>(stride, 1);
+    // Only convert the rows that the thresholded rows' windows can read
+    size_t ky = ctx->params.kernel_size[0];
+    for (size_t j = 0, converted = 0; j < ctx->height; j += stride) {
+        size_t y0 = std::max(converted, j > ky + 1 ? j - ky - 1 : 0);
+        converted = std::min(ctx->height, j + ky + 1);
+        if (y0 < converted) ctx->convert(image, y0, converted);
+    }
+    auto result =
+      ctx->finder.find_hit(ctx->converted, ctx->mask(image), min_strong_pixels, stride);
+    if (strong_pixels != nullptr) *strong_pixels = result.strong_pixels;
+    return result.hit;
+}
@@ -9,8 +9,82 @@ using tcb::span;
 using std::span;
 #endif
 
+#include <cstdint>
 #include <memory>
 #include <type_traits>
+#include <vector>
+
+#include "spotfinder_params.h"
+
+/// A region of the image to find spots in, as a list of runs of pixels
+class SpotfinderRegion {
+  public:
+    /// Pixels [x_begin, x_end) of row y
+    struct Span {
+        size_t y;
+        size_t x_begin;
+        size_t x_end;
+    };
+
+    SpotfinderRegion(size_t width, size_t height) : width(width), height(height) {}
+
+    /// Add a rectangle, clipped to the image
+    void add_rectangle(size_t x, size_t y, size_t rect_width, size_t rect_height);
+    /// Add the pixels with centres from r_inner up to r_outer away from a
+    /// point, e.g. a resolution shell around the beam centre. Positions are
+    /// in pixels, with the first pixel covering 0 to 1.
+    void add_annulus(double centre_x, double centre_y, double r_inner, double r_outer);
+
+    /// The distance in pixels from the beam centre to resolution d, on a flat
+    /// detector normal to the beam. All lengths in the same units as d, other
+    /// than the pixel size, which is in the units of distance.
+    static auto resolution_radius(double d,
+                                  double wavelength,
+                                  double distance,
+                                  double pixel_size) -> double;
+
+    auto spans() const -> span<const Span> {
+        return {_spans.data(), _spans.size()};
+    }
+
+  private:
+    size_t width, height;
+    std::vector<Span> _spans;
+};
+
+/// The intermediate values of standard_dispersion over a rectangle of the
+/// image, for debugging. Each array is height x width, in row order.
+struct DispersionIntermediates {
+    size_t x, y;  ///< The first pixel of the rectangle
+    size_t width, height;
+    std::vector<double> count;  ///< Valid pixels in each window
+    std::vector<double> mean;
+    std::vector<double> variance;
+    std::vector<double> index_of_dispersion;
+    std::vector<uint8_t> cv_mask;      ///< Passes the index of dispersion test
+    std::vector<uint8_t> value_mask;   ///< Passes the strong pixel value test
+    std::vector<uint8_t> global_mask;  ///< Above the global threshold
+    std::vector<uint8_t> strong;       ///< The result
+};
+
+/// The result of StandaloneSpotfinder::find_hit
+struct HitResult {
+    bool hit;
+    /// Strong pixels counted, times the stride. For a hit this stops at
+    /// about the threshold, so is a lower bound.
+    size_t strong_pixels;
+    size_t rows;  ///< Image rows thresholded
+};
+
+/// Settings for StandaloneSpotfinder::temporal_dispersion
+struct TemporalBackgroundParams {
+    /// The weight of each new frame in the background, about one over the
+    /// number of frames averaged
+    double alpha = 0.1;
+    /// Frames between full dispersion thresholds, which reseed the
+    /// background so that it can't drift
+    int refresh_interval = 50;
+};
 
 template <typename T = double>
 class StandaloneSpotfinder {
@@ -26,12 +100,84 @@ class StandaloneSpotfinder {
     std::unique_ptr<StandaloneSpotfinderImpl, StandaloneSpotfinderImplDeleter> impl;
 
   public:
+    /// The working buffers are huge-page backed, on the NUMA node of the
+    /// constructing thread, so construct on the thread that will use it.
     StandaloneSpotfinder(size_t width, size_t height);
+    StandaloneSpotfinder(size_t width, size_t height, const spotfinder_params& params);
+
+    /// The DIALS default parameters
+    static auto default_params() -> spotfinder_params {
+        spotfinder_params params;
+        spotfinder_default_params(&params);
+        return params;
+    }
+
+    /// Use a per-pixel detector gain map (all positive) in every following
+    /// threshold, like DIALS threshold_w_gain. An empty span returns to
+    /// unit gain.
+    void set_gain(const span<const float> gain);
 
     auto standard_dispersion(const span<const T> image, const span<const bool> mask)
       -> span<const bool>;
     auto standard_dispersion(const span<const T> image, const span<const uint8_t> mask)
       -> span<const bool>;
+
+    /// Find strong pixels only inside a region. All other pixels are not
+    /// strong. Takes time roughly in proportion to the region's size.
+    auto standard_dispersion(const span<const T> image,
+                             const span<const bool> mask,
+                             const SpotfinderRegion &region) -> span<const bool>;
+
+    /// Run standard_dispersion, and also return its intermediate values over
+    /// a rectangle (clipped to the image). This uses a separately compiled
+    /// threshold, so standard_dispersion itself pays nothing for it.
+    auto standard_dispersion_intermediates(const span<const T> image,
+                                           const span<const bool> mask,
+                                           size_t x,
+                                           size_t y,
+                                           size_t width,
+                                           size_t height) -> DispersionIntermediates;
+
+    /// Find strong pixels against a per-pixel background that is carried
+    /// over from the previous images of the sweep, instead of the local
+    /// window. The first image, and every refresh_interval-th after, runs
+    /// standard_dispersion to seed the background. Images must be passed in
+    /// order, with reset_temporal_background at the start of a new sweep.
+    auto temporal_dispersion(const span<const T> image,
+                             const span<const bool> mask,
+                             const TemporalBackgroundParams &params = {})
+      -> span<const bool>;
+    void reset_temporal_background();
+
+    /// Decide quickly whether an image is a hit, with at least
+    /// min_strong_pixels strong pixels. Only every stride-th row is
+    /// thresholded and its count scaled up by the stride, and thresholding
+    /// stops as soon as the image is known to be a hit, so blank images
+    /// cost about 1 / stride of standard_dispersion and hits less.
+    auto find_hit(const span<const T> image,
+                  const span<const bool> mask,
+                  size_t min_strong_pixels,
+                  size_t stride = 1) -> HitResult;
+
+    /*
+     * The other DIALS local threshold methods, with the kernel size and
+     * min_count from the parameters. Each is a single pass over the image.
+     */
+
+    /// pixel > mean + n_sigma * sdev
+    auto niblack(const span<const T> image, double n_sigma) -> span<const bool>;
+    /// pixel > mean * (1 + k * (sdev / r - 1))
+    auto sauvola(const span<const T> image, double k, double r) -> span<const bool>;
+    /// var / mean > 1 + n_sigma * sqrt(2 / (n - 1))
+    auto index_of_dispersion(const span<const T> image, double n_sigma)
+      -> span<const bool>;
+    /// index_of_dispersion, counting only the masked pixels
+    auto index_of_dispersion_masked(const span<const T> image,
+                                    const span<const bool> mask,
+                                    double n_sigma) -> span<const bool>;
+    /// The XDS-style dispersion threshold, with nsig_b, nsig_s and the gain map
+    auto dispersion_w_gain(const span<const T> image, const span<const bool> mask)
+      -> span<const bool>;
 };
 
 #endif
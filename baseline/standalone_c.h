@@ -0,0 +1,38 @@
+#ifndef STANDALONE_C_H
+#define STANDALONE_C_H
+
+#include <stdbool.h>
+
+#include "h5read.h"
+#include "spotfinder_params.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+/// Create a standalone spotfinder, or with NULL params the DIALS defaults
+void* standalone_spotfinder_create(size_t width,
+                                   size_t height,
+                                   const spotfinder_params* params);
+void standalone_spotfinder_free(void* context);
+/// Use a per-pixel gain map of size width * height (all positive) in every
+/// following threshold, or unit gain again if gain is NULL. It is copied.
+void standalone_spotfinder_set_gain(void* context, const float* gain, size_t size);
+/// Find the strong pixels, returning how many there are. If destination is
+/// not NULL it is pointed at the result, valid until the next call.
+uint32_t standalone_spotfinder_standard_dispersion(void* context,
+                                                   image_t* image,
+                                                   bool** destination);
+/// Decide whether an image has at least min_strong_pixels strong pixels,
+/// thresholding only every stride-th row (a stride of 0 is taken as 1) and
+/// stopping as soon as it does. If strong_pixels is not NULL it is set to
+/// the (scaled) count.
+bool standalone_spotfinder_find_hit(void* context,
+                                    image_t* image,
+                                    uint32_t min_strong_pixels,
+                                    uint32_t stride,
+                                    uint32_t* strong_pixels);
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -89,9 +89,37 @@ bool CBFRead::is_image_available(size_t index) {
       expand_template(_template_path, index + _first_index));
 }
 
+bool CBFRead::wait_for_image(size_t index, float timeout) {
+    auto folder = std::filesystem::path(
+                    expand_template(_template_path, index + _first_index))
+                    .parent_path();
+    return wait_for_directory_change(folder.empty() ? "." : folder.string(),
+                                     timeout,
+                                     [&]() { return is_image_available(index); });
+}
+
 SPAN<uint8_t> CBFRead::get_raw_chunk(size_t index, SPAN<uint8_t> destination) {
     auto filename = expand_template(_template_path, index + _first_index);
 
+    if (_direct_io) {
+        // Read the whole file in place, and return the view after the marker
+        size_t size = 0;
+        if (h5read_direct_read_file(
+              filename.c_str(), &size, destination.data(), destination.size())) {
+            auto file_data =
+              std::string_view(reinterpret_cast<char *>(destination.data()), size);
+            size_t marker = file_data.find(BINARY_MARKER);
+            if (marker == std::string_view::npos) {
+                print("Error: No binary section in {}\n", filename);
+                return {};
+            }
+            size_t data_start = marker + BINARY_MARKER.length();
+            return {destination.data() + data_start, size - data_start};
+        }
+        print("Warning: Direct read of {} failed; using buffered reads\n", filename);
+        _direct_io = false;
+    }
+
     // std::vector<char> file_data;
     std::string file_data;
     file_data.reserve(std::filesystem::file_size(filename));
@@ -105,7 +133,12 @@ SPAN<uint8_t> CBFRead::get_raw_chunk(size_t index, SPAN<uint8_t> destination) {
         f.read(read_buffer.data(), read_buffer.size());
         file_data.append(read_buffer.data(), f.gcount());
     } while (f.gcount());
-    size_t data_start = file_data.find(BINARY_MARKER) + BINARY_MARKER.length();
+    size_t marker = file_data.find(BINARY_MARKER);
+    if (marker == std::string::npos) {
+        print("Error: No binary section in {}\n", filename);
+        return {};
+    }
+    size_t data_start = marker + BINARY_MARKER.length();
     // auto byte_data = std::string_view
 
     //   reinterpret_cast<uint8_t *>(file_data.data()) + data_start,
@@ -106,7 +106,7 @@ unsigned int cbf_decompress(const char *packed,
 }
 
 template <typename Tout>
-void decompress_byte_offset(const SPAN<uint8_t> in, SPAN<Tout> out) {
+void decompress_byte_offset(const SPAN<const uint8_t> in, SPAN<Tout> out) {
     cbf_decompress(reinterpret_cast<const char *>(in.data()),
                    in.size_bytes(),
                    out.data(),
@@ -120,11 +120,21 @@ class CBFRead : public Reader {
     std::array<size_t, 2> _image_shape;
     const std::string _template_path;
     std::vector<uint8_t> _mask;
+    bool _direct_io = false;
 
   public:
     CBFRead(const std::string &templatestr, size_t num_images, size_t first_index);
 
     bool is_image_available(size_t index);
+    bool wait_for_image(size_t index, float timeout);
+    bool can_wait_concurrently() const {
+        return true;
+    }
+
+    bool set_direct_io(bool enable) {
+        _direct_io = enable;
+        return true;
+    }
 
     SPAN<uint8_t> get_raw_chunk(size_t index, SPAN<uint8_t> destination);
 
@@ -143,4 +153,4 @@ class CBFRead : public Reader {
 };
 
 template <typename Tout>
-void decompress_byte_offset(const SPAN<uint8_t> in, SPAN<Tout> out);
\ No newline at end of file
+void decompress_byte_offset(const SPAN<const uint8_t> in, SPAN<Tout> out);
\ No newline at end of file
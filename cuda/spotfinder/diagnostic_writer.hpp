@@ -0,0 +1,171 @@
+#pragma once
+
+/**
+ * Writes diagnostic PNG images of the strong pixels and reflections found on
+ * each frame, away from the pipeline's worker threads.
+ *
+ * Workers only pass a frame's strong pixel runs and reflection boxes, which
+ * are small, through a queue. A pool of low-priority threads renders them
+ * (strong pixels red, reflections boxed in blue, on white) and encodes the
+ * PNGs. Images can be written for only every Nth frame, and downscaled, in
+ * which case an output pixel is strong if any pixel it covers is. If the
+ * pool falls behind, frames are dropped rather than holding up the workers.
+ */
+
+#include <fmt/core.h>
+#include <lodepng.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "label3d.hpp"
+
+class DiagnosticWriter {
+  public:
+    /// The most frames that can wait for each rendering thread
+    static constexpr size_t queue_depth_per_thread = 4;
+
+    /**
+     * @param every     Write an image for every this many frames
+     * @param scale     Shrink images by this factor in each direction
+     * @param threads   The number of threads to render and encode with
+     */
+    DiagnosticWriter(int width, int height, int every, int scale, int threads)
+        : _width(width),
+          _height(height),
+          _every(std::max(every, 1)),
+          _scale(std::max(scale, 1)),
+          _max_queued(queue_depth_per_thread * std::max(threads, 1)) {
+        for (int i = 0; i < std::max(threads, 1); ++i) {
+            _threads.emplace_back([this]() { run(); });
+        }
+    }
+    /// Waits for every queued image to be written
+    ~DiagnosticWriter() {
+        {
+            std::scoped_lock lock(_mutex);
+            _stopping = true;
+        }
+        _ready.notify_all();
+        for (auto &thread : _threads) {
+            thread.join();
+        }
+    }
+    DiagnosticWriter(const DiagnosticWriter &) = delete;
+    DiagnosticWriter &operator=(const DiagnosticWriter &) = delete;
+
+    /// Whether an image is written for this frame, so it needs its runs
+    auto wants(size_t image_num) const -> bool {
+        return image_num % _every == 0;
+    }
+
+    /// Queue a frame to be written, or drop it if the queue is full
+    void submit(size_t image_num,
+                std::vector<PixelRun> runs,
+                std::vector<Reflection> reflections) {
+        {
+            std::scoped_lock lock(_mutex);
+            if (_queue.size() >= _max_queued) {
+                ++_dropped;
+                return;
+            }
+            _queue.push_back({image_num, std::move(runs), std::move(reflections)});
+        }
+        _ready.notify_one();
+    }
+
+    /// Frames not written because the queue was full
+    auto dropped() const -> size_t {
+        return _dropped;
+    }
+
+  private:
+    struct Job {
+        size_t image_num;
+        std::vector<PixelRun> runs;
+        std::vector<Reflection> reflections;
+    };
+    using RGB = std::array<uint8_t, 3>;
+
+    void run() {
+        // On Linux this only lowers the priority of this thread
+        setpriority(PRIO_PROCESS, syscall(SYS_gettid), 19);
+        std::vector<RGB> image;
+        std::unique_lock lock(_mutex);
+        while (true) {
+            _ready.wait(lock, [&] { return !_queue.empty() || _stopping; });
+            if (_queue.empty()) break;
+            auto job = std::move(_queue.front());
+            _queue.pop_front();
+            lock.unlock();
+            write(job, image);
+            lock.lock();
+        }
+    }
+
+    void write(const Job &job, std::vector<RGB> &image) const {
+        constexpr RGB color_background{255, 255, 255};
+        constexpr RGB color_pixel{255, 0, 0};
+        constexpr RGB color_shoebox{0, 0, 255};
+
+        int width = (_width + _scale - 1) / _scale;
+        int height = (_height + _scale - 1) / _scale;
+        image.assign(static_cast<size_t>(width) * height, color_background);
+        auto set = [&](int x, int y, RGB color) {
+            if (x >= 0 && x < width && y >= 0 && y < height) {
+                image[static_cast<size_t>(width) * y + x] = color;
+            }
+        };
+
+        for (auto &run : job.runs) {
+            for (int x = run.x_begin / _scale; x <= (run.x_end - 1) / _scale; ++x) {
+                set(x, run.y / _scale, color_pixel);
+            }
+        }
+        // Draw a square around each shoebox, edgeMin to edgeMax full-size
+        // pixels out, but always at least a pixel clear of it
+        constexpr int edgeMin = 5, edgeMax = 7;
+        int edge_min = std::max(edgeMin / _scale, 1);
+        int edge_max = std::max(edgeMax / _scale, edge_min);
+        for (auto &box : job.reflections) {
+            int l = box.l / _scale, r = box.r / _scale;
+            int t = box.t / _scale, b = box.b / _scale;
+            for (int edge = edge_min; edge <= edge_max; ++edge) {
+                for (int x = l - edge; x <= r + edge; ++x) {
+                    set(x, t - edge, color_shoebox);
+                    set(x, b + edge, color_shoebox);
+                }
+                for (int y = t - edge; y <= b + edge; ++y) {
+                    set(l - edge, y, color_shoebox);
+                    set(r + edge, y, color_shoebox);
+                }
+            }
+        }
+        lodepng::encode(fmt::format("image_{:05d}.png", job.image_num),
+                        reinterpret_cast<uint8_t *>(image.data()),
+                        width,
+                        height,
+                        LCT_RGB);
+    }
+
+    int _width, _height;
+    int _every, _scale;
+    size_t _max_queued;
+    std::mutex _mutex;
+    std::condition_variable _ready;
+    std::deque<Job> _queue;
+    bool _stopping = false;
+    std::atomic<size_t> _dropped = 0;
+    std::vector<std::jthread> _threads;
+};
@@ -0,0 +1,266 @@
+#pragma once
+
+/**
+ * Streaming 3D connected components, for joining strong pixels on
+ * consecutive images into 3D reflections, as DIALS does.
+ *
+ * Each image's strong pixels are run-length encoded (which can be done on
+ * any thread), then the runs are passed in image order to the labeller. It
+ * joins runs that touch on neighbouring rows of an image, or on the same
+ * row of the previous image, with union-find, and emits each reflection as
+ * soon as an image adds nothing to it. Only the previous image's runs and
+ * the reflections that can still grow are kept, however long the sweep.
+ */
+
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+#ifdef USE_SPAN_BACKPORT
+#include "span.hpp"
+using tcb::span;
+#else
+#include <span>
+using std::span;
+#endif
+
+/// A run of strong pixels [x_begin, x_end) on row y of an image
+struct PixelRun {
+    int y;
+    int x_begin, x_end;
+    /// Total counts of the pixels, and of counts * pixel centre x
+    double intensity = 0;
+    double intensity_x = 0;
+};
+
+/// Find the runs of strong pixels in an image, in row order
+template <typename T>
+auto find_pixel_runs(span<const uint8_t> strong,
+                     span<const T> image,
+                     int width,
+                     int height) -> std::vector<PixelRun> {
+    std::vector<PixelRun> runs;
+    for (int y = 0; y < height; ++y) {
+        const uint8_t *row = strong.data() + static_cast<size_t>(y) * width;
+        const T *values = image.data() + static_cast<size_t>(y) * width;
+        for (int x = 0; x < width;) {
+            if (!row[x]) {
+                ++x;
+                continue;
+            }
+            PixelRun run{.y = y, .x_begin = x};
+            for (; x < width && row[x]; ++x) {
+                run.intensity += values[x];
+                run.intensity_x += values[x] * (x + 0.5);
+            }
+            run.x_end = x;
+            runs.push_back(run);
+        }
+    }
+    return runs;
+}
+
+/// A reflection on one image
+struct Reflection {
+    /// Bounding box, inclusive: left, top, right, bottom
+    int l, t, r, b;
+    int num_pixels = 0;
+};
+
+/// A reflection made of strong pixels on one or more images
+struct Reflection3D {
+    /// Bounding box, inclusive, in pixels and images
+    int x_min, x_max, y_min, y_max, z_min, z_max;
+    size_t num_pixels;
+    double intensity;
+    /// Intensity-weighted centre, with pixel and image centres at +0.5
+    double x, y, z;
+};
+
+class StreamingLabeller3D {
+  public:
+    /**
+     * Add the runs of the next image, in row order.
+     * @returns The reflections that this image finished, which stay valid
+     *          until the next call
+     */
+    auto add_image(span<const PixelRun> runs) -> const std::vector<Reflection3D> & {
+        _finished.clear();
+        _current.clear();
+        for (auto &run : runs) {
+            assert(_current.empty() || run.y >= _current.back().run.y);
+            uint32_t id = allocate(run);
+            _current.push_back({run, id});
+        }
+        join_rows();
+        join_images();
+
+        // Anything that touches this image can still grow. Everything else
+        // is finished, and merged components can be reused.
+        for (auto &run : _current) {
+            run.id = find(run.id);
+            _components[run.id].last_image = _z;
+        }
+        auto still_live = _live.begin();
+        for (uint32_t id : _live) {
+            auto &component = _components[id];
+            if (component.parent == id && component.last_image == _z) {
+                *still_live++ = id;
+                continue;
+            }
+            if (component.parent == id) {
+                _finished.push_back(component.reflection());
+            }
+            _free.push_back(id);
+        }
+        _live.erase(still_live, _live.end());
+
+        std::swap(_previous, _current);
+        ++_z;
+        return _finished;
+    }
+
+    /// Finish every reflection, at the end of the sweep
+    auto finish() -> const std::vector<Reflection3D> & {
+        add_image({});
+        return _finished;
+    }
+
+    /// Reflections that could still grow
+    auto num_live() const -> size_t {
+        return _live.size();
+    }
+
+  private:
+    /// Part of a reflection, with running intensity-weighted position sums
+    struct Component {
+        uint32_t parent;
+        int last_image;
+        Reflection3D box;
+        double intensity_x, intensity_y, intensity_z;
+
+        void merge(const Component &other) {
+            box.x_min = std::min(box.x_min, other.box.x_min);
+            box.x_max = std::max(box.x_max, other.box.x_max);
+            box.y_min = std::min(box.y_min, other.box.y_min);
+            box.y_max = std::max(box.y_max, other.box.y_max);
+            box.z_min = std::min(box.z_min, other.box.z_min);
+            box.z_max = std::max(box.z_max, other.box.z_max);
+            box.num_pixels += other.box.num_pixels;
+            box.intensity += other.box.intensity;
+            intensity_x += other.intensity_x;
+            intensity_y += other.intensity_y;
+            intensity_z += other.intensity_z;
+        }
+        auto reflection() const -> Reflection3D {
+            Reflection3D result = box;
+            if (box.intensity > 0) {
+                result.x = intensity_x / box.intensity;
+                result.y = intensity_y / box.intensity;
+                result.z = intensity_z / box.intensity;
+            } else {
+                // No counts to weight by, so use the middle of the box
+                result.x = (box.x_min + box.x_max + 1) / 2.0;
+                result.y = (box.y_min + box.y_max + 1) / 2.0;
+                result.z = (box.z_min + box.z_max + 1) / 2.0;
+            }
+            return result;
+        }
+    };
+    struct LabelledRun {
+        PixelRun run;
+        uint32_t id;
+    };
+
+    /// A new component of just one run, on this image
+    auto allocate(const PixelRun &run) -> uint32_t {
+        uint32_t id;
+        if (_free.empty()) {
+            id = _components.size();
+            _components.emplace_back();
+        } else {
+            id = _free.back();
+            _free.pop_back();
+        }
+        _live.push_back(id);
+        _components[id] = {
+          .parent = id,
+          .last_image = _z,
+          .box = {.x_min = run.x_begin,
+                  .x_max = run.x_end - 1,
+                  .y_min = run.y,
+                  .y_max = run.y,
+                  .z_min = _z,
+                  .z_max = _z,
+                  .num_pixels = static_cast<size_t>(run.x_end - run.x_begin),
+                  .intensity = run.intensity},
+          .intensity_x = run.intensity_x,
+          .intensity_y = run.intensity * (run.y + 0.5),
+          .intensity_z = run.intensity * (_z + 0.5),
+        };
+        return id;
+    }
+
+    auto find(uint32_t id) -> uint32_t {
+        while (_components[id].parent != id) {
+            // Path halving
+            _components[id].parent = _components[_components[id].parent].parent;
+            id = _components[id].parent;
+        }
+        return id;
+    }
+
+    void join(uint32_t a, uint32_t b) {
+        a = find(a);
+        b = find(b);
+        if (a == b) return;
+        _components[a].merge(_components[b]);
+        _components[b].parent = a;
+    }
+
+    /// Call join on every pair of overlapping runs from two lists, each in
+    /// row order, where row_of maps a run in the second list to the row of
+    /// the first to match it against
+    template <typename RowOf>
+    void join_overlapping(const std::vector<LabelledRun> &first,
+                          const std::vector<LabelledRun> &second,
+                          RowOf row_of) {
+        auto begin = first.begin();
+        for (auto &run : second) {
+            int row = row_of(run.run);
+            // Skip the runs that end before this one starts
+            while (begin != first.end()
+                   && std::pair(begin->run.y, begin->run.x_end)
+                        <= std::pair(row, run.run.x_begin)) {
+                ++begin;
+            }
+            // Then the runs on the row that start before this one ends overlap
+            for (auto other = begin; other != first.end() && other->run.y == row
+                                     && other->run.x_begin < run.run.x_end;
+                 ++other) {
+                join(other->id, run.id);
+            }
+        }
+    }
+
+    /// Join runs that touch on neighbouring rows of this image
+    void join_rows() {
+        join_overlapping(
+          _current, _current, [](const PixelRun &run) { return run.y - 1; });
+    }
+    /// Join runs that touch on the same row of the previous image
+    void join_images() {
+        join_overlapping(
+          _previous, _current, [](const PixelRun &run) { return run.y; });
+    }
+
+    std::vector<Component> _components;
+    /// Components allocated and not yet finished or merged away
+    std::vector<uint32_t> _live;
+    std::vector<uint32_t> _free;
+    std::vector<LabelledRun> _previous, _current;
+    std::vector<Reflection3D> _finished;
+    int _z = 0;
+};
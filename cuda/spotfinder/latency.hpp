@@ -0,0 +1,227 @@
+#pragma once
+
+/**
+ * Per-stage latency histograms, for instrumenting the processing pipeline.
+ *
+ * Every worker thread records into its own set of histograms, so recording
+ * a time is a couple of uncontended relaxed atomic stores and never takes a
+ * lock. The histograms can be read and merged at any point, so that a
+ * monitoring thread can report progress while the workers are still running.
+ */
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <memory>
+#include <nlohmann/json.hpp>
+#include <string>
+#include <vector>
+
+/// Log-linear histogram of durations, in nanoseconds.
+///
+/// Like an HDR histogram, each power of two range is split into equal
+/// sub-buckets, so every value is stored to within 1/64 of itself. Only one
+/// thread may record into a histogram, but any thread may read it.
+class LatencyHistogram {
+  public:
+    /// Each power-of-two range is split into 2^(precision_bits-1) buckets
+    static constexpr int precision_bits = 7;
+    /// Values up to 2^max_bits ns (about 18 minutes) are stored exactly
+    static constexpr int max_bits = 40;
+    static constexpr size_t num_buckets =
+      (max_bits - precision_bits + 2) << (precision_bits - 1);
+
+    void record(uint64_t ns) {
+        ns = std::min<uint64_t>(ns, (uint64_t{1} << max_bits) - 1);
+        add(_counts[bucket_index(ns)], 1);
+        add(_count, 1);
+        add(_sum, ns);
+        if (ns > _max.load(std::memory_order_relaxed)) {
+            _max.store(ns, std::memory_order_relaxed);
+        }
+    }
+    template <typename Rep, typename Period>
+    void record(std::chrono::duration<Rep, Period> duration) {
+        record(std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count());
+    }
+
+    /// Add all of the values recorded in another histogram to this one
+    void merge(const LatencyHistogram &other) {
+        for (size_t i = 0; i < num_buckets; ++i) {
+            add(_counts[i], other._counts[i].load(std::memory_order_relaxed));
+        }
+        add(_count, other.count());
+        add(_sum, other.sum());
+        _max.store(std::max(max(), other.max()), std::memory_order_relaxed);
+    }
+
+    auto count() const -> uint64_t {
+        return _count.load(std::memory_order_relaxed);
+    }
+    /// Total of all recorded values, in ns
+    auto sum() const -> uint64_t {
+        return _sum.load(std::memory_order_relaxed);
+    }
+    auto max() const -> uint64_t {
+        return _max.load(std::memory_order_relaxed);
+    }
+    auto mean() const -> double {
+        return count() ? static_cast<double>(sum()) / count() : 0.0;
+    }
+    /// The value that a fraction of recorded values are at or below, in ns
+    auto percentile(double fraction) const -> uint64_t {
+        uint64_t total = count();
+        if (total == 0) return 0;
+        auto target = std::max<uint64_t>(1, std::ceil(fraction * total));
+        uint64_t seen = 0;
+        for (size_t i = 0; i < num_buckets; ++i) {
+            seen += _counts[i].load(std::memory_order_relaxed);
+            if (seen >= target) {
+                // The middle of the bucket, but never more than was seen
+                return std::min(max(), (bucket_lower(i) + bucket_lower(i + 1)) / 2);
+            }
+        }
+        return max();
+    }
+
+  private:
+    std::array<std::atomic<uint64_t>, num_buckets> _counts{};
+    std::atomic<uint64_t> _count = 0, _sum = 0, _max = 0;
+
+    /// Increment a counter that only this thread writes
+    static void add(std::atomic<uint64_t> &counter, uint64_t value) {
+        counter.store(counter.load(std::memory_order_relaxed) + value,
+                      std::memory_order_relaxed);
+    }
+
+    static auto bucket_index(uint64_t value) -> size_t {
+        constexpr uint64_t linear_limit = uint64_t{1} << precision_bits;
+        if (value < linear_limit) return value;
+        // Keep the top precision_bits bits of the value
+        int shift = std::bit_width(value) - precision_bits;
+        return (static_cast<size_t>(shift) << (precision_bits - 1))
+               + (value >> shift);
+    }
+    /// The smallest value stored in a bucket
+    static auto bucket_lower(size_t index) -> uint64_t {
+        constexpr size_t half = size_t{1} << (precision_bits - 1);
+        if (index < 2 * half) return index;
+        size_t shift = index / half - 1;
+        return static_cast<uint64_t>(index - shift * half) << shift;
+    }
+};
+
+/// The parts of processing a frame that are timed
+enum class Stage { Wait, Read, Decompress, Threshold, Label, Total };
+constexpr size_t num_stages = static_cast<size_t>(Stage::Total) + 1;
+constexpr std::array<const char *, num_stages> stage_names = {
+  "wait", "read", "decompress", "threshold", "label", "total"};
+
+/// A histogram for every stage
+class StageHistograms {
+  public:
+    auto operator[](Stage stage) -> LatencyHistogram & {
+        return _stages[static_cast<size_t>(stage)];
+    }
+    auto operator[](Stage stage) const -> const LatencyHistogram & {
+        return _stages[static_cast<size_t>(stage)];
+    }
+    void merge(const StageHistograms &other) {
+        for (size_t i = 0; i < num_stages; ++i) {
+            _stages[i].merge(other._stages[i]);
+        }
+    }
+
+  private:
+    std::array<LatencyHistogram, num_stages> _stages;
+};
+
+/// Times a stage from construction until stop(), or until destroyed
+class StageTimer {
+  public:
+    StageTimer(StageHistograms &histograms, Stage stage)
+        : _histogram(&histograms[stage]), _start(std::chrono::steady_clock::now()) {}
+    ~StageTimer() {
+        stop();
+    }
+    StageTimer(const StageTimer &) = delete;
+    StageTimer &operator=(const StageTimer &) = delete;
+
+    void stop() {
+        if (_histogram) {
+            _histogram->record(std::chrono::steady_clock::now() - _start);
+            _histogram = nullptr;
+        }
+    }
+
+  private:
+    LatencyHistogram *_histogram;
+    std::chrono::steady_clock::time_point _start;
+};
+
+/// Stage histograms for every worker thread
+class PipelineStats {
+  public:
+    PipelineStats(size_t num_threads) : _start(std::chrono::steady_clock::now()) {
+        for (size_t i = 0; i < num_threads; ++i) {
+            _threads.push_back(std::make_unique<StageHistograms>());
+        }
+    }
+
+    auto num_threads() const -> size_t {
+        return _threads.size();
+    }
+
+    /// The histograms that only this thread records into
+    auto thread(size_t index) -> StageHistograms & {
+        return *_threads[index];
+    }
+
+    /// Combine all threads' histograms, as they are right now
+    auto merged() const -> std::unique_ptr<StageHistograms> {
+        auto total = std::make_unique<StageHistograms>();
+        for (auto &thread : _threads) {
+            total->merge(*thread);
+        }
+        return total;
+    }
+
+    /// Seconds since the stats were created
+    auto elapsed() const -> double {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - _start)
+          .count();
+    }
+
+    /// Latency percentiles (in µs), rate and utilisation of every stage
+    auto to_json() const -> nlohmann::json {
+        auto total = merged();
+        double seconds = elapsed();
+        auto stages = nlohmann::json::object();
+        for (size_t i = 0; i < num_stages; ++i) {
+            auto &histogram = (*total)[static_cast<Stage>(i)];
+            stages[stage_names[i]] = {
+              {"count", histogram.count()},
+              {"mean_us", histogram.mean() * 1e-3},
+              {"p50_us", histogram.percentile(0.5) * 1e-3},
+              {"p99_us", histogram.percentile(0.99) * 1e-3},
+              {"p999_us", histogram.percentile(0.999) * 1e-3},
+              {"max_us", histogram.max() * 1e-3},
+              {"fps", histogram.count() / seconds},
+              {"busy", histogram.sum() * 1e-9 / (seconds * _threads.size())},
+            };
+        }
+        return {
+          {"elapsed_s", seconds},
+          {"threads", num_threads()},
+          {"stages", stages},
+        };
+    }
+
+  private:
+    std::vector<std::unique_ptr<StageHistograms>> _threads;
+    std::chrono::steady_clock::time_point _start;
+};
@@ -0,0 +1,193 @@
+#pragma once
+
+/**
+ * Streams the results of a run to a compact binary file.
+ *
+ * The file is a header, then a stream of records. Each record's table is
+ * stored by column, so a reader can load a column straight into an array.
+ * All values are little-endian:
+ *
+ *   Header:   char[8] "SPOTRES\0", uint32 version, uint32 width, uint32 height
+ *   Record:   uint32 type, uint32 rows, then the record's fields
+ *   Frame (type 1): uint64 frame index, uint64 strong pixels, then the
+ *             reflections on that frame, as int32 columns l, t, r, b and
+ *             num_pixels (the box is inclusive)
+ *   3D reflections (type 2): int32 columns x_min, x_max, y_min, y_max,
+ *             z_min, z_max, uint64 num_pixels, then float64 columns
+ *             intensity, x, y, z
+ *
+ * Records are encoded into an in-memory buffer by the caller, and full
+ * buffers are written out by a dedicated thread, so writing results never
+ * waits for the disk. If the disk falls behind, more buffers are allocated
+ * rather than blocking the caller. Call finish() at the end to wait for
+ * everything to be written, and find out whether it all was.
+ */
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef USE_SPAN_BACKPORT
+#include "span.hpp"
+using tcb::span;
+#else
+#include <span>
+using std::span;
+#endif
+
+#include "label3d.hpp"
+
+class ResultsWriter {
+  public:
+    static constexpr uint32_t version = 1;
+    enum RecordType : uint32_t { Frame = 1, Reflections3D = 2 };
+    /// Hand a buffer to the writer thread once it holds at least this much
+    static constexpr size_t buffer_size = 4 * 1024 * 1024;
+
+    ResultsWriter(const std::string &path, uint32_t width, uint32_t height)
+        : _file(path, std::ios::binary) {
+        if (!_file) throw std::runtime_error("Could not open " + path);
+        _current.reserve(buffer_size);
+        append("SPOTRES", 8);
+        append_value(version);
+        append_value(width);
+        append_value(height);
+        _thread = std::jthread([this]() { run(); });
+    }
+    ~ResultsWriter() {
+        finish();
+    }
+    ResultsWriter(const ResultsWriter &) = delete;
+    ResultsWriter &operator=(const ResultsWriter &) = delete;
+
+    /// Record a frame's strong pixel count and reflections
+    void write_frame(uint64_t index,
+                     uint64_t num_strong_pixels,
+                     span<const Reflection> reflections) {
+        append_value<uint32_t>(Frame);
+        append_value<uint32_t>(reflections.size());
+        append_value(index);
+        append_value(num_strong_pixels);
+        append_column<int32_t>(reflections, [](auto &r) { return r.l; });
+        append_column<int32_t>(reflections, [](auto &r) { return r.t; });
+        append_column<int32_t>(reflections, [](auto &r) { return r.r; });
+        append_column<int32_t>(reflections, [](auto &r) { return r.b; });
+        append_column<int32_t>(reflections, [](auto &r) { return r.num_pixels; });
+        hand_over_if_full();
+    }
+
+    /// Record finished 3D reflections
+    void write_reflections_3d(span<const Reflection3D> reflections) {
+        if (reflections.empty()) return;
+        append_value<uint32_t>(Reflections3D);
+        append_value<uint32_t>(reflections.size());
+        append_column<int32_t>(reflections, [](auto &r) { return r.x_min; });
+        append_column<int32_t>(reflections, [](auto &r) { return r.x_max; });
+        append_column<int32_t>(reflections, [](auto &r) { return r.y_min; });
+        append_column<int32_t>(reflections, [](auto &r) { return r.y_max; });
+        append_column<int32_t>(reflections, [](auto &r) { return r.z_min; });
+        append_column<int32_t>(reflections, [](auto &r) { return r.z_max; });
+        append_column<uint64_t>(reflections, [](auto &r) { return r.num_pixels; });
+        append_column<double>(reflections, [](auto &r) { return r.intensity; });
+        append_column<double>(reflections, [](auto &r) { return r.x; });
+        append_column<double>(reflections, [](auto &r) { return r.y; });
+        append_column<double>(reflections, [](auto &r) { return r.z; });
+        hand_over_if_full();
+    }
+
+    /**
+     * Write out everything recorded, and stop the writer thread. Nothing
+     * more can be recorded after this.
+     * @returns Whether every write succeeded, so the file is complete
+     */
+    auto finish() -> bool {
+        if (_thread.joinable()) {
+            {
+                std::scoped_lock lock(_mutex);
+                _full.push_back(std::move(_current));
+                _stopping = true;
+            }
+            _ready.notify_one();
+            // Joining waits for everything to be written
+            _thread.join();
+        }
+        return !_failed;
+    }
+
+  private:
+    void append(const void *data, size_t size) {
+        auto bytes = static_cast<const char *>(data);
+        _current.insert(_current.end(), bytes, bytes + size);
+    }
+    template <typename T>
+    void append_value(T value) {
+        append(&value, sizeof(T));
+    }
+    template <typename T, typename Row, typename Field>
+    void append_column(span<const Row> rows, Field field) {
+        size_t offset = _current.size();
+        _current.resize(offset + rows.size() * sizeof(T));
+        for (auto &row : rows) {
+            T value = field(row);
+            std::memcpy(_current.data() + offset, &value, sizeof(T));
+            offset += sizeof(T);
+        }
+    }
+
+    /// Pass a full buffer to the writer thread, and take an empty one
+    void hand_over_if_full() {
+        if (_current.size() < buffer_size) return;
+        {
+            std::scoped_lock lock(_mutex);
+            _full.push_back(std::move(_current));
+            if (_empty.empty()) {
+                _current = {};
+            } else {
+                _current = std::move(_empty.back());
+                _empty.pop_back();
+            }
+        }
+        _current.clear();
+        _current.reserve(buffer_size);
+        _ready.notify_one();
+    }
+
+    void run() {
+        std::unique_lock lock(_mutex);
+        while (true) {
+            _ready.wait(lock, [&] { return !_full.empty() || _stopping; });
+            if (_full.empty()) break;
+            auto buffers = std::move(_full);
+            _full.clear();
+            lock.unlock();
+            // After a failure, nothing more can usefully be written
+            for (auto &buffer : buffers) {
+                if (_file) _file.write(buffer.data(), buffer.size());
+            }
+            if (_file) _file.flush();
+            if (!_file) _failed = true;
+            lock.lock();
+            for (auto &buffer : buffers) {
+                _empty.push_back(std::move(buffer));
+            }
+        }
+    }
+
+    std::ofstream _file;
+    /// The buffer being encoded into, only touched by the caller
+    std::vector<char> _current;
+    std::mutex _mutex;
+    std::condition_variable _ready;
+    /// Buffers waiting to be written, and written buffers to reuse
+    std::vector<std::vector<char>> _full, _empty;
+    bool _stopping = false;
+    std::atomic<bool> _failed = false;
+    std::jthread _thread;
+};
@@ -0,0 +1,367 @@
+#pragma once
+
+/**
+ * Scheduling of frames through the stages of processing.
+ *
+ * Each frame passes through a fixed list of stages (e.g. read, decompress,
+ * threshold, label), and each stage is run by a pool of workers. Within a
+ * pool, any worker can run any of its stages: when a worker finishes a stage
+ * it queues the next stage of that frame on its own deque, and idle workers
+ * steal from the others, so a worker blocked on one slow frame never holds
+ * up the rest. Frames move between pools through lock-free bounded queues,
+ * so that e.g. I/O and decompression can each have their own threads.
+ *
+ * The number of frames in flight is bounded, and results are passed back
+ * out strictly in frame order through a reorder buffer, so the consumer
+ * never needs to sort them.
+ */
+
+#include <atomic>
+#include <bit>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <vector>
+
+/// Fixed-size work-stealing deque of pointers (Chase-Lev).
+///
+/// Only the owning worker may push and pop, at the bottom. Any other thread
+/// may steal from the top. This never blocks or allocates, and is safe as
+/// long as it never holds more than the capacity.
+template <typename T>
+class WorkStealingDeque {
+  public:
+    WorkStealingDeque(size_t capacity)
+        : _mask(std::bit_ceil(std::max<size_t>(capacity, 2)) - 1),
+          _items(_mask + 1) {}
+
+    void push(T *item) {
+        int64_t bottom = _bottom.load(std::memory_order_relaxed);
+        assert(bottom - _top.load(std::memory_order_acquire)
+               <= static_cast<int64_t>(_mask));
+        _items[bottom & _mask].store(item, std::memory_order_relaxed);
+        // Publish the item, and whatever it points to, to thieves
+        _bottom.store(bottom + 1, std::memory_order_release);
+    }
+
+    /// Take the most recently pushed item. Owner only.
+    auto pop() -> T * {
+        int64_t bottom = _bottom.load(std::memory_order_relaxed) - 1;
+        _bottom.store(bottom, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t top = _top.load(std::memory_order_relaxed);
+        if (top > bottom) {
+            // Empty
+            _bottom.store(bottom + 1, std::memory_order_relaxed);
+            return nullptr;
+        }
+        T *item = _items[bottom & _mask].load(std::memory_order_relaxed);
+        if (top == bottom) {
+            // The last item, which a thief might be taking at the same time
+            if (!_top.compare_exchange_strong(
+                  top, top + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+                item = nullptr;
+            }
+            _bottom.store(bottom + 1, std::memory_order_relaxed);
+        }
+        return item;
+    }
+
+    /// Take the oldest item. Any thread. Can spuriously return nothing if
+    /// another thread took an item at the same time.
+    auto steal() -> T * {
+        int64_t top = _top.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t bottom = _bottom.load(std::memory_order_acquire);
+        if (top >= bottom) {
+            return nullptr;
+        }
+        T *item = _items[top & _mask].load(std::memory_order_relaxed);
+        if (!_top.compare_exchange_strong(
+              top, top + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+            return nullptr;
+        }
+        return item;
+    }
+
+    auto empty() const -> bool {
+        return _top.load(std::memory_order_acquire)
+               >= _bottom.load(std::memory_order_acquire);
+    }
+
+  private:
+    size_t _mask;
+    std::vector<std::atomic<T *>> _items;
+    alignas(64) std::atomic<int64_t> _top = 0;
+    alignas(64) std::atomic<int64_t> _bottom = 0;
+};
+
+/// Collects results that arrive in any order, and passes them on in order.
+///
+/// Indices must be less than the window size ahead of the next result to be
+/// emitted. The emit function is called by whichever thread completes the
+/// run, without the lock held, and never by two threads at once.
+template <typename T>
+class ReorderBuffer {
+  public:
+    using emit_function = std::function<void(size_t index, T &result)>;
+
+    ReorderBuffer(size_t window, emit_function emit)
+        : _slots(window), _emit(std::move(emit)) {}
+
+    void submit(size_t index, T result) {
+        std::unique_lock lock(_mutex);
+        assert(index >= _next && index < _next + _slots.size());
+        _slots[index % _slots.size()] = std::move(result);
+        if (_emitting) {
+            // Another thread is emitting, and will pick this up
+            return;
+        }
+        _emitting = true;
+        while (auto &slot = _slots[_next % _slots.size()]) {
+            T value = std::move(*slot);
+            slot.reset();
+            size_t emit_index = _next++;
+            lock.unlock();
+            _emit(emit_index, value);
+            lock.lock();
+        }
+        _emitting = false;
+    }
+
+  private:
+    std::mutex _mutex;
+    std::vector<std::optional<T>> _slots;
+    emit_function _emit;
+    size_t _next = 0;
+    bool _emitting = false;
+};
+
+/// Fixed-size lock-free multi-producer, multi-consumer queue (Vyukov).
+///
+/// Every slot carries a sequence number, saying whether it is ready to be
+/// written or read on this pass around the ring, so producers and consumers
+/// each only contend on their own end.
+template <typename T>
+class BoundedQueue {
+  public:
+    BoundedQueue(size_t capacity)
+        : _mask(std::bit_ceil(std::max<size_t>(capacity, 2)) - 1),
+          _cells(std::make_unique<Cell[]>(_mask + 1)) {
+        for (size_t i = 0; i <= _mask; ++i) {
+            _cells[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    /// Add an item, or return false if the queue is full
+    bool try_push(T value) {
+        size_t position = _tail.load(std::memory_order_relaxed);
+        while (true) {
+            Cell &cell = _cells[position & _mask];
+            size_t sequence = cell.sequence.load(std::memory_order_acquire);
+            auto difference = static_cast<intptr_t>(sequence - position);
+            if (difference == 0) {
+                if (_tail.compare_exchange_weak(
+                      position, position + 1, std::memory_order_relaxed)) {
+                    cell.value = std::move(value);
+                    cell.sequence.store(position + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (difference < 0) {
+                return false;
+            } else {
+                position = _tail.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    /// Take the oldest item, if there is one
+    auto try_pop() -> std::optional<T> {
+        size_t position = _head.load(std::memory_order_relaxed);
+        while (true) {
+            Cell &cell = _cells[position & _mask];
+            size_t sequence = cell.sequence.load(std::memory_order_acquire);
+            auto difference = static_cast<intptr_t>(sequence - (position + 1));
+            if (difference == 0) {
+                if (_head.compare_exchange_weak(
+                      position, position + 1, std::memory_order_relaxed)) {
+                    T value = std::move(cell.value);
+                    cell.sequence.store(position + _mask + 1,
+                                        std::memory_order_release);
+                    return value;
+                }
+            } else if (difference < 0) {
+                return std::nullopt;
+            } else {
+                position = _head.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    auto empty() const -> bool {
+        return _head.load(std::memory_order_acquire)
+               >= _tail.load(std::memory_order_acquire);
+    }
+
+  private:
+    struct Cell {
+        std::atomic<size_t> sequence;
+        T value;
+    };
+    size_t _mask;
+    std::unique_ptr<Cell[]> _cells;
+    alignas(64) std::atomic<size_t> _head = 0;
+    alignas(64) std::atomic<size_t> _tail = 0;
+};
+
+/// Hands out frame stages to pools of workers.
+///
+/// Each stage is run by one pool, and each worker belongs to one pool. When
+/// a worker queues the next stage of a frame and its own pool runs that
+/// stage, it goes on the worker's deque, for it or its pool-mates to steal.
+/// Otherwise it is handed to the other pool through that stage's queue.
+///
+/// Workers call next() for their next task, preferring the latest stage
+/// available so that frames already in flight are finished first. A new
+/// frame is only started once there are fewer than max_in_flight frames
+/// between it and the oldest frame not yet released.
+template <typename Frame>
+class FrameScheduler {
+  public:
+    struct Task {
+        size_t stage;
+        Frame *frame;
+    };
+
+    /// stage_pools gives the pool that runs each stage, and worker_pools
+    /// the pool of each worker. start_frame is called to get the work item
+    /// for each new frame index.
+    FrameScheduler(std::vector<size_t> stage_pools,
+                   std::vector<size_t> worker_pools,
+                   size_t num_frames,
+                   size_t max_in_flight,
+                   std::function<Frame *(size_t index)> start_frame)
+        : _stage_pools(std::move(stage_pools)),
+          _worker_pools(std::move(worker_pools)),
+          _num_frames(num_frames),
+          _max_in_flight(max_in_flight),
+          _start_frame(std::move(start_frame)) {
+        for (size_t stage = 0; stage < _stage_pools.size(); ++stage) {
+            _handoff.push_back(std::make_unique<BoundedQueue<Frame *>>(max_in_flight));
+            for (size_t worker = 0; worker < _worker_pools.size(); ++worker) {
+                _deques.push_back(
+                  std::make_unique<WorkStealingDeque<Frame>>(max_in_flight));
+            }
+        }
+    }
+
+    auto num_workers() const -> size_t {
+        return _worker_pools.size();
+    }
+
+    /// Get the next task for a worker, waiting until there is one.
+    ///
+    /// Returns nothing once every frame is released, or on cancel().
+    auto next(size_t worker) -> std::optional<Task> {
+        size_t pool = _worker_pools[worker];
+        while (true) {
+            auto epoch = _epoch.load(std::memory_order_acquire);
+            if (_cancelled.load(std::memory_order_relaxed)) {
+                return std::nullopt;
+            }
+            for (size_t stage = _stage_pools.size(); stage-- > 0;) {
+                if (_stage_pools[stage] != pool) continue;
+                if (auto frame = deque(stage, worker).pop()) {
+                    return Task{stage, frame};
+                }
+                if (auto frame = _handoff[stage]->try_pop()) {
+                    return Task{stage, *frame};
+                }
+                for (size_t i = 1; i < num_workers(); ++i) {
+                    auto victim = (worker + i) % num_workers();
+                    if (_worker_pools[victim] != pool) continue;
+                    if (auto frame = deque(stage, victim).steal()) {
+                        return Task{stage, frame};
+                    }
+                }
+            }
+            auto index = _next_frame.load(std::memory_order_relaxed);
+            auto released = _released.load(std::memory_order_acquire);
+            if (index >= _num_frames && released >= _num_frames) {
+                return std::nullopt;
+            }
+            if (_stage_pools[0] == pool && index < _num_frames
+                && index < released + _max_in_flight) {
+                if (_next_frame.compare_exchange_weak(index, index + 1)) {
+                    return Task{0, _start_frame(index)};
+                }
+                continue;
+            }
+            // A steal can lose a race with another thief, so only wait
+            // if everything really is empty
+            if (any_queued(pool)) continue;
+            // Nothing to do until another worker queues or releases a frame
+            _epoch.wait(epoch, std::memory_order_acquire);
+        }
+    }
+
+    /// Queue the next stage of a frame
+    void push(size_t worker, size_t stage, Frame *frame) {
+        if (_stage_pools[stage] == _worker_pools[worker]) {
+            deque(stage, worker).push(frame);
+        } else {
+            // Never full, because no more than max_in_flight frames exist
+            [[maybe_unused]] bool pushed = _handoff[stage]->try_push(frame);
+            assert(pushed);
+        }
+        wake();
+    }
+
+    /// Mark the oldest frames as finished with, making room for new ones
+    void release(size_t count = 1) {
+        _released.fetch_add(count, std::memory_order_release);
+        wake();
+    }
+
+    /// Stop handing out tasks
+    void cancel() {
+        _cancelled = true;
+        wake();
+    }
+
+  private:
+    std::vector<size_t> _stage_pools, _worker_pools;
+    size_t _num_frames, _max_in_flight;
+    std::function<Frame *(size_t)> _start_frame;
+    /// Per-stage, per-worker deques, for work within a pool
+    std::vector<std::unique_ptr<WorkStealingDeque<Frame>>> _deques;
+    /// Per-stage queues, for handing work from one pool to another
+    std::vector<std::unique_ptr<BoundedQueue<Frame *>>> _handoff;
+    std::atomic<size_t> _next_frame = 0;
+    std::atomic<size_t> _released = 0;
+    std::atomic<bool> _cancelled = false;
+    /// Changes whenever there might be new work, for idle workers to wait on
+    std::atomic<uint32_t> _epoch = 0;
+
+    auto deque(size_t stage, size_t worker) -> WorkStealingDeque<Frame> & {
+        return *_deques[stage * num_workers() + worker];
+    }
+    auto any_queued(size_t pool) const -> bool {
+        for (size_t stage = 0; stage < _stage_pools.size(); ++stage) {
+            if (_stage_pools[stage] != pool) continue;
+            if (!_handoff[stage]->empty()) return true;
+            for (size_t worker = 0; worker < num_workers(); ++worker) {
+                if (!_deques[stage * num_workers() + worker]->empty()) return true;
+            }
+        }
+        return false;
+    }
+    void wake() {
+        _epoch.fetch_add(1, std::memory_order_release);
+        _epoch.notify_all();
+    }
+};
@@ -0,0 +1,497 @@
+/**
+ * Simulate a detector stream writer, to stress-test the /dev/shm frame handoff.
+ *
+ * Writes start_1 and start_4 headers then numbered frames into a folder, at
+ * a fixed rate, using one of the frame commit conventions that SHMRead
+ * understands. With --verify, an SHMRead on another thread waits for each
+ * frame as it is committed and checks every byte of it, so any partially
+ * written frame that is handed to a reader is caught. With --prewrite, the
+ * first frames are written before the reader starts, as if it was started
+ * late, to check that frames already in the folder are counted.
+ *
+ * The frames can be:
+ * - pattern:   a valid bitshuffle chunk header followed by a deterministic
+ *              pattern; these are not decompressible images.
+ * - synthetic: synthetic images from h5read, compressed with bitshuffle-LZ4.
+ * - FILE.nxs:  the raw chunks of an existing dataset, replayed as-is.
+ *
+ * Synthetic and replayed frames are loaded into memory before writing
+ * starts, and cycled through if more frames are written than loaded, so
+ * that nothing but the write itself happens in the frame time.
+ */
+#include <bitshuffle.h>
+#include <fcntl.h>
+#include <fmt/core.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <argparse/argparse.hpp>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <filesystem>
+#include <memory>
+#include <nlohmann/json.hpp>
+#include <thread>
+#include <vector>
+
+#include "shmread.hpp"
+
+using namespace fmt;
+using json = nlohmann::json;
+using clock_type = std::chrono::steady_clock;
+
+/// Pattern word for position i of a frame, so the reader can check it
+static auto pattern_word(size_t frame, size_t i) -> uint64_t {
+    // splitmix64
+    uint64_t z = (frame << 40) + i + 0x9e3779b97f4a7c15ull;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+}
+
+/// Write the bitshuffle chunk header: big-endian uncompressed size and
+/// block size, both in bytes
+static void write_chunk_header(uint8_t *header, uint64_t image_size, uint32_t block) {
+    for (int i = 0; i < 8; ++i) {
+        header[i] = (image_size >> (8 * (7 - i))) & 0xFF;
+    }
+    for (int i = 0; i < 4; ++i) {
+        header[8 + i] = (block >> (8 * (3 - i))) & 0xFF;
+    }
+}
+
+static void fill_frame(std::vector<uint8_t> &frame, size_t index, size_t image_size) {
+    write_chunk_header(frame.data(), image_size, 8192);
+    for (size_t i = 12, word = 0; i < frame.size(); i += 8, ++word) {
+        uint64_t value = pattern_word(index, word);
+        std::copy_n(reinterpret_cast<uint8_t *>(&value),
+                    std::min<size_t>(8, frame.size() - i),
+                    frame.data() + i);
+    }
+}
+
+/// Compress a 16-bit image into a bitshuffle-LZ4 chunk, like the HDF5 filter
+static auto compress_frame(const std::vector<uint16_t> &image) -> std::vector<uint8_t> {
+    auto frame =
+      std::vector<uint8_t>(12 + bshuf_compress_lz4_bound(image.size(), 2, 0));
+    write_chunk_header(
+      frame.data(), image.size() * 2, bshuf_default_block_size(2) * 2);
+    int64_t size =
+      bshuf_compress_lz4(image.data(), frame.data() + 12, image.size(), 2, 0);
+    if (size < 0) {
+        print("Error: Compressing frame failed ({})\n", size);
+        std::exit(1);
+    }
+    frame.resize(12 + size);
+    return frame;
+}
+
+/// Quick hash of a frame, to check it was read back complete
+static auto frame_hash(SPAN<const uint8_t> data) -> uint64_t {
+    uint64_t hash = data.size();
+    size_t i = 0;
+    for (; i + 8 <= data.size(); i += 8) {
+        uint64_t word;
+        std::memcpy(&word, data.data() + i, 8);
+        hash = (hash ^ word) * 0x9e3779b97f4a7c15ull;
+        hash ^= hash >> 29;
+    }
+    for (; i < data.size(); ++i) {
+        hash = (hash ^ data[i]) * 0x100000001b3ull;
+    }
+    return hash;
+}
+
+/// Frames to write, when they are prepared in advance
+struct FrameSource {
+    size_t width, height;
+    std::vector<uint8_t> mask;  ///< 1 for good pixels
+    std::vector<std::vector<uint8_t>> frames;
+};
+
+/// Take the image size and mask from a reader, without any frames
+static auto describe_source(const H5Read &reader) -> FrameSource {
+    FrameSource source{reader.get_image_fast(), reader.get_image_slow()};
+    if (auto mask = reader.get_mask()) {
+        source.mask.assign(mask->begin(), mask->end());
+    } else {
+        source.mask.assign(source.width * source.height, 1);
+    }
+    return source;
+}
+
+/// Generate synthetic frames, in parallel, and compress them
+static auto load_synthetic(h5read_detector detector, size_t count) -> FrameSource {
+    h5read_synthetic_params params;
+    h5read_synthetic_default_params(&params);
+    params.detector = detector;
+    params.frames = count;
+    params.threads = 1;
+    H5Read reader(params);
+    auto source = describe_source(reader);
+    source.frames.resize(count);
+
+    std::atomic<size_t> next = 0;
+    std::vector<std::jthread> workers;
+    for (unsigned t = 0; t < std::max(1u, std::thread::hardware_concurrency()); ++t) {
+        workers.emplace_back([&]() {
+            auto image = std::vector<uint16_t>(source.width * source.height);
+            for (size_t i = next++; i < count; i = next++) {
+                reader.get_image_into(i, image.data());
+                source.frames[i] = compress_frame(image);
+            }
+        });
+    }
+    return source;
+}
+
+/// Read the raw chunks of an existing dataset
+static auto load_dataset(const std::string &filename, size_t count) -> FrameSource {
+    H5Read reader(filename);
+    auto source = describe_source(reader);
+    count = std::min(count, reader.get_number_of_images());
+    auto buffer = std::vector<uint8_t>(source.width * source.height * 2 + (1 << 20));
+    for (size_t i = 0; i < count; ++i) {
+        auto chunk = reader.try_get_raw_chunk(i, {buffer.data(), buffer.size()});
+        if (chunk.status == H5READ_ERROR_BUFFER_TOO_SMALL) {
+            buffer.resize(chunk.size);
+            chunk = reader.try_get_raw_chunk(i, {buffer.data(), buffer.size()});
+        }
+        if (!chunk) {
+            print("Error: Reading chunk {} of {}: {}\n",
+                  i,
+                  filename,
+                  h5read_status_string(chunk.status));
+            std::exit(1);
+        }
+        source.frames.emplace_back(chunk.data.begin(), chunk.data.end());
+    }
+    return source;
+}
+
+/// Sleep until a time, finishing with a spin so that we aren't late by
+/// the scheduler wakeup latency
+static void wait_until(clock_type::time_point due) {
+    std::this_thread::sleep_until(due - std::chrono::microseconds(200));
+    while (clock_type::now() < due) {
+    }
+}
+
+/// Write a whole file with plain POSIX I/O, exiting on failure
+static void write_file(const std::string &path, const void *data, size_t size) {
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        print("Error: Could not open {} for writing: {}\n", path, strerror(errno));
+        std::exit(1);
+    }
+    auto ptr = static_cast<const uint8_t *>(data);
+    while (size > 0) {
+        ssize_t written = write(fd, ptr, size);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            print("Error: Writing {} failed: {}\n", path, strerror(errno));
+            std::exit(1);
+        }
+        ptr += written;
+        size -= written;
+    }
+    close(fd);
+}
+
+/// Write a file under a temporary name, then move it into place
+static void write_file_atomic(const std::string &directory,
+                              const std::string &name,
+                              const void *data,
+                              size_t size) {
+    auto temporary = format("{}/.{}.tmp", directory, name);
+    auto destination = format("{}/{}", directory, name);
+    write_file(temporary, data, size);
+    if (rename(temporary.c_str(), destination.c_str()) != 0) {
+        print("Error: Could not rename {}: {}\n", temporary, strerror(errno));
+        std::exit(1);
+    }
+}
+
+/// Value at a fraction through a sorted list
+static auto percentile(const std::vector<double> &sorted, double fraction) -> double {
+    if (sorted.empty()) return 0;
+    return sorted[std::min(sorted.size() - 1, size_t(fraction * sorted.size()))];
+}
+
+int main(int argc, char **argv) {
+    auto parser = argparse::ArgumentParser(
+      "shm_simulator", "", argparse::default_arguments::help);
+    parser.add_argument("directory").help("Folder to write frames into");
+    parser.add_argument("-n", "--images")
+      .help("Number of frames to write")
+      .metavar("NUM")
+      .default_value<uint32_t>(1000)
+      .scan<'u', uint32_t>();
+    parser.add_argument("--fps")
+      .help("Frames per second to write at. 0 for as fast as possible.")
+      .metavar("RATE")
+      .default_value<float>(500)
+      .scan<'f', float>();
+    parser.add_argument("--source")
+      .help("Frames to write: pattern, synthetic, or a Nexus file to replay")
+      .metavar("SOURCE")
+      .default_value<std::string>("pattern");
+    parser.add_argument("--distinct")
+      .help("Synthetic or replayed frames to load, and cycle through")
+      .metavar("NUM")
+      .default_value<uint32_t>(100)
+      .scan<'u', uint32_t>();
+    parser.add_argument("--detector")
+      .help("Synthetic detector size: 4m or 16m")
+      .default_value<std::string>("4m");
+    parser.add_argument("--frame-size")
+      .help("Size of each pattern frame file, in bytes")
+      .metavar("BYTES")
+      .default_value<uint32_t>(1 << 20)
+      .scan<'u', uint32_t>();
+    parser.add_argument("--commit")
+      .help("How frames are committed: rename, marker or close")
+      .default_value<std::string>("rename");
+    parser.add_argument("--verify")
+      .help("Read back and check every frame, as it is committed")
+      .default_value(false)
+      .implicit_value(true);
+    parser.add_argument("--prewrite")
+      .help("Frames to write before the verifying reader starts")
+      .metavar("NUM")
+      .default_value<uint32_t>(0)
+      .scan<'u', uint32_t>();
+    parser.add_argument("--keep")
+      .help("Don't remove verified frames")
+      .default_value(false)
+      .implicit_value(true);
+    try {
+        parser.parse_args(argc, argv);
+    } catch (std::runtime_error &e) {
+        print("Error: {}\n{}", e.what(), parser.usage());
+        std::exit(1);
+    }
+    auto directory = parser.get<std::string>("directory");
+    size_t num_images = parser.get<uint32_t>("images");
+    size_t num_loaded = std::clamp<size_t>(
+      parser.get<uint32_t>("distinct"), 1, std::max<size_t>(num_images, 1));
+    float fps = parser.get<float>("fps");
+    auto source_name = parser.get<std::string>("source");
+    size_t frame_size = std::max<size_t>(parser.get<uint32_t>("frame-size"), 12);
+    auto commit = parser.get<std::string>("commit");
+    bool do_verify = parser.get<bool>("verify");
+    bool do_keep = parser.get<bool>("keep");
+    size_t num_prewritten =
+      std::min<size_t>(parser.get<uint32_t>("prewrite"), num_images);
+    if (commit != "rename" && commit != "marker" && commit != "close") {
+        print("Error: Unknown commit convention '{}'\n", commit);
+        std::exit(1);
+    }
+    auto detector = parser.get<std::string>("detector");
+    if (detector != "4m" && detector != "16m") {
+        print("Error: Unknown detector '{}'\n", detector);
+        std::exit(1);
+    }
+
+    // Pattern frames are generated as we go, on a 4M detector
+    FrameSource source{2068, 2162};
+    if (source_name == "synthetic") {
+        print("Generating {} synthetic frames\n", num_loaded);
+        source = load_synthetic(
+          detector == "16m" ? H5READ_EIGER2XE_16M : H5READ_EIGER2XE_4M, num_loaded);
+    } else if (source_name != "pattern") {
+        print("Loading {} frames from {}\n", num_loaded, source_name);
+        source = load_dataset(source_name, num_loaded);
+        if (source.frames.empty()) {
+            print("Error: {} has no images to replay\n", source_name);
+            std::exit(1);
+        }
+    } else {
+        source.mask.assign(source.width * source.height, 1);
+    }
+    bool is_pattern = source.frames.empty();
+    size_t width = source.width, height = source.height;
+    std::filesystem::create_directories(directory);
+
+    // Headers are always moved into place, so a reader never sees them partial
+    json header = {
+      {"nimages", num_images},
+      {"ntrigger", 1},
+      {"x_pixels_in_detector", width},
+      {"y_pixels_in_detector", height},
+      {"bit_depth_image", 16},
+    };
+    // Writing in place ("close") is the undeclared, older convention
+    if (commit != "close") {
+        header["frame_commit"] = commit;
+    }
+    // The stream mask is nonzero for bad pixels
+    auto mask = std::vector<int32_t>(width * height);
+    for (size_t i = 0; i < mask.size(); ++i) {
+        mask[i] = source.mask[i] ? 0 : 1;
+    }
+    write_file_atomic(directory, "start_4", mask.data(), mask.size() * sizeof(int32_t));
+    auto header_text = header.dump();
+    write_file_atomic(directory, "start_1", header_text.data(), header_text.size());
+
+    // When each frame was committed, to measure the latency until it is
+    // seen, and what it should contain
+    auto commit_times = std::vector<std::atomic<int64_t>>(num_images);
+    auto frame_hashes = std::vector<std::atomic<uint64_t>>(num_images);
+    auto since_start = [start = clock_type::now()]() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(clock_type::now()
+                                                                    - start)
+          .count();
+    };
+
+    auto pattern_frame = std::vector<uint8_t>(is_pattern ? frame_size : 0);
+    /// Get the contents of a frame, and note what it should be read as
+    auto next_frame = [&](size_t i) -> const std::vector<uint8_t> & {
+        if (is_pattern) {
+            fill_frame(pattern_frame, i, width * height * 2);
+        }
+        const auto &frame =
+          is_pattern ? pattern_frame : source.frames[i % source.frames.size()];
+        if (do_verify) {
+            frame_hashes[i] = frame_hash({frame.data(), frame.size()});
+        }
+        return frame;
+    };
+    /// Write a frame into the folder, and commit it
+    auto write_frame = [&](size_t i, const std::vector<uint8_t> &frame) {
+        auto name = format("image_{:06d}_2", i);
+        auto path = format("{}/{}", directory, name);
+        if (commit == "rename") {
+            auto temporary = format("{}/.{}.tmp", directory, name);
+            write_file(temporary, frame.data(), frame.size());
+            commit_times[i] = since_start();
+            if (rename(temporary.c_str(), path.c_str()) != 0) {
+                print("Error: Could not rename {}: {}\n", temporary, strerror(errno));
+                std::exit(1);
+            }
+        } else if (commit == "marker") {
+            write_file(path, frame.data(), frame.size());
+            commit_times[i] = since_start();
+            write_file(path + ".commit", nullptr, 0);
+        } else {
+            // Written in place, relying on the reader seeing the close
+            commit_times[i] = since_start();
+            write_file(path, frame.data(), frame.size());
+        }
+    };
+
+    // Frames already in the folder when the reader starts must still be
+    // counted, even if they were written in place
+    if (num_prewritten) {
+        print("Writing {} frames before starting the reader\n", num_prewritten);
+    }
+    for (size_t i = 0; i < num_prewritten; ++i) {
+        write_frame(i, next_frame(i));
+    }
+
+    std::jthread verifier;
+    size_t bad_frames = 0;
+    auto latencies = std::vector<double>();
+    if (do_verify) {
+        // Start watching before the frames are written, as frames written in
+        // place are otherwise only counted once they have settled
+        auto reader = std::make_unique<SHMRead>(directory);
+        verifier = std::jthread([&, reader = std::move(reader)]() {
+            auto buffer = std::vector<uint8_t>(width * height * 2 + (1 << 20));
+            latencies.reserve(num_images);
+            for (size_t i = 0; i < num_images; ++i) {
+                if (!reader->wait_for_image(i, 10)) {
+                    print("Error: Timed out waiting for frame {}\n", i);
+                    bad_frames += num_images - i;
+                    break;
+                }
+                // Frames written before the reader started have no latency
+                if (i >= num_prewritten) {
+                    latencies.push_back((since_start() - commit_times[i]) * 1e-3);
+                }
+                auto chunk =
+                  reader->get_raw_chunk_view(i, {buffer.data(), buffer.size()});
+                if (frame_hash(chunk.data) != frame_hashes[i]) {
+                    print("\033[1;31mFrame {} was incomplete ({} bytes)\033[0m\n",
+                          i,
+                          chunk.data.size());
+                    bad_frames += 1;
+                }
+                chunk = {};
+                if (!do_keep) {
+                    auto path = format("{}/image_{:06d}_2", directory, i);
+                    std::filesystem::remove(path);
+                    std::filesystem::remove(path + ".commit");
+                }
+            }
+        });
+    }
+
+    auto frame_description = is_pattern ? format("{} KB", frame_size / 1024)
+                                        : format("{}x{}", width, height);
+    print("Writing {} frames of {} to {} at {} ({} commit)\n",
+          num_images - num_prewritten,
+          frame_description,
+          directory,
+          fps > 0 ? format("{} fps", fps) : "full speed",
+          commit);
+
+    auto period = std::chrono::duration_cast<clock_type::duration>(
+      std::chrono::duration<double>(fps > 0 ? 1.0 / fps : 0));
+    size_t late_frames = 0, total_bytes = 0;
+    // How far after its due time each frame was started
+    auto start_delays = std::vector<double>();
+    start_delays.reserve(num_images);
+    auto start_time = clock_type::now();
+    for (size_t i = num_prewritten; i < num_images; ++i) {
+        // Generate outside of the frame time, as the detector would
+        const auto &frame = next_frame(i);
+        auto due = start_time + (i - num_prewritten) * period;
+        if (clock_type::now() > due + period) {
+            late_frames += 1;
+        }
+        if (fps > 0) {
+            wait_until(due);
+        }
+        start_delays.push_back(
+          std::chrono::duration<double, std::micro>(clock_type::now() - due).count());
+
+        write_frame(i, frame);
+        total_bytes += frame.size();
+    }
+    float total_time =
+      std::chrono::duration<double>(clock_type::now() - start_time).count();
+    print("Wrote {} frames in {:.2f} s ({:.0f} fps, {:.2f} GB/s); {} frames late\n",
+          num_images - num_prewritten,
+          total_time,
+          (num_images - num_prewritten) / total_time,
+          total_bytes / total_time / 1e9,
+          late_frames);
+    if (fps > 0) {
+        std::sort(start_delays.begin(), start_delays.end());
+        print("Pacing: frames started a median {:.1f} µs, p99 {:.1f} µs after due\n",
+              percentile(start_delays, 0.5),
+              percentile(start_delays, 0.99));
+    }
+
+    if (do_verify) {
+        verifier.join();
+        std::sort(latencies.begin(), latencies.end());
+        if (!latencies.empty()) {
+            print(
+              "Commit to read latency: median {:.1f} µs, p99 {:.1f} µs, max {:.1f} "
+              "µs\n",
+              percentile(latencies, 0.5),
+              percentile(latencies, 0.99),
+              latencies.back());
+        }
+        if (bad_frames) {
+            print("\033[1;31mError: {} frames were read incomplete\033[0m\n",
+                  bad_frames);
+            return 1;
+        }
+        print("All {} frames verified complete\n", num_images);
+    }
+}
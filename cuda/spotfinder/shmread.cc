@@ -1,17 +1,96 @@
-
-
 #include "shmread.hpp"
 
+#include <fcntl.h>
 #include <fmt/core.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
 #include <iostream>
 #include <nlohmann/json.hpp>
+#include <thread>
 
 #include "common.hpp"
 
 using json = nlohmann::json;
 using namespace fmt;
 
+/// Pool of fixed-size regions of address space to map frame files into.
+///
+/// Each frame is a new file, so would need a new mapping. Instead of
+/// creating and destroying a fresh mapping for every frame, each is mapped
+/// over a free slot with MAP_FIXED, and the slot is returned when released.
+class SHMRead::MappingPool {
+  public:
+    MappingPool(size_t slot_size) : _slot_size(slot_size) {}
+    ~MappingPool() {
+        for (auto slot : _slots) {
+            munmap(slot, _slot_size);
+        }
+    }
+    auto slot_size() const -> size_t {
+        return _slot_size;
+    }
+    /// Get a free slot, reserving a new one if none are available
+    auto acquire() -> void * {
+        std::scoped_lock lock(_mutex);
+        if (!_free.empty()) {
+            auto slot = _free.back();
+            _free.pop_back();
+            return slot;
+        }
+        void *slot = reserve(nullptr);
+        if (slot == MAP_FAILED) throw std::bad_alloc();
+        _slots.push_back(slot);
+        return slot;
+    }
+    void release(void *slot) {
+        // Drop the frame mapping, so that deleted frames can be freed
+        reserve(slot);
+        std::scoped_lock lock(_mutex);
+        _free.push_back(slot);
+    }
+
+  private:
+    auto reserve(void *address) -> void * {
+        return mmap(address,
+                    _slot_size,
+                    PROT_NONE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE
+                      | (address ? MAP_FIXED : 0),
+                    -1,
+                    0);
+    }
+    size_t _slot_size;
+    std::mutex _mutex;
+    std::vector<void *> _slots;
+    std::vector<void *> _free;
+};
+
+/// How long a frame written in place must be left unchanged before we can
+/// assume that it is complete, when we haven't seen it being closed
+constexpr auto settle_time = std::chrono::seconds(1);
+/// How often to check for frames when we can't watch the folder
+constexpr auto poll_interval = std::chrono::milliseconds(10);
+
+/// Parse the frame index from a filename e.g. image_000001_2, with a suffix
+static auto parse_frame_index(const char *filename, const char *suffix)
+  -> std::optional<size_t> {
+    size_t index = 0;
+    int part = 0, length = 0;
+    if (sscanf(filename, "image_%zu_%d%n", &index, &part, &length) == 2 && part == 2
+        && strcmp(filename + length, suffix) == 0) {
+        return index;
+    }
+    return std::nullopt;
+}
+
 SHMRead::SHMRead(const std::string &path) : _base_path(path) {
     // Read the header
     auto header_path = path + "/start_1";
@@ -25,6 +104,18 @@ SHMRead::SHMRead(const std::string &path) : _base_path(path) {
       data["x_pixels_in_detector"].template get<size_t>(),
     };
 
+    // Writers that cannot rename frames into place must say so
+    if (data.contains("frame_commit")) {
+        auto commit = data["frame_commit"].template get<std::string>();
+        if (commit == "marker") {
+            _commit = FrameCommit::Marker;
+        } else if (commit != "rename") {
+            throw std::runtime_error(
+              format("Unknown frame_commit convention '{}'", commit));
+        }
+        _commit_by_existence = true;
+    }
+
     uint8_t bit_depth_image = data["bit_depth_image"].template get<uint8_t>();
 
     if (bit_depth_image != 16) {
@@ -44,15 +135,225 @@ SHMRead::SHMRead(const std::string &path) : _base_path(path) {
         _mask.push_back(!v);
     }
     // return {destination.data(), static_cast<size_t>(f.gcount())};
+
+    // Compressed frames are practically never larger than the raw image.
+    // Any that are just fall back to a normal read.
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t max_frame_size =
+      _image_shape[0] * _image_shape[1] * (bit_depth_image / 8) + 2 * page;
+    _mappings = std::make_shared<MappingPool>(max_frame_size & ~(page - 1));
+
+    // Watch for frames being committed, rather than checking each file. A
+    // frame is complete once it is renamed into place (or closed, for older
+    // writers that write in place); commit markers are empty, so are
+    // complete as soon as they are created. Start watching before scanning,
+    // so that nothing is missed. Without a watch, we poll instead, and for
+    // older writers only count frames that have settled.
+    uint32_t events = _commit == FrameCommit::Marker
+                        ? IN_CREATE | IN_MOVED_TO
+                        : IN_CLOSE_WRITE | IN_MOVED_TO;
+    _watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (_watch_fd >= 0
+        && inotify_add_watch(_watch_fd, _base_path.c_str(), events) < 0) {
+        close(_watch_fd);
+        _watch_fd = -1;
+    }
+    if (_watch_fd >= 0) {
+        scan_committed();
+    }
+}
+
+SHMRead::~SHMRead() {
+    if (_watch_fd >= 0) close(_watch_fd);
+}
+
+auto SHMRead::frame_path(size_t index) const -> std::string {
+    return format("{}/image_{:06d}_2", _base_path, index);
+}
+
+auto SHMRead::commit_path(size_t index) const -> std::string {
+    if (_commit == FrameCommit::Marker) {
+        return frame_path(index) + ".commit";
+    }
+    return frame_path(index);
+}
+
+auto SHMRead::parse_commit_index(const char *filename) const
+  -> std::optional<size_t> {
+    return parse_frame_index(filename, _commit == FrameCommit::Marker ? ".commit" : "");
+}
+
+void SHMRead::mark_committed(size_t index) {
+    if (index < _committed_below) return;
+    _committed.insert(index);
+    // Only keep the frames that are past a gap
+    while (!_committed.empty() && *_committed.begin() == _committed_below) {
+        _committed.erase(_committed.begin());
+        ++_committed_below;
+    }
+}
+
+auto SHMRead::is_committed_on_disk(size_t index) const -> bool {
+    std::error_code error;
+    auto modified = std::filesystem::last_write_time(commit_path(index), error);
+    if (error) return false;
+    // A frame written in place might still be being written, unless it has
+    // been left alone for long enough
+    return _commit_by_existence
+           || std::filesystem::file_time_type::clock::now() - modified >= settle_time;
+}
+
+void SHMRead::scan_committed() {
+    for (auto &entry : std::filesystem::directory_iterator(_base_path)) {
+        auto index = parse_commit_index(entry.path().filename().c_str());
+        if (!index || *index < _committed_below || _committed.contains(*index)) {
+            continue;
+        }
+        if (is_committed_on_disk(*index)) {
+            mark_committed(*index);
+        } else {
+            // If it is still being written we will see it closed, but it
+            // might have been closed before we started watching
+            _settling.insert(*index);
+        }
+    }
+}
+
+void SHMRead::update_committed() {
+    alignas(inotify_event) char events[4096];
+    ssize_t length = 0;
+    bool overflowed = false;
+    while ((length = read(_watch_fd, events, sizeof(events))) > 0) {
+        for (char *ptr = events; ptr < events + length;) {
+            auto event = reinterpret_cast<inotify_event *>(ptr);
+            if (event->mask & IN_Q_OVERFLOW) {
+                overflowed = true;
+            } else if (event->len > 0) {
+                if (auto index = parse_commit_index(event->name)) {
+                    mark_committed(*index);
+                }
+            }
+            ptr += sizeof(inotify_event) + event->len;
+        }
+    }
+    if (overflowed) {
+        // Events were lost, so find the frames they would have committed
+        scan_committed();
+    }
+    for (auto it = _settling.begin(); it != _settling.end();) {
+        if (*it < _committed_below || _committed.contains(*it)) {
+            it = _settling.erase(it);
+        } else if (is_committed_on_disk(*it)) {
+            mark_committed(*it);
+            it = _settling.erase(it);
+        } else {
+            ++it;
+        }
+    }
 }
 
 bool SHMRead::is_image_available(size_t index) {
-    return std::filesystem::exists(format("{}/image_{:06d}_2", _base_path, index));
+    if (_watch_fd < 0) {
+        return is_committed_on_disk(index);
+    }
+    std::scoped_lock lock(_commit_mutex);
+    if (index < _committed_below) return true;
+    if (!_watching) update_committed();
+    return index < _committed_below || _committed.contains(index);
+}
+
+bool SHMRead::wait_for_image(size_t index, float timeout) {
+    auto deadline =
+      std::chrono::steady_clock::now() + std::chrono::duration<float>(timeout);
+    auto milliseconds_left = [&]() {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(
+                 deadline - std::chrono::steady_clock::now())
+          .count();
+    };
+    if (_watch_fd < 0) {
+        // We couldn't watch the folder, so fall back to polling
+        while (!is_committed_on_disk(index)) {
+            auto remaining = milliseconds_left();
+            if (remaining <= 0) return false;
+            std::this_thread::sleep_for(
+              std::min(std::chrono::milliseconds(remaining), poll_interval));
+        }
+        return true;
+    }
+    std::unique_lock lock(_commit_mutex);
+    while (true) {
+        if (!_watching) update_committed();
+        if (index < _committed_below || _committed.contains(index)) return true;
+        auto remaining = milliseconds_left();
+        if (remaining <= 0) return false;
+        if (_watching) {
+            // Another thread is waiting on the watch, and will tell us
+            _commit_checked.wait_until(lock, deadline);
+            continue;
+        }
+        // Frames that are settling don't send events, so check them again
+        if (!_settling.empty()) {
+            remaining = std::min<int64_t>(
+              remaining,
+              std::chrono::duration_cast<std::chrono::milliseconds>(settle_time)
+                .count());
+        }
+        _watching = true;
+        lock.unlock();
+        pollfd watch{.fd = _watch_fd, .events = POLLIN};
+        poll(&watch, 1, remaining);
+        lock.lock();
+        _watching = false;
+        update_committed();
+        _commit_checked.notify_all();
+    }
+}
+
+auto SHMRead::get_raw_chunk_view(size_t index, SPAN<uint8_t> destination)
+  -> ChunkView {
+    if (_direct_io) {
+        return Reader::get_raw_chunk_view(index, destination);
+    }
+    int fd = open(frame_path(index).c_str(), O_RDONLY);
+    if (fd < 0) {
+        return {};
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size == 0
+        || info.st_size > _mappings->slot_size()) {
+        close(fd);
+        return Reader::get_raw_chunk_view(index, destination);
+    }
+    void *slot = _mappings->acquire();
+    // Populate now, so that the decompressor doesn't take page faults
+    void *data = mmap(
+      slot, info.st_size, PROT_READ, MAP_SHARED | MAP_FIXED | MAP_POPULATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        _mappings->release(slot);
+        return Reader::get_raw_chunk_view(index, destination);
+    }
+    // Hand the slot back to the pool when the last user is done
+    auto owner = std::shared_ptr<const void>(
+      slot, [mappings = _mappings](const void *slot) {
+          mappings->release(const_cast<void *>(slot));
+      });
+    return {{static_cast<const uint8_t *>(data), static_cast<size_t>(info.st_size)},
+            owner};
 }
 
 SPAN<uint8_t> SHMRead::get_raw_chunk(size_t index, SPAN<uint8_t> destination) {
-    std::ifstream f(format("{}/image_{:06d}_2", _base_path, index),
-                    std::ios::in | std::ios::binary);
+    auto filename = frame_path(index);
+    if (_direct_io) {
+        size_t size = 0;
+        if (h5read_direct_read_file(
+              filename.c_str(), &size, destination.data(), destination.size())) {
+            return {destination.data(), size};
+        }
+        print("Warning: Direct read of {} failed; using buffered reads\n", filename);
+        _direct_io = false;
+    }
+    std::ifstream f(filename, std::ios::in | std::ios::binary);
     f.read(reinterpret_cast<char *>(destination.data()), destination.size());
     return {destination.data(), static_cast<size_t>(f.gcount())};
 }
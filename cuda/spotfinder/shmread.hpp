@@ -3,23 +3,93 @@
 #include <cuda_runtime.h>
 #include <fmt/core.h>
 
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <set>
 #include <vector>
 
 #include "h5read.h"
 
 class SHMRead : public Reader {
+  public:
+    /// How the writer signals that a frame file is complete.
+    ///
+    /// Rename:  Frames are written under another name (e.g. with a leading
+    ///          '.') and renamed into place, so only complete frames exist.
+    /// Marker:  Frames are written in place, and an empty commit marker
+    ///          file image_NNNNNN_2.commit is created once each is closed.
+    enum class FrameCommit { Rename, Marker };
+
   private:
+    class MappingPool;
+
     size_t _num_images;
     std::array<size_t, 2> _image_shape;
     const std::string _base_path;
     std::vector<uint8_t> _mask;
+    bool _direct_io = false;
+    FrameCommit _commit = FrameCommit::Rename;
+    /// Whether a frame's commit file existing proves that it is complete.
+    /// Only if the writer declares its convention, as writers that don't
+    /// might write frames in place.
+    bool _commit_by_existence = false;
+    /// inotify descriptor watching the frame folder, or -1 if not watching
+    int _watch_fd = -1;
+    /// Guards the commit tracking, so that threads can wait at once
+    std::mutex _commit_mutex;
+    /// Notified whenever the thread waiting on the watch has checked it
+    std::condition_variable _commit_checked;
+    /// Whether a thread is waiting on the watch. Only it reads the events,
+    /// so that no other thread can take the event that would wake it.
+    bool _watching = false;
+    /// Every frame below this has been committed
+    size_t _committed_below = 0;
+    /// Committed frames above _committed_below, which writers can commit
+    /// out of order
+    std::set<size_t> _committed;
+    /// Frames of an undeclared writer that were already in the folder, but
+    /// were changed too recently to be sure that they are complete
+    std::set<size_t> _settling;
+    /// Reusable address space that frames are memory-mapped into
+    std::shared_ptr<MappingPool> _mappings;
+
+    auto frame_path(size_t index) const -> std::string;
+    /// The file whose presence marks the frame as complete
+    auto commit_path(size_t index) const -> std::string;
+    auto parse_commit_index(const char *filename) const -> std::optional<size_t>;
+    void mark_committed(size_t index);
+    /// Whether the frame file is committed, as far as the folder shows
+    auto is_committed_on_disk(size_t index) const -> bool;
+    /// Mark every frame that the folder shows is committed
+    void scan_committed();
+    /// Read any pending directory events, to mark committed frames
+    void update_committed();
 
   public:
     SHMRead(const std::string &path);
+    ~SHMRead();
+    SHMRead(const SHMRead &) = delete;
+    SHMRead &operator=(const SHMRead &) = delete;
+
+    auto frame_commit() const -> FrameCommit {
+        return _commit;
+    }
 
     bool is_image_available(size_t index);
+    bool wait_for_image(size_t index, float timeout);
+    bool can_wait_concurrently() const {
+        return true;
+    }
+
+    bool set_direct_io(bool enable) {
+        _direct_io = enable;
+        return true;
+    }
 
     SPAN<uint8_t> get_raw_chunk(size_t index, SPAN<uint8_t> destination);
+    /// Memory-map the frame, so it can be read without any copy
+    ChunkView get_raw_chunk_view(size_t index, SPAN<uint8_t> destination);
 
     virtual auto get_raw_chunk_compression() -> ChunkCompression {
         return Reader::ChunkCompression::BITSHUFFLE_LZ4;
@@ -15,8 +15,11 @@
 #include <chrono>
 #include <cmath>
 #include <csignal>
+#include <fstream>
 #include <iostream>
+#include <iterator>
 #include <memory>
+#include <optional>
 #include <ranges>
 #include <stop_token>
 #include <thread>
@@ -24,7 +27,12 @@
 
 #include "cbfread.hpp"
 #include "common.hpp"
+#include "diagnostic_writer.hpp"
 #include "h5read.h"
+#include "label3d.hpp"
+#include "latency.hpp"
+#include "results_writer.hpp"
+#include "scheduler.hpp"
 #include "shmread.hpp"
 #include "standalone.h"
 
@@ -50,10 +58,24 @@ auto operator==(const int2 &left, const int2 &right) -> bool {
     return left.x == right.x && left.y == right.y;
 }
 
-struct Reflection {
-    int l, t, r, b;
-    int num_pixels = 0;
-};
+/// Allocate page-locked host memory for transfers, backed by huge pages on
+/// the calling thread's NUMA node
+template <typename T>
+auto make_cuda_pinned_huge_malloc(size_t num_items) {
+    size_t size = sizeof(T) * num_items;
+    auto obj = static_cast<T *>(h5read_huge_alloc(size, H5READ_NUMA_LOCAL));
+    if (obj == nullptr) throw std::bad_alloc();
+    auto err = cudaHostRegister(obj, size, cudaHostRegisterDefault);
+    if (err != cudaSuccess) {
+        h5read_huge_free(obj, size);
+        throw cuda_error(format("Error in make_cuda_pinned_huge_malloc: {}",
+                                cuda_error_string(err)));
+    }
+    return std::shared_ptr<T[]>{obj, [size](T *ptr) {
+                                    cudaHostUnregister(ptr);
+                                    h5read_huge_free(ptr, size);
+                                }};
+}
 
 template <typename T>
 struct PitchedMalloc {
@@ -84,6 +106,60 @@ struct PitchedMalloc {
     size_t pitch;
 };
 
+/// The outcome of processing a frame, reported once all earlier frames are
+struct FrameResult {
+    bool skipped = false;
+    /// The thread that labelled the frame
+    int thread_id = 0;
+    size_t num_strong_pixels = 0;
+    size_t num_reflections = 0;
+    /// Times from the start of the threshold stage on the GPU, in ms
+    float copy_ms = 0, kernel_ms = 0, postcopy_ms = 0;
+    float label_ms = 0;
+    /// Whether the DIALS standalone comparison matched, if run
+    std::optional<bool> validation_matches;
+    /// The strong pixels, for joining into 3D reflections in frame order
+    std::vector<PixelRun> runs;
+    /// The reflections, if they are being written out
+    std::vector<Reflection> reflections;
+};
+
+/// A frame in flight, with the host buffers it uses between stages
+struct FrameWork {
+    size_t index = 0;
+    std::unique_ptr<uint8_t[], HugeBufferDeleter> raw_chunk_alloc;
+    span<uint8_t> raw_chunk_buffer;
+    std::shared_ptr<pixel_t[]> host_image;
+    std::shared_ptr<uint8_t[]> host_results;
+    /// The raw data, which might be borrowed from the reader
+    Reader::ChunkView chunk;
+    FrameResult result;
+    std::chrono::steady_clock::time_point start_time;
+};
+
+/// The stages each frame is scheduled through, in order
+constexpr std::array pipeline_stages = {
+  Stage::Read, Stage::Decompress, Stage::Threshold, Stage::Label};
+
+/// Position of a stage in pipeline_stages, as the scheduler numbers them
+constexpr auto stage_index(Stage stage) -> size_t {
+    return std::ranges::find(pipeline_stages, stage) - pipeline_stages.begin();
+}
+
+/// GPU resources for a thread that runs the threshold stage
+struct ThresholdContext {
+    CudaStream stream;
+    PitchedMalloc<pixel_t> device_image;
+    PitchedMalloc<uint8_t> device_results;
+    // NPP buffers, for labelling on the GPU
+    std::shared_ptr<Npp8u> device_label_buffer;
+    PitchedMalloc<Npp32u> device_label_dest;
+    NppStreamContext npp_context;
+    CudaEvent start, copy, post, postcopy;
+
+    ThresholdContext(int width, int height, const PitchedMalloc<uint8_t> &mask);
+};
+
 /// Copy the mask from a reader into a pitched GPU area
 template <typename T>
 auto upload_mask(T &reader) -> PitchedMalloc<uint8_t> {
@@ -157,6 +233,22 @@ auto create_npp_context_from_stream(const CudaStream &stream) -> NppStreamContex
     return npp_context;
 }
 
+ThresholdContext::ThresholdContext(int width,
+                                   int height,
+                                   const PitchedMalloc<uint8_t> &mask)
+    : device_image(width, height),
+      device_results(make_cuda_malloc<uint8_t[]>(mask.pitch * height),
+                     width,
+                     height,
+                     mask.pitch),
+      device_label_dest(width, height),
+      npp_context(create_npp_context_from_stream(stream)) {
+    int npp_buffer_size = 0;
+    NPP_CHECK(
+      nppiLabelMarkersUFGetBufferSize_32u_C1R({width, height}, &npp_buffer_size));
+    device_label_buffer = make_cuda_malloc<Npp8u>(npp_buffer_size);
+}
+
 void wait_for_ready_for_read(const std::string &path,
                              std::function<bool(const std::string &)> checker,
                              float timeout = 120.0f) {
@@ -176,6 +268,15 @@ void wait_for_ready_for_read(const std::string &path,
           "( ●    )",
           "(●     )",
         };
+        // Watch the path (or the folder it will appear in) so that we wake
+        // up as soon as anything changes, instead of waiting a full cycle
+        auto watch_path = std::filesystem::path(path);
+        if (!std::filesystem::is_directory(watch_path)) {
+            watch_path = watch_path.parent_path();
+        }
+        auto watch = std::unique_ptr<h5read_watch, decltype(&h5read_watch_free)>(
+          h5read_watch_open(watch_path.empty() ? "." : watch_path.c_str()),
+          &h5read_watch_free);
         int i = 0;
         while (!checker(path)) {
             auto wait_time = std::chrono::duration_cast<std::chrono::duration<double>>(
@@ -189,18 +290,60 @@ void wait_for_ready_for_read(const std::string &path,
                 print("\nError: Waited too long for read availability\n");
                 std::exit(1);
             }
-            std::this_thread::sleep_for(80ms);
+            // The wait here is only to keep the spinner turning
+            if (watch) {
+                h5read_watch_wait(watch.get(), 80);
+            } else {
+                std::this_thread::sleep_for(80ms);
+            }
         }
         print("\n");
     }
 }
 
+/// Write the current pipeline timings to a JSON file, replacing it whole
+void write_latency_json(const std::string &path, const PipelineStats &stats) {
+    auto temporary = path + ".tmp";
+    {
+        std::ofstream out(temporary);
+        out << stats.to_json().dump(2) << "\n";
+    }
+    std::filesystem::rename(temporary, path);
+}
+
+/// Print the latency distribution and throughput of every stage
+void print_latency_table(const PipelineStats &stats) {
+    auto total = stats.merged();
+    double seconds = stats.elapsed();
+    print("\n{:>12} {:>7} {:>9} {:>9} {:>9} {:>9} {:>8} {:>6}\n",
+          "Stage",
+          "Count",
+          "p50 ms",
+          "p99 ms",
+          "p999 ms",
+          "Max ms",
+          "fps",
+          "Busy");
+    for (size_t i = 0; i < num_stages; ++i) {
+        auto &histogram = (*total)[static_cast<Stage>(i)];
+        print("{:>12} {:7d} {:9.2f} {:9.2f} {:9.2f} {:9.2f} {:8.1f} {:5.0f}%\n",
+              stage_names[i],
+              histogram.count(),
+              histogram.percentile(0.5) * 1e-6,
+              histogram.percentile(0.99) * 1e-6,
+              histogram.percentile(0.999) * 1e-6,
+              histogram.max() * 1e-6,
+              histogram.count() / seconds,
+              100 * histogram.sum() * 1e-9 / (seconds * stats.num_threads()));
+    }
+}
+
 int main(int argc, char **argv) {
     // Parse arguments and get our H5Reader
     auto parser = CUDAArgumentParser();
     parser.add_h5read_arguments();
     parser.add_argument("-n", "--threads")
-      .help("Number of parallel reader threads")
+      .help("Number of worker threads, for the stages without their own pool")
       .default_value<uint32_t>(1)
       .metavar("NUM")
       .scan<'u', uint32_t>();
@@ -216,11 +359,33 @@ int main(int argc, char **argv) {
       .help("Write diagnostic output images")
       .default_value(false)
       .implicit_value(true);
+    parser.add_argument("--writeout-every")
+      .help("Only write diagnostic images for every Nth image")
+      .metavar("N")
+      .default_value<uint32_t>(1)
+      .scan<'u', uint32_t>();
+    parser.add_argument("--writeout-scale")
+      .help("Shrink diagnostic images by this factor")
+      .metavar("N")
+      .default_value<uint32_t>(1)
+      .scan<'u', uint32_t>();
+    parser.add_argument("--writeout-threads")
+      .help("Number of low-priority threads to write diagnostic images with")
+      .metavar("NUM")
+      .default_value<uint32_t>(2)
+      .scan<'u', uint32_t>();
     parser.add_argument("--min-spot-size")
       .help("Reflections with a pixel count below this will be discarded.")
       .metavar("N")
       .default_value<uint32_t>(2)
       .scan<'u', uint32_t>();
+    parser.add_argument("--output")
+      .help("Stream strong pixel counts and reflections to this binary file")
+      .metavar("FILE");
+    parser.add_argument("--3d")
+      .help("Also join strong pixels on consecutive images into 3D reflections")
+      .default_value(false)
+      .implicit_value(true);
     parser.add_argument("--start-index")
       .help("Index of first image. Only used for CBF reading, and can only be 0 or 1.")
       .metavar("N")
@@ -231,11 +396,52 @@ int main(int argc, char **argv) {
       .metavar("S")
       .default_value<float>(30)
       .scan<'f', float>();
+    parser.add_argument("--direct")
+      .help("Read image data with O_DIRECT, bypassing the page cache")
+      .default_value(false)
+      .implicit_value(true);
+    parser.add_argument("--io-threads")
+      .help("Wait for and read frames on a separate pool of this many threads")
+      .metavar("NUM")
+      .default_value<uint32_t>(0)
+      .scan<'u', uint32_t>();
+    parser.add_argument("--decompress-threads")
+      .help("Decompress frames on a separate pool of this many threads")
+      .metavar("NUM")
+      .default_value<uint32_t>(0)
+      .scan<'u', uint32_t>();
+    parser.add_argument("--compute-threads")
+      .help("Threshold and label frames on a separate pool of this many threads")
+      .metavar("NUM")
+      .default_value<uint32_t>(0)
+      .scan<'u', uint32_t>();
+    parser.add_argument("--max-in-flight")
+      .help("Maximum number of frames being processed at once (default: 2 per thread)")
+      .metavar("NUM")
+      .scan<'u', uint32_t>();
+    parser.add_argument("--no-pin")
+      .help("Don't pin each worker thread to a CPU")
+      .default_value(false)
+      .implicit_value(true);
+    parser.add_argument("--latency-json")
+      .help("Write per-stage latency percentiles to this JSON file")
+      .metavar("FILE");
+    parser.add_argument("--latency-interval")
+      .help("Also rewrite the latency JSON every this many seconds while running")
+      .metavar("S")
+      .default_value<float>(0)
+      .scan<'f', float>();
 
     auto args = parser.parse_args(argc, argv);
     bool do_validate = parser.get<bool>("validate");
     bool do_writeout = parser.get<bool>("writeout");
+    bool do_3d = parser.get<bool>("3d");
+    auto output_path = parser.present<std::string>("output");
+    bool do_direct_io = parser.get<bool>("direct");
+    bool do_pin_threads = !parser.get<bool>("no-pin");
     float wait_timeout = parser.get<float>("timeout");
+    auto latency_json = parser.present<std::string>("latency-json");
+    float latency_interval = parser.get<float>("latency-interval");
 
     uint32_t num_cpu_threads = parser.get<uint32_t>("threads");
     if (num_cpu_threads < 1) {
@@ -244,6 +450,40 @@ int main(int argc, char **argv) {
     }
     uint32_t min_spot_size = parser.get<uint32_t>("min-spot-size");
 
+    // Stages can be given their own pool of threads, so that e.g. reading
+    // and decompression can run flat out at the same time. The rest share
+    // the main pool.
+    auto pool_sizes = std::vector<uint32_t>{num_cpu_threads};
+    auto stage_pools = std::vector<size_t>(pipeline_stages.size(), 0);
+    auto add_pool = [&](const std::string &option, std::vector<Stage> stages) {
+        if (auto size = parser.get<uint32_t>(option)) {
+            for (auto stage : stages) {
+                stage_pools[stage_index(stage)] = pool_sizes.size();
+            }
+            pool_sizes.push_back(size);
+        }
+    };
+    add_pool("io-threads", {Stage::Read});
+    add_pool("decompress-threads", {Stage::Decompress});
+    add_pool("compute-threads", {Stage::Threshold, Stage::Label});
+    if (std::ranges::count(stage_pools, 0) == 0) {
+        // Every stage has its own pool, so the main one isn't needed
+        pool_sizes[0] = 0;
+    }
+    auto worker_pools = std::vector<size_t>{};
+    for (size_t pool = 0; pool < pool_sizes.size(); ++pool) {
+        worker_pools.insert(worker_pools.end(), pool_sizes[pool], pool);
+    }
+    uint32_t num_workers = worker_pools.size();
+
+    size_t max_in_flight = parser.is_used("max-in-flight")
+                             ? parser.get<uint32_t>("max-in-flight")
+                             : 2 * num_workers;
+    if (max_in_flight < 1) {
+        print("Error: Maximum frames in flight must be >= 1\n");
+        std::exit(1);
+    }
+
     std::unique_ptr<Reader> reader_ptr;
 
     // Wait for read-readiness
@@ -273,6 +513,10 @@ int main(int argc, char **argv) {
     // Bind this as a reference
     Reader &reader = *reader_ptr;
 
+    if (do_direct_io && !reader.set_direct_io(true)) {
+        print("Warning: Reader does not support direct reads\n");
+    }
+
     auto reader_mutex = std::mutex{};
 
     uint32_t num_images = parser.is_used("images") ? parser.get<uint32_t>("images")
@@ -300,48 +544,181 @@ int main(int argc, char **argv) {
           blocks_dims.y,
           blocks_dims.z,
           num_blocks);
-    print("Running with {} CPU threads\n", num_cpu_threads);
+    print("Running with {} CPU threads\n", num_workers);
+    for (size_t pool = 0; pool < pool_sizes.size(); ++pool) {
+        if (pool_sizes[pool] == 0) continue;
+        std::string stage_list;
+        for (size_t stage = 0; stage < pipeline_stages.size(); ++stage) {
+            if (stage_pools[stage] != pool) continue;
+            if (!stage_list.empty()) stage_list += ", ";
+            stage_list += stage_names[static_cast<size_t>(pipeline_stages[stage])];
+        }
+        print("    {:2d} for {}\n", pool_sizes[pool], stage_list);
+    }
 
     auto mask = upload_mask(reader);
 
     auto all_images_start_time = std::chrono::high_resolution_clock::now();
 
-    auto next_image = std::atomic<int>(0);
     auto completed_images = std::atomic<int>(0);
 
-    auto cpu_sync = std::barrier{num_cpu_threads};
+    auto cpu_sync = std::barrier{num_workers};
+
+    // Every thread records how long each stage of each frame takes
+    auto stats = PipelineStats(num_workers);
+    std::jthread latency_writer;
+    if (latency_json && latency_interval > 0) {
+        latency_writer = std::jthread([&](std::stop_token stop) {
+            auto next_write = std::chrono::steady_clock::now();
+            while (!stop.stop_requested()) {
+                std::this_thread::sleep_for(50ms);
+                if (std::chrono::steady_clock::now() < next_write) continue;
+                write_latency_json(*latency_json, stats);
+                next_write += std::chrono::duration_cast<std::chrono::nanoseconds>(
+                  std::chrono::duration<float>(latency_interval));
+            }
+        });
+    }
+
+    // Host buffers for every frame that can be in flight at once. Frame N
+    // always uses slot N % max_in_flight.
+    std::vector<FrameWork> frames(max_in_flight);
+    for (auto &frame : frames) {
+        // Aligned, with room for the widened reads, so that it can be used
+        // for direct reads.
+        size_t raw_chunk_buffer_size =
+          width * height * sizeof(pixel_t) + 2 * H5READ_DIRECT_ALIGNMENT;
+        frame.raw_chunk_alloc = make_huge_buffer(raw_chunk_buffer_size);
+        frame.raw_chunk_buffer =
+          span<uint8_t>{frame.raw_chunk_alloc.get(), raw_chunk_buffer_size};
+        frame.host_image = make_cuda_pinned_huge_malloc<pixel_t>(width * height);
+        frame.host_results = make_cuda_pinned_huge_malloc<uint8_t>(width * height);
+    }
+    auto scheduler = FrameScheduler<FrameWork>(
+      stage_pools,
+      worker_pools,
+      num_images,
+      max_in_flight,
+      [&](size_t index) {
+          auto &frame = frames[index % max_in_flight];
+          frame.index = index;
+          frame.result = {};
+          frame.start_time = std::chrono::steady_clock::now();
+          return &frame;
+      });
+    // Wake up any idle workers if the user cancels
+    auto cancel_on_stop =
+      std::stop_callback(global_stop.get_token(), [&]() { scheduler.cancel(); });
+
+    // Diagnostic images are rendered and written away from the workers
+    std::optional<DiagnosticWriter> diagnostic_writer;
+    if (do_writeout) {
+        diagnostic_writer.emplace(width,
+                                  height,
+                                  parser.get<uint32_t>("writeout-every"),
+                                  parser.get<uint32_t>("writeout-scale"),
+                                  parser.get<uint32_t>("writeout-threads"));
+    }
+
+    // Results are written from the reorder buffer, so in frame order
+    std::optional<ResultsWriter> results_writer;
+    if (output_path) {
+        results_writer.emplace(*output_path, width, height);
+    }
 
-    auto png_write_mutex = std::mutex{};
+    // Frames reach the 3D labeller in order, from the reorder buffer
+    auto labeller_3d = StreamingLabeller3D();
+    size_t num_reflections_3d = 0;
+    auto record_reflections_3d = [&](const std::vector<Reflection3D> &reflections) {
+        std::vector<Reflection3D> kept;
+        std::ranges::copy_if(reflections, std::back_inserter(kept), [&](auto &r) {
+            return r.num_pixels >= min_spot_size;
+        });
+        num_reflections_3d += kept.size();
+        if (results_writer) results_writer->write_reflections_3d(kept);
+    };
 
-    double time_waiting_for_images = 0.0;
+    // Report each frame once it, and every frame before it, is finished
+    auto results = ReorderBuffer<FrameResult>(
+      max_in_flight, [&](size_t image_num, FrameResult &result) {
+          if (do_3d) {
+              // A skipped frame has no runs, so ends every reflection
+              record_reflections_3d(labeller_3d.add_image(result.runs));
+          }
+          if (result.skipped) {
+              scheduler.release();
+              return;
+          }
+          if (results_writer) {
+              results_writer->write_frame(
+                image_num, result.num_strong_pixels, result.reflections);
+          }
+          if (result.validation_matches) {
+              if (*result.validation_matches) {
+                  print(
+                    "Thread {:2d}, Image {:4d}: Compared: \033[32mMatch {} "
+                    "px\033[0m\n",
+                    result.thread_id,
+                    image_num,
+                    result.num_strong_pixels);
+              } else {
+                  print(
+                    "Thread {:2d}, Image {:4d}: Compared: "
+                    "\033[1;31mMismatch ({} px from kernel)\033[0m\n",
+                    result.thread_id,
+                    image_num,
+                    result.num_strong_pixels);
+              }
+          } else if (num_workers == 1) {
+              float total_ms = result.postcopy_ms + result.label_ms;
+              print(
+                "Thread {:2d} finished image {:4d}\n"
+                "       Copy: {:5.1f} ms\n"
+                "     Kernel: {:5.1f} ms\n"
+                "  Post Copy: {:5.1f} ms\n"
+                "       Post: {:5.1f} ms\n"
+                "             ════════\n"
+                "     Total:  {:5.1f} ms ({:.1f} GBps)\n"
+                "    {} strong pixels in {} reflections\n",
+                result.thread_id,
+                image_num,
+                result.copy_ms,
+                result.kernel_ms,
+                result.postcopy_ms - result.kernel_ms,
+                result.label_ms,
+                total_ms,
+                GBps<pixel_t>(total_ms, width * height),
+                bold(result.num_strong_pixels),
+                bold(result.num_reflections));
+          } else {
+              print(
+                "Thread {:2d} finished image {:4d} with {} pixels in {} "
+                "reflections\n",
+                result.thread_id,
+                image_num,
+                result.num_strong_pixels,
+                result.num_reflections);
+          }
+          completed_images += 1;
+          scheduler.release();
+      });
 
-    // Spawn the reader threads
+    // Spawn the worker threads. Each can run any stage its pool runs, for
+    // any frame.
     std::vector<std::jthread> threads;
-    for (int thread_id = 0; thread_id < num_cpu_threads; ++thread_id) {
+    for (int thread_id = 0; thread_id < num_workers; ++thread_id) {
         threads.emplace_back([&, thread_id]() {
-            auto stop_token = global_stop.get_token();
-            CudaStream stream;
-
-            auto host_image = make_cuda_pinned_malloc<pixel_t>(width * height);
-            auto host_results = make_cuda_pinned_malloc<uint8_t>(width * height);
-            auto device_image = PitchedMalloc<pixel_t>(width, height);
-            auto device_results =
-              PitchedMalloc<uint8_t>(make_cuda_malloc<uint8_t[]>(mask.pitch * height),
-                                     width,
-                                     height,
-                                     mask.pitch);
-
-            // Initialise NPP buffers
-            int npp_buffer_size = 0;
-            NPP_CHECK(nppiLabelMarkersUFGetBufferSize_32u_C1R({width, height},
-                                                              &npp_buffer_size));
-            auto device_label_buffer = make_cuda_malloc<Npp8u>(npp_buffer_size);
-            auto device_label_dest = PitchedMalloc<Npp32u>(width, height);
-            auto npp_context = create_npp_context_from_stream(stream);
-
-            // Buffer for reading compressed chunk data in
-            auto raw_chunk_buffer =
-              std::vector<uint8_t>(width * height * sizeof(pixel_t));
+            // Pin before allocating, so that our buffers are on our NUMA node
+            if (do_pin_threads && h5read_pin_thread(thread_id) != 0) {
+                print("Warning: Could not pin thread {} to a CPU\n", thread_id);
+            }
+            auto &timings = stats.thread(thread_id);
+
+            // Only threads that threshold need anything on the GPU
+            std::optional<ThresholdContext> gpu;
+            if (stage_pools[stage_index(Stage::Threshold)] == worker_pools[thread_id]) {
+                gpu.emplace(width, height, mask);
+            }
 
             // Allocate buffers for DIALS-style extraction
             auto px_coords = std::vector<int2>();
@@ -350,323 +727,287 @@ int main(int argc, char **argv) {
 
             // Let all threads do setup tasks before reading starts
             cpu_sync.arrive_and_wait();
-            CudaEvent start, copy, post, postcopy, end;
 
-            while (!stop_token.stop_requested()) {
-                auto image_num = next_image.fetch_add(1);
-                if (image_num >= num_images) {
-                    break;
-                }
-                {
-                    // TODO:
-                    //  - This loop does not handle the stop token
-                    //  - Counting time like this does not work efficiently
-                    //    because it might not be the "next" image that
-                    //    gets the lock.
-                    //  - This freezes if the collection is stopped;
-                    //    continue implementing timout feature
-                    //
-                    // Lock so we don't duplicate wait count, and also
-                    // because we don't know if the HDF5 function is threadsafe
-                    std::scoped_lock lock(reader_mutex);
-                    auto swmr_wait_start_time =
-                      std::chrono::high_resolution_clock::now();
-                    // Check that our image is available and wait if not
-                    while (!reader.is_image_available(image_num)) {
-                        std::this_thread::sleep_for(100ms);
+            while (auto task = scheduler.next(thread_id)) {
+                FrameWork &frame = *task->frame;
+                auto image_num = frame.index;
+                auto &host_image = frame.host_image;
+                auto &host_results = frame.host_results;
+                // Whether this frame has been through every stage it needs
+                bool is_finished = false;
+
+                switch (pipeline_stages[task->stage]) {
+                case Stage::Read: {
+                    bool is_available;
+                    {
+                        // TODO: The wait does not handle the stop token, so
+                        //       can take up to the timeout to respond
+                        //
+                        // Readers that can't be waited on by several threads
+                        // at once, like HDF5 which we don't know is
+                        // threadsafe, are waited on under the read lock.
+                        StageTimer wait_timer(timings, Stage::Wait);
+                        auto lock = std::unique_lock(reader_mutex, std::defer_lock);
+                        if (!reader.can_wait_concurrently()) {
+                            lock.lock();
+                        }
+                        // Wait for our image to be available. The readers
+                        // wake on file changes, so this doesn't add polling
+                        // latency.
+                        is_available = reader.wait_for_image(image_num, wait_timeout);
                     }
-                    time_waiting_for_images +=
-                      std::chrono::duration_cast<std::chrono::duration<double>>(
-                        std::chrono::high_resolution_clock::now()
-                        - swmr_wait_start_time)
-                        .count();
-                }
-                // Sized buffer for the actual data read from file
-                span<uint8_t> buffer;
-                // Fetch the image data from the reader
-                while (true) {
+                    if (!is_available) {
+                        print(
+                          "\033[1;31mError: Timed out waiting for image "
+                          "{}\033[0m\n",
+                          image_num);
+                        global_stop.request_stop();
+                        frame.result.skipped = true;
+                        is_finished = true;
+                        break;
+                    }
+                    // Fetch the image data from the reader. Frames are only
+                    // available once committed by the writer, so this is
+                    // never a partially written file. The view might be
+                    // borrowed from the reader, rather than in our buffer.
                     {
+                        StageTimer read_timer(timings, Stage::Read);
                         std::scoped_lock lock(reader_mutex);
-                        buffer = reader.get_raw_chunk(image_num, raw_chunk_buffer);
+                        frame.chunk =
+                          reader.get_raw_chunk_view(image_num, frame.raw_chunk_buffer);
                     }
-                    // /dev/shm we might not have an atomic write
-                    if (buffer.size() == 0) {
+                    if (frame.chunk.data.size() == 0) {
                         print(
-                          "\033[1mRace Condition?!?? Got buffer size 0 for image "
-                          "{image_num}. "
-                          "Sleeping.\033[0m\n");
-                        std::this_thread::sleep_for(100ms);
-                        continue;
+                          "\033[1;31mError: Image {} is available but empty; "
+                          "skipping\033[0m\n",
+                          image_num);
+                        frame.result.skipped = true;
+                        is_finished = true;
                     }
                     break;
                 }
-                // Decompress this data, outside of the mutex.
-                // We do this here rather than in the reader, because we
-                // anticipate that we will want to eventually offload
-                // the decompression
-                switch (reader.get_raw_chunk_compression()) {
-                case Reader::ChunkCompression::BITSHUFFLE_LZ4:
-                    bshuf_decompress_lz4(
-                      buffer.data() + 12, host_image.get(), width * height, 2, 0);
-                    break;
-                case Reader::ChunkCompression::BYTE_OFFSET_32:
-                    decompress_byte_offset<pixel_t>(buffer,
-                                                    {host_image.get(), width * height});
-                    // std::copy(buffer.begin(), buffer.end(), host_image.get());
-                    // std::exit(1);
-                    break;
-                }
-                start.record(stream);
-                // Copy the image to GPU
-                CUDA_CHECK(cudaMemcpy2DAsync(device_image.get(),
-                                             device_image.pitch_bytes(),
+                case Stage::Decompress: {
+                    // Decompress this data, outside of the mutex.
+                    // We do this here rather than in the reader, because we
+                    // anticipate that we will want to eventually offload
+                    // the decompression
+                    StageTimer decompress_timer(timings, Stage::Decompress);
+                    switch (reader.get_raw_chunk_compression()) {
+                    case Reader::ChunkCompression::BITSHUFFLE_LZ4:
+                        bshuf_decompress_lz4(frame.chunk.data.data() + 12,
                                              host_image.get(),
-                                             width * sizeof(pixel_t),
-                                             width * sizeof(pixel_t),
-                                             height,
-                                             cudaMemcpyHostToDevice,
-                                             stream));
-                copy.record(stream);
-                // When done, launch the spotfind kernel
-                // do_spotfinding_naive<<<blocks_dims, gpu_thread_block_size, 0, stream>>>(
-                call_do_spotfinding_naive(blocks_dims,
-                                          gpu_thread_block_size,
-                                          0,
-                                          stream,
-                                          device_image.get(),
-                                          device_image.pitch,
-                                          mask.get(),
-                                          mask.pitch,
-                                          width,
-                                          height,
-                                          device_results.get());
-                post.record(stream);
-
-                // Copy the results buffer back to the CPU
-                CUDA_CHECK(cudaMemcpy2DAsync(host_results.get(),
-                                             width * sizeof(uint8_t),
-                                             device_results.get(),
-                                             device_results.pitch_bytes(),
-                                             width * sizeof(uint8_t),
-                                             height,
-                                             cudaMemcpyDeviceToHost,
-                                             stream));
-                postcopy.record(stream);
-                // Now, wait for stream to finish
-                CUDA_CHECK(cudaStreamSynchronize(stream));
-
-                // Manually reproduce what the DIALS connected components does
-                // Start with the behaviour of the PixelList class:
-                size_t num_strong_pixels = 0;
-                px_values.clear();
-                px_coords.clear();
-                px_kvals.clear();
-
-                for (int y = 0, k = 0; y < height; ++y) {
-                    for (int x = 0; x < width; ++x, ++k) {
-                        if (host_results[k]) {
-                            px_coords.emplace_back(x, y);
-                            px_values.push_back(host_image[k]);
-                            px_kvals.push_back(k);
-                            ++num_strong_pixels;
-                        }
-                    }
-                }
-
-                auto graph =
-                  boost::adjacency_list<boost::vecS, boost::vecS, boost::undirectedS>{
-                    px_values.size()};
-
-                // Index for next pixel to search when looking for pixels
-                // below the current one. This will only ever increase, because
-                // we are guaranteed to always look for one after the last found
-                // pixel.
-                int idx_pixel_below = 1;
-
-                for (int i = 0; i < static_cast<int>(px_coords.size()) - 1; ++i) {
-                    auto coord = px_coords[i];
-                    auto coord_right = int2{coord.x + 1, coord.y};
-                    auto k = px_kvals[i];
-
-                    if (px_coords[i + 1] == coord_right) {
-                        // Since we generate strong pixels coordinates horizontally,
-                        // if there is a pixel to the right then it is guaranteed
-                        // to be the next one in the list. Connect these.
-                        boost::add_edge(i, i + 1, graph);
-                    }
-                    // Now, check the pixel directly below this one. We need to scan
-                    // to find it, because _if_ there is a matching strong pixel,
-                    // then we don't know how far ahead it is in the coordinates array
-                    if (coord.y < height - 1) {
-                        auto coord_below = int2{coord.x, coord.y + 1};
-                        auto k_below = k + width;
-                        // int idx = i + 1;
-                        while (idx_pixel_below < px_coords.size() - 1
-                               && px_kvals[idx_pixel_below] < k_below) {
-                            ++idx_pixel_below;
-                        }
-                        // Either we've got the pixel below, past that - or the
-                        // last pixel in the coordinate set.
-                        if (px_coords[idx_pixel_below] == coord_below) {
-                            boost::add_edge(i, idx_pixel_below, graph);
-                        }
+                                             width * height,
+                                             2,
+                                             0);
+                        break;
+                    case Reader::ChunkCompression::BYTE_OFFSET_32:
+                        decompress_byte_offset<pixel_t>(
+                          frame.chunk.data, {host_image.get(), width * height});
+                        break;
                     }
+                    // Let the reader reuse any memory we borrowed
+                    frame.chunk = {};
+                    break;
                 }
-                auto labels = std::vector<int>(boost::num_vertices(graph));
-                auto num_labels = boost::connected_components(graph, labels.data());
-
-                auto boxes = std::vector<Reflection>(num_labels, {width, height, 0, 0});
-
-                assert(labels.size() == px_coords.size());
-                for (int i = 0; i < labels.size(); ++i) {
-                    auto label = labels[i];
-                    auto coord = px_coords[i];
-                    Reflection &box = boxes[label];
-                    box.l = std::min(box.l, coord.x);
-                    box.r = std::max(box.r, coord.x);
-                    box.t = std::min(box.t, coord.y);
-                    box.b = std::max(box.b, coord.y);
-                    box.num_pixels += 1;
-                }
+                case Stage::Threshold: {
+                    auto &stream = gpu->stream;
+                    auto &device_image = gpu->device_image;
+                    auto &device_results = gpu->device_results;
+                    auto &start = gpu->start, &copy = gpu->copy;
+                    auto &post = gpu->post, &postcopy = gpu->postcopy;
+                    start.record(stream);
+                    // Copy the image to GPU
+                    CUDA_CHECK(cudaMemcpy2DAsync(device_image.get(),
+                                                 device_image.pitch_bytes(),
+                                                 host_image.get(),
+                                                 width * sizeof(pixel_t),
+                                                 width * sizeof(pixel_t),
+                                                 height,
+                                                 cudaMemcpyHostToDevice,
+                                                 stream));
+                    copy.record(stream);
+                    // When done, launch the spotfind kernel
+                    call_do_spotfinding_naive(blocks_dims,
+                                              gpu_thread_block_size,
+                                              0,
+                                              stream,
+                                              device_image.get(),
+                                              device_image.pitch,
+                                              mask.get(),
+                                              mask.pitch,
+                                              width,
+                                              height,
+                                              device_results.get());
+                    post.record(stream);
 
-                // Filter shoeboxes
-                if (min_spot_size > 0) {
-                    std::vector<Reflection> filtered_boxes;
-                    for (auto &box : boxes) {
-                        if (box.num_pixels >= min_spot_size) {
-                            filtered_boxes.emplace_back(box);
-                        }
-                    }
-                    boxes = std::move(filtered_boxes);
+                    // Copy the results buffer back to the CPU
+                    CUDA_CHECK(cudaMemcpy2DAsync(host_results.get(),
+                                                 width * sizeof(uint8_t),
+                                                 device_results.get(),
+                                                 device_results.pitch_bytes(),
+                                                 width * sizeof(uint8_t),
+                                                 height,
+                                                 cudaMemcpyDeviceToHost,
+                                                 stream));
+                    postcopy.record(stream);
+                    // Now, wait for stream to finish
+                    CUDA_CHECK(cudaStreamSynchronize(stream));
+                    timings[Stage::Threshold].record(
+                      std::chrono::duration<float, std::milli>(
+                        postcopy.elapsed_time(start)));
+                    frame.result.copy_ms = copy.elapsed_time(start);
+                    frame.result.kernel_ms = post.elapsed_time(start);
+                    frame.result.postcopy_ms = postcopy.elapsed_time(start);
+                    break;
                 }
-                // // Do the connected component calculations
-                // NPP_CHECK(nppiLabelMarkersUF_8u32u_C1R_Ctx(device_results.get(),
-                //                                            device_results.pitch,
-                //                                            device_label_dest.get(),
-                //                                            device_label_dest.pitch,
-                //                                            {width, height},
-                //                                            nppiNormL1,
-                //                                            device_label_buffer.get(),
-                //                                            npp_context));
-                end.record(stream);
-                // Now, wait for stream to finish
-                CUDA_CHECK(cudaStreamSynchronize(stream));
-
-                if (do_writeout) {
-                    // Build an image buffer
-                    auto buffer =
-                      std::vector<std::array<uint8_t, 3>>(width * height, {0, 0, 0});
-                    constexpr std::array<uint8_t, 3> color_pixel{255, 0, 0};
+                case Stage::Label: {
+                    // Manually reproduce what the DIALS connected components
+                    // does. Start with the behaviour of the PixelList class:
+                    StageTimer label_timer(timings, Stage::Label);
+                    auto label_start = std::chrono::steady_clock::now();
+                    size_t num_strong_pixels = 0;
+                    px_values.clear();
+                    px_coords.clear();
+                    px_kvals.clear();
 
                     for (int y = 0, k = 0; y < height; ++y) {
                         for (int x = 0; x < width; ++x, ++k) {
-                            uint8_t graysc_value = std::max(
-                              0.0f, 255.99f - static_cast<float>(host_image[k]) * 10);
-                            buffer[k] = {graysc_value, graysc_value, graysc_value};
                             if (host_results[k]) {
-                                buffer[k] = color_pixel;
+                                px_coords.emplace_back(x, y);
+                                px_values.push_back(host_image[k]);
+                                px_kvals.push_back(k);
+                                ++num_strong_pixels;
                             }
                         }
                     }
-                    // Go over each shoebox and write a square
-                    // for (auto box : boxes) {
-                    for (int i = 0; i < boxes.size(); ++i) {
-                        auto &box = boxes[i];
-                        constexpr std::array<uint8_t, 3> color_shoebox{0, 0, 255};
-
-                        // edgeMin/edgeMax define how thick the border is
-                        constexpr int edgeMin = 5, edgeMax = 7;
-                        for (int edge = edgeMin; edge <= edgeMax; ++edge) {
-                            for (int x = box.l - edge; x <= box.r + edge; ++x) {
-                                buffer[width * (box.t - edge) + x] = color_shoebox;
-                                buffer[width * (box.b + edge) + x] = color_shoebox;
+
+                    using Graph = boost::
+                      adjacency_list<boost::vecS, boost::vecS, boost::undirectedS>;
+                    auto graph = Graph{px_values.size()};
+
+                    // Index for next pixel to search when looking for pixels
+                    // below the current one. This will only ever increase,
+                    // because we are guaranteed to always look for one after
+                    // the last found pixel.
+                    int idx_pixel_below = 1;
+
+                    for (int i = 0; i < static_cast<int>(px_coords.size()) - 1; ++i) {
+                        auto coord = px_coords[i];
+                        auto coord_right = int2{coord.x + 1, coord.y};
+                        auto k = px_kvals[i];
+
+                        if (px_coords[i + 1] == coord_right) {
+                            // Since we generate strong pixels coordinates
+                            // horizontally, if there is a pixel to the right
+                            // then it is guaranteed to be the next one in the
+                            // list. Connect these.
+                            boost::add_edge(i, i + 1, graph);
+                        }
+                        // Now, check the pixel directly below this one. We
+                        // need to scan to find it, because _if_ there is a
+                        // matching strong pixel, then we don't know how far
+                        // ahead it is in the coordinates array
+                        if (coord.y < height - 1) {
+                            auto coord_below = int2{coord.x, coord.y + 1};
+                            auto k_below = k + width;
+                            while (idx_pixel_below < px_coords.size() - 1
+                                   && px_kvals[idx_pixel_below] < k_below) {
+                                ++idx_pixel_below;
                             }
-                            for (int y = box.t - edge; y <= box.b + edge; ++y) {
-                                buffer[width * y + box.l - edge] = color_shoebox;
-                                buffer[width * y + box.r + edge] = color_shoebox;
+                            // Either we've got the pixel below, past that - or
+                            // the last pixel in the coordinate set.
+                            if (px_coords[idx_pixel_below] == coord_below) {
+                                boost::add_edge(i, idx_pixel_below, graph);
                             }
                         }
                     }
-                    lodepng::encode(format("image_{:05d}.png", image_num),
-                                    reinterpret_cast<uint8_t *>(buffer.data()),
-                                    width,
-                                    height,
-                                    LCT_RGB);
-                }
-                if (do_validate) {
-                    // Count the number of pixels
-                    size_t num_strong_pixels = 0;
-                    for (int y = 0; y < height; ++y) {
-                        for (int x = 0; x < width; ++x) {
-                            if (host_results[x + width * y]) {
-                                ++num_strong_pixels;
+                    auto labels = std::vector<int>(boost::num_vertices(graph));
+                    auto num_labels = boost::connected_components(graph, labels.data());
+
+                    auto boxes =
+                      std::vector<Reflection>(num_labels, {width, height, 0, 0});
+
+                    assert(labels.size() == px_coords.size());
+                    for (int i = 0; i < labels.size(); ++i) {
+                        auto label = labels[i];
+                        auto coord = px_coords[i];
+                        Reflection &box = boxes[label];
+                        box.l = std::min(box.l, coord.x);
+                        box.r = std::max(box.r, coord.x);
+                        box.t = std::min(box.t, coord.y);
+                        box.b = std::max(box.b, coord.y);
+                        box.num_pixels += 1;
+                    }
+
+                    // Filter shoeboxes
+                    if (min_spot_size > 0) {
+                        std::vector<Reflection> filtered_boxes;
+                        for (auto &box : boxes) {
+                            if (box.num_pixels >= min_spot_size) {
+                                filtered_boxes.emplace_back(box);
                             }
                         }
+                        boxes = std::move(filtered_boxes);
                     }
-                    auto spotfinder = StandaloneSpotfinder(width, height);
-                    // Read the image into a vector
-                    auto converted_image = std::vector<double>{
-                      host_image.get(), host_image.get() + width * height};
-                    auto dials_strong = spotfinder.standard_dispersion(
-                      converted_image, reader.get_mask().value_or(span<uint8_t>{}));
-                    size_t mismatch_x = 0, mismatch_y = 0;
-                    bool validation_matches = compare_results(dials_strong.data(),
-                                                              width,
-                                                              host_results.get(),
-                                                              width,
-                                                              width,
-                                                              height,
-                                                              &mismatch_x,
-                                                              &mismatch_y);
-                    if (validation_matches) {
-                        print(
-                          "Thread {:2d}, Image {:4d}: Compared: \033[32mMatch {} "
-                          "px\033[0m\n",
-                          thread_id,
-                          image_num,
-                          num_strong_pixels);
-                    } else {
-                        print(
-                          "Thread {:2d}, Image {:4d}: Compared: "
-                          "\033[1;31mMismatch ({} px from kernel)\033[0m\n",
-                          thread_id,
+                    bool do_image =
+                      diagnostic_writer && diagnostic_writer->wants(image_num);
+                    if (do_3d || do_image) {
+                        frame.result.runs = find_pixel_runs<pixel_t>(
+                          {host_results.get(), static_cast<size_t>(width * height)},
+                          {host_image.get(), static_cast<size_t>(width * height)},
+                          width,
+                          height);
+                    }
+                    if (do_image) {
+                        diagnostic_writer->submit(
                           image_num,
-                          num_strong_pixels);
+                          do_3d ? frame.result.runs : std::move(frame.result.runs),
+                          boxes);
                     }
+                    label_timer.stop();
+                    frame.result.label_ms = std::chrono::duration<float, std::milli>(
+                                              std::chrono::steady_clock::now()
+                                              - label_start)
+                                              .count();
 
-                } else {
-                    if (num_cpu_threads == 1) {
-                        print(
-                          "Thread {:2d} finished image {:4d}\n"
-                          "       Copy: {:5.1f} ms\n"
-                          "     Kernel: {:5.1f} ms\n"
-                          "  Post Copy: {:5.1f} ms\n"
-                          "       Post: {:5.1f} ms\n"
-                          "             ════════\n"
-                          "     Total:  {:5.1f} ms ({:.1f} GBps)\n"
-                          "    {} strong pixels in {} reflections\n",
-                          thread_id,
-                          image_num,
-                          copy.elapsed_time(start),
-                          post.elapsed_time(start),
-                          postcopy.elapsed_time(post),
-                          end.elapsed_time(postcopy),
-                          end.elapsed_time(start),
-                          GBps<pixel_t>(end.elapsed_time(start), width * height),
-                          bold(num_strong_pixels),
-                          bold(boxes.size()));
-                    } else {
-                        print(
-                          "Thread {:2d} finished image {:4d} with {} pixels in {} "
-                          "reflections\n",
-                          thread_id,
-                          image_num,
-                          num_strong_pixels,
-                          boxes.size());
+                    if (do_validate) {
+                        auto spotfinder = StandaloneSpotfinder(width, height);
+                        // Read the image into a vector
+                        auto converted_image = std::vector<double>{
+                          host_image.get(), host_image.get() + width * height};
+                        auto dials_strong = spotfinder.standard_dispersion(
+                          converted_image, reader.get_mask().value_or(span<uint8_t>{}));
+                        size_t mismatch_x = 0, mismatch_y = 0;
+                        frame.result.validation_matches =
+                          compare_results(dials_strong.data(),
+                                          width,
+                                          host_results.get(),
+                                          width,
+                                          width,
+                                          height,
+                                          &mismatch_x,
+                                          &mismatch_y);
+                    }
+                    frame.result.thread_id = thread_id;
+                    frame.result.num_strong_pixels = num_strong_pixels;
+                    frame.result.num_reflections = boxes.size();
+                    if (results_writer) {
+                        frame.result.reflections = std::move(boxes);
                     }
+                    is_finished = true;
+                    break;
+                }
+                default:
+                    break;
+                }
+
+                if (is_finished) {
+                    timings[Stage::Total].record(std::chrono::steady_clock::now()
+                                                 - frame.start_time);
+                    results.submit(image_num, std::move(frame.result));
+                } else {
+                    scheduler.push(thread_id, task->stage + 1, &frame);
                 }
-                // auto image_num = next_image.fetch_add(1);
-                completed_images += 1;
             }
         });
     }
@@ -690,6 +1031,31 @@ int main(int argc, char **argv) {
       completed_images / total_time,
       width,
       height);
+    if (do_3d) {
+        record_reflections_3d(labeller_3d.finish());
+        print("{} 3D reflections\n", bold(num_reflections_3d));
+    }
+    // Wait for all of the results and diagnostic images to be written
+    bool results_complete = !results_writer || results_writer->finish();
+    if (!results_complete) {
+        print("\033[1;31mError: Failed to write results to {}\033[0m\n",
+              *output_path);
+    }
+    results_writer.reset();
+    if (diagnostic_writer) {
+        if (diagnostic_writer->dropped() > 0) {
+            print("Warning: Dropped {} diagnostic images, as writing fell behind\n",
+                  diagnostic_writer->dropped());
+        }
+        diagnostic_writer.reset();
+    }
+    latency_writer = {};
+    print_latency_table(stats);
+    if (latency_json) {
+        write_latency_json(*latency_json, stats);
+    }
+    auto total_timings = stats.merged();
+    double time_waiting_for_images = (*total_timings)[Stage::Wait].sum() * 1e-9;
     if (time_waiting_for_images < 10) {
         print("Total time waiting for images to appear: {:.0f} ms\n",
               time_waiting_for_images * 1000);
@@ -697,4 +1063,6 @@ int main(int argc, char **argv) {
         print("Total time waiting for images to appear: {:.2f} s\n",
               time_waiting_for_images);
     }
+    // The run didn't succeed if its results file is incomplete
+    return results_complete ? 0 : 1;
 }
@@ -37,9 +37,56 @@ h5read_handle *h5read_open(const char *master_filename);
 /// Generate sample data
 h5read_handle *h5read_generate_samples();
 
+/// Detector geometries that synthetic data can be generated for
+typedef enum h5read_detector {
+    H5READ_EIGER2XE_4M,
+    H5READ_EIGER2XE_16M,
+} h5read_detector;
+
+/// Description of a synthetic dataset, for h5read_generate_synthetic
+typedef struct h5read_synthetic_params {
+    h5read_detector detector;   ///< Detector geometry, with module gaps masked
+    size_t frames;              ///< Number of frames in the dataset
+    double background;          ///< Mean background counts at the beam centre
+    double background_edge;     ///< Mean background counts at the corners
+    double spots_per_frame;     ///< Mean number of spots on each frame
+    double spot_intensity;      ///< Mean total counts in a spot
+    double spot_sigma;          ///< Gaussian width of spots, in pixels
+    double hot_pixel_fraction;  ///< Fraction of pixels that are (unmasked) hot
+    uint16_t saturation;        ///< Count at which pixels saturate
+    uint64_t seed;              ///< Seed; the same seed gives the same data
+    int threads;                ///< Threads generating each frame; 0 for all CPUs
+} h5read_synthetic_params;
+
+/// Fill in default synthetic dataset parameters: 1000 frames of 16M data
+void h5read_synthetic_default_params(h5read_synthetic_params *params);
+
+/** Generate realistic synthetic data, on the fly, as frames are read.
+ *
+ * Frames have a Poisson background falling off from the beam centre,
+ * Gaussian spots, hot pixels and saturation. Each frame depends only on
+ * its index and the seed, so frames can be read from several threads at
+ * once; set `threads` to 1 in that case, to avoid oversubscribing. Like
+ * sample data, there are no raw chunks. Release with h5read_free.
+ */
+h5read_handle *h5read_generate_synthetic(const h5read_synthetic_params *params);
+
 /// Cleanup and release an h5 file object
 void h5read_free(h5read_handle *);
 
+/// Default upper limit of data files to keep open at once
+#define H5READ_DEFAULT_MAX_OPEN_FILES 256
+
+/** Set the most data files that will be kept open at once.
+ *
+ * Data files are opened when first read from. Past this limit, the least
+ * recently used file is closed. By default this is a quarter of the file
+ * descriptor limit, up to H5READ_DEFAULT_MAX_OPEN_FILES. Limits below 1 are
+ * taken as 1. Lowering the limit closes the least recently used files at
+ * once, until no more than the limit are open.
+ */
+void h5read_set_max_open_files(h5read_handle *obj, int max_open_files);
+
 /// Get the number of images in a dataset
 size_t h5read_get_number_of_images(h5read_handle *obj);
 /// Get the number of image pixels in the slow dimension
@@ -66,18 +113,181 @@ void h5read_free_image(image_t *image);
  */
 void h5read_get_image_into(h5read_handle *obj, size_t index, image_t_type *data);
 
+/** Read the raw, still compressed, chunk for an image.
+ *
+ * max_size is the size of the data buffer. The size of the chunk is written
+ * to size. Exits if the chunk does not fit or cannot be read; use
+ * h5read_try_get_raw_chunk to handle these errors instead.
+ */
 void h5read_get_raw_chunk(h5read_handle *obj,
                           size_t index,
                           size_t *size,
                           uint8_t *data,
                           size_t max_size);
 
+/// Get the size of an image chunk, or 0 if it has not been written yet
 size_t h5read_get_chunk_size(h5read_handle *obj, size_t index);
 
+/// Results of the h5read_try_ read functions, which do not exit on failure
+typedef enum {
+    H5READ_OK = 0,
+    H5READ_ERROR_SAMPLE_DATA,       ///< Sample data has no raw chunks
+    H5READ_ERROR_OUT_OF_RANGE,      ///< The image is not in the dataset
+    H5READ_ERROR_NOT_AVAILABLE,     ///< The image has not been written (yet)
+    H5READ_ERROR_OPEN,              ///< The data file could not be opened
+    H5READ_ERROR_BUFFER_TOO_SMALL,  ///< The chunk is larger than the buffer
+    H5READ_ERROR_DATA_TYPE,         ///< The data is not 16-bit
+    H5READ_ERROR_READ,              ///< HDF5 failed to read the data
+} h5read_status;
+
+/// Get a description of a status code
+const char *h5read_status_string(h5read_status status);
+
+/// Read an image into a preallocated buffer, or return the reason it failed
+h5read_status h5read_try_get_image_into(h5read_handle *obj,
+                                        size_t index,
+                                        image_t_type *data);
+
+/** Read an image, or return the reason it failed.
+ *
+ * On success image is set to the image, which must be released with
+ * h5read_free_image. On failure it is set to NULL.
+ */
+h5read_status h5read_try_get_image(h5read_handle *obj, size_t index, image_t **image);
+
+/** Read the raw chunk for an image, or return the reason it failed.
+ *
+ * size is always set to the size of the chunk, if it exists, even if it
+ * was too large for the buffer. This allows a caller to grow their buffer
+ * and retry on H5READ_ERROR_BUFFER_TOO_SMALL, without needing to call
+ * h5read_get_chunk_size before every read.
+ */
+h5read_status h5read_try_get_raw_chunk(h5read_handle *obj,
+                                       size_t index,
+                                       size_t *size,
+                                       uint8_t *data,
+                                       size_t max_size);
+
+/// Get the size of an image chunk, or return the reason it is not available
+h5read_status h5read_try_get_chunk_size(h5read_handle *obj,
+                                        size_t index,
+                                        size_t *size);
+
+/** Wait for an image in a live (SWMR) dataset to be written.
+ *
+ * Rather than polling, this sleeps until the data file is changed, and then
+ * refreshes the view of the dataset. Returns 1 if the image is available, or
+ * 0 if the timeout expired first.
+ */
+int h5read_wait_for_image(h5read_handle *obj, size_t index, int timeout_ms);
+
+/// Watch for files being written in a directory, with inotify
+typedef struct _h5read_watch h5read_watch;
+
+/** Start watching a directory for files being created, written or moved in.
+ *
+ * Returns NULL if the directory could not be watched.
+ */
+h5read_watch *h5read_watch_open(const char *directory);
+/** Sleep until there has been a change in the watched directory.
+ *
+ * Returns 1 if there was a change since the last wait, or 0 on timeout.
+ */
+int h5read_watch_wait(h5read_watch *watch, int timeout_ms);
+/// Stop watching a directory, and release the watch
+void h5read_watch_free(h5read_watch *watch);
+
+/// Alignment, in bytes, of buffers, offsets and lengths for O_DIRECT reads
+#define H5READ_DIRECT_ALIGNMENT 4096
+
+/** Allocate a buffer suitable for direct (O_DIRECT) reads.
+ *
+ * The buffer is aligned to H5READ_DIRECT_ALIGNMENT and has its size rounded
+ * up to a multiple of it. Release with free(). Returns NULL if failed.
+ */
+void *h5read_direct_alloc(size_t size);
+
+/// Size, in bytes, of the huge pages that large buffers are allocated in
+#define H5READ_HUGE_PAGE_SIZE (2 * 1024 * 1024)
+/// NUMA node meaning "wherever the calling thread is running"
+#define H5READ_NUMA_LOCAL -1
+
+/** Allocate a large buffer, backed by huge pages where possible.
+ *
+ * The buffer is aligned to H5READ_HUGE_PAGE_SIZE (so is also suitable for
+ * direct reads), placed on the given NUMA node (or the caller's, for
+ * H5READ_NUMA_LOCAL) and already faulted in. Reserved (hugetlbfs) pages are
+ * used if there are any, otherwise transparent huge pages are requested.
+ * Release with h5read_huge_free, passing the same size. Returns NULL if
+ * failed.
+ */
+void *h5read_huge_alloc(size_t size, int numa_node);
+/// Release a buffer from h5read_huge_alloc
+void h5read_huge_free(void *buffer, size_t size);
+/** Turn huge pages on or off for later h5read_huge_alloc allocations.
+ *
+ * The default is on, unless the environment variable H5READ_HUGE_PAGES is
+ * set to 0. Mostly useful for measuring the difference they make.
+ */
+void h5read_set_huge_pages(int enable);
+
+/// The NUMA node the calling thread is running on, or -1 if unknown
+int h5read_current_numa_node(void);
+/** Pin the calling thread to a single CPU.
+ *
+ * `index` counts through the CPUs that the process is allowed to run on,
+ * wrapping around, so that worker N can simply be pinned with index N.
+ * Returns 0 on success.
+ */
+int h5read_pin_thread(int index);
+
+/** Read a byte range from a file descriptor opened with O_DIRECT.
+ *
+ * The read is widened out to aligned boundaries, so `buffer` must come from
+ * h5read_direct_alloc and be able to hold `size + 2 * H5READ_DIRECT_ALIGNMENT`
+ * bytes. Returns a pointer to the first requested byte within `buffer`, or
+ * NULL if the read failed.
+ */
+uint8_t *h5read_direct_pread(int fd,
+                             size_t offset,
+                             size_t size,
+                             uint8_t *buffer,
+                             size_t buffer_size);
+
+/** Read an entire file with O_DIRECT.
+ *
+ * The buffer has the same requirements as h5read_direct_pread, and the file
+ * data starts at the beginning of it. Returns NULL if the read failed.
+ */
+uint8_t *h5read_direct_read_file(const char *filename,
+                                 size_t *size,
+                                 uint8_t *buffer,
+                                 size_t buffer_size);
+
+/** Read a raw chunk with O_DIRECT, bypassing the page cache.
+ *
+ * Like h5read_get_raw_chunk, but the chunk is read straight from the data
+ * file with the same buffer requirements as h5read_direct_pread. The chunk
+ * will usually not start at the beginning of `data`; use the returned
+ * pointer. Returns NULL if the chunk could not be read this way e.g. the
+ * filesystem does not support O_DIRECT. As with h5read_try_get_raw_chunk,
+ * size is set even if the chunk was too large for the buffer.
+ */
+uint8_t *h5read_get_raw_chunk_direct(h5read_handle *obj,
+                                     size_t index,
+                                     size_t *size,
+                                     uint8_t *data,
+                                     size_t max_size);
+
 /// Read an image from a dataset, split up into modules
 image_modules_t *h5read_get_image_modules(h5read_handle *obj, size_t frame_number);
 /// Free an image read as modules
 void h5read_free_image_modules(image_modules_t *modules);
+/// Read an image as modules, or return the reason it failed. As for
+/// h5read_try_get_image, modules is set to NULL on failure.
+h5read_status h5read_try_get_image_modules(h5read_handle *obj,
+                                          size_t frame_number,
+                                          image_modules_t **modules);
 
 /// Parse basic command arguments with verbose, filename in form:
 ///     Usage: <prog> [-h|--help] [-v] [FILE.nxs]
@@ -87,9 +297,13 @@ h5read_handle *h5read_parse_standard_args(int argc, char **argv);
 }
 
 #include <array>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
 #include <memory>
 #include <optional>
 #include <string>
+#include <thread>
 #include <vector>
 
 // We might be on an implementation that doesn't have <span>, so use a backport
@@ -108,6 +322,8 @@ class Image {
 
   public:
     Image(std::shared_ptr<h5read_handle> reader, size_t i) noexcept;
+    /// Take ownership of an image read with h5read_try_get_image
+    Image(std::shared_ptr<h5read_handle> reader, image_t *image) noexcept;
 
     const SPAN<image_t_type> data;
     const SPAN<uint8_t> mask;
@@ -125,6 +341,9 @@ class ImageModules {
 
   public:
     ImageModules(std::shared_ptr<h5read_handle> handle, size_t i) noexcept;
+    /// Take ownership of modules read with h5read_try_get_image_modules
+    ImageModules(std::shared_ptr<h5read_handle> handle,
+                 image_modules_t *modules) noexcept;
 
     const SPAN<image_t_type> data;
     const SPAN<uint8_t> mask;
@@ -146,11 +365,66 @@ class Reader {
         BYTE_OFFSET_32,
     };
 
+    /// A raw chunk, that may be borrowed from memory owned by the reader
+    struct ChunkView {
+        SPAN<const uint8_t> data;
+        /// Keeps any borrowed memory alive, for as long as it is held
+        std::shared_ptr<const void> owner;
+    };
+
     virtual ~Reader(){};
 
     virtual bool is_image_available(size_t index) = 0;
 
+    /// Wait for an image to become available, for up to timeout seconds.
+    /// Returns whether the image is available.
+    virtual bool wait_for_image(size_t index, float timeout) = 0;
+
+    /// Whether wait_for_image is safe to call from several threads at once,
+    /// and while other threads are reading. Otherwise, the caller must
+    /// serialize it with every other call, as with the read functions.
+    virtual bool can_wait_concurrently() const {
+        return false;
+    }
+
+    /// Request that raw chunk reads bypass the page cache, with O_DIRECT.
+    ///
+    /// Destination buffers must then come from make_direct_buffer, and the
+    /// span returned from get_raw_chunk may not start at the buffer start.
+    /// Returns false if the reader does not support direct reads.
+    virtual bool set_direct_io(bool /*enable*/) {
+        return false;
+    }
+
+    /// The result of a raw chunk read that is allowed to fail
+    struct ChunkResult {
+        h5read_status status;
+        SPAN<uint8_t> data;
+        /// Size of the chunk. This is set even if it didn't fit the buffer.
+        size_t size;
+
+        explicit operator bool() const {
+            return status == H5READ_OK;
+        }
+    };
+
     virtual SPAN<uint8_t> get_raw_chunk(size_t index, SPAN<uint8_t> destination) = 0;
+    /// Read a raw chunk, returning the reason for failure instead of exiting
+    virtual ChunkResult try_get_raw_chunk(size_t index, SPAN<uint8_t> destination) {
+        if (!is_image_available(index)) {
+            return {H5READ_ERROR_NOT_AVAILABLE, {}, 0};
+        }
+        auto chunk = get_raw_chunk(index, destination);
+        return {H5READ_OK, chunk, chunk.size()};
+    }
+    /// Get a raw chunk without copying it, if the reader is able to.
+    ///
+    /// Otherwise, the chunk is read into destination like get_raw_chunk. The
+    /// data is only valid while the returned view (or its owner) is held.
+    virtual ChunkView get_raw_chunk_view(size_t index, SPAN<uint8_t> destination) {
+        auto chunk = get_raw_chunk(index, destination);
+        return {{chunk.data(), chunk.size()}, nullptr};
+    }
     virtual ChunkCompression get_raw_chunk_compression() = 0;
     virtual size_t get_number_of_images() const = 0;
     virtual std::array<size_t, 2> image_shape() const = 0;
@@ -164,6 +438,8 @@ class H5Read : public Reader {
 
     /// Create a reader using generated sample data
     H5Read();
+    /// Create a reader generating synthetic data
+    H5Read(const h5read_synthetic_params &params);
     /// Create a reader from a Nexus file
     H5Read(const std::string &filename);
     /// Create a reader by parsing command arguments
@@ -180,14 +456,45 @@ class H5Read : public Reader {
 #endif
         h5read_get_image_into(_handle.get(), index, data.data());
     }
+    /// Read image data into an existing buffer, returning any failure
+    h5read_status try_get_image_into(size_t index, SPAN<uint16_t> data) {
+        if (data.size() < get_image_slow() * get_image_fast()) {
+            return H5READ_ERROR_BUFFER_TOO_SMALL;
+        }
+        return h5read_try_get_image_into(_handle.get(), index, data.data());
+    }
 
     /// See if an image is available for raw chunk read
     bool is_image_available(size_t index) {
         return h5read_get_chunk_size(_handle.get(), index) > 0;
     }
 
+    /// Wait for an image to be written, for up to timeout seconds
+    bool wait_for_image(size_t index, float timeout) {
+        return h5read_wait_for_image(_handle.get(), index, timeout * 1000);
+    }
+
+    virtual bool set_direct_io(bool enable) {
+        _direct_io = enable;
+        return true;
+    }
+
     SPAN<uint8_t> get_raw_chunk(size_t index, SPAN<uint8_t> destination) {
         size_t chunk_bytes;
+        if (_direct_io) {
+            auto chunk = h5read_get_raw_chunk_direct(_handle.get(),
+                                                     index,
+                                                     &chunk_bytes,
+                                                     destination.data(),
+                                                     destination.size_bytes());
+            if (chunk != nullptr) {
+                return {chunk, chunk_bytes};
+            }
+            // Not every filesystem supports O_DIRECT, so fall back
+            fprintf(stderr,
+                    "Warning: Direct chunk read failed; using buffered reads\n");
+            _direct_io = false;
+        }
         h5read_get_raw_chunk(_handle.get(),
                              index,
                              &chunk_bytes,
@@ -196,6 +503,35 @@ class H5Read : public Reader {
         return {destination.data(), chunk_bytes};
     }
 
+    ChunkResult try_get_raw_chunk(size_t index, SPAN<uint8_t> destination) {
+        size_t chunk_bytes = 0;
+        if (_direct_io) {
+            auto chunk = h5read_get_raw_chunk_direct(_handle.get(),
+                                                     index,
+                                                     &chunk_bytes,
+                                                     destination.data(),
+                                                     destination.size_bytes());
+            if (chunk != nullptr) {
+                return {H5READ_OK, {chunk, chunk_bytes}, chunk_bytes};
+            }
+            // The buffered read will tell us why this failed
+        }
+        auto status = h5read_try_get_raw_chunk(_handle.get(),
+                                               index,
+                                               &chunk_bytes,
+                                               destination.data(),
+                                               destination.size_bytes());
+        if (status != H5READ_OK) {
+            return {status, {}, chunk_bytes};
+        }
+        if (_direct_io) {
+            fprintf(stderr,
+                    "Warning: Direct chunk read failed; using buffered reads\n");
+            _direct_io = false;
+        }
+        return {status, {destination.data(), chunk_bytes}, chunk_bytes};
+    }
+
     virtual auto get_raw_chunk_compression() -> ChunkCompression {
         return Reader::ChunkCompression::BITSHUFFLE_LZ4;
     }
@@ -203,6 +539,15 @@ class H5Read : public Reader {
     Image get_image(size_t index) {
         return Image(_handle, index);
     }
+    /// Read an image, returning the reason for failure instead of exiting
+    h5read_status try_get_image(size_t index, std::optional<Image> &image) {
+        image_t *result = nullptr;
+        auto status = h5read_try_get_image(_handle.get(), index, &result);
+        if (status == H5READ_OK) {
+            image.emplace(_handle, result);
+        }
+        return status;
+    }
 
     virtual std::optional<SPAN<const uint8_t>> get_mask() const {
         auto mask = h5read_get_mask(_handle.get());
@@ -215,6 +560,16 @@ class H5Read : public Reader {
     ImageModules get_image_modules(size_t index) {
         return ImageModules(_handle, index);
     }
+    /// Read an image as modules, returning the reason for failure
+    h5read_status try_get_image_modules(size_t index,
+                                        std::optional<ImageModules> &modules) {
+        image_modules_t *result = nullptr;
+        auto status = h5read_try_get_image_modules(_handle.get(), index, &result);
+        if (status == H5READ_OK) {
+            modules.emplace(_handle, result);
+        }
+        return status;
+    }
 
     /// Get the total number of image frames
     virtual size_t get_number_of_images() const {
@@ -237,6 +592,81 @@ class H5Read : public Reader {
 
   protected:
     std::shared_ptr<h5read_handle> _handle;
+    bool _direct_io = false;
+};
+
+/// Wait for a check to pass, for up to timeout seconds.
+///
+/// Instead of polling, this sleeps until there are changes in the directory.
+/// Returns false if the timeout expired first.
+template <typename F>
+bool wait_for_directory_change(const std::string &directory, float timeout, F check) {
+    if (check()) return true;
+    // Watch before checking again, so that changes are never missed
+    auto watch = std::unique_ptr<h5read_watch, decltype(&h5read_watch_free)>(
+      h5read_watch_open(directory.c_str()), &h5read_watch_free);
+    auto deadline = std::chrono::steady_clock::now()
+                    + std::chrono::duration<float>(timeout);
+    while (!check()) {
+        auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(
+                           deadline - std::chrono::steady_clock::now())
+                           .count();
+        if (remaining <= 0) return false;
+        if (watch) {
+            h5read_watch_wait(watch.get(), remaining);
+        } else {
+            // We couldn't watch the directory, so fall back to polling
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+    }
+    return true;
+}
+
+/// Allocate an owning buffer suitable for direct (O_DIRECT) reads
+inline auto make_direct_buffer(size_t size) {
+    auto data = static_cast<uint8_t *>(h5read_direct_alloc(size));
+    if (data == nullptr) throw std::bad_alloc();
+    return std::unique_ptr<uint8_t[], decltype(&std::free)>(data, &std::free);
+}
+
+/// Deleter for memory from h5read_huge_alloc, which needs the size back
+struct HugeBufferDeleter {
+    size_t size;
+    void operator()(void *ptr) const {
+        h5read_huge_free(ptr, size);
+    }
+};
+
+/// Allocate an owning, huge-page backed buffer of `count` T's
+template <typename T = uint8_t>
+auto make_huge_buffer(size_t count, int numa_node = H5READ_NUMA_LOCAL) {
+    auto data = static_cast<T *>(h5read_huge_alloc(count * sizeof(T), numa_node));
+    if (data == nullptr) throw std::bad_alloc();
+    return std::unique_ptr<T[], HugeBufferDeleter>(data, {count * sizeof(T)});
+}
+
+/// Standard allocator for huge-page backed containers, on the NUMA node
+/// of the thread that allocates. Only worth it for large allocations.
+template <typename T>
+struct HugePageAllocator {
+    using value_type = T;
+
+    HugePageAllocator() = default;
+    template <typename U>
+    HugePageAllocator(const HugePageAllocator<U> &) {}
+
+    auto allocate(size_t count) -> T * {
+        auto data = h5read_huge_alloc(count * sizeof(T), H5READ_NUMA_LOCAL);
+        if (data == nullptr) throw std::bad_alloc();
+        return static_cast<T *>(data);
+    }
+    void deallocate(T *ptr, size_t count) {
+        h5read_huge_free(ptr, count * sizeof(T));
+    }
+    template <typename U>
+    bool operator==(const HugePageAllocator<U> &) const {
+        return true;
+    }
 };
 
 template <typename T>
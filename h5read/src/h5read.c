@@ -1,11 +1,26 @@
+// Needed for O_DIRECT
+#define _GNU_SOURCE
+
 #include "h5read.h"
 
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <libgen.h>
+#include <math.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
 #include <unistd.h>
 
 #ifdef HAVE_HDF5
@@ -19,23 +34,30 @@ typedef uint8_t hid_t;
 
 // VDS stuff
 
-#define MAXFILENAME 256
-#define MAXDATAFILES 100
 #define MAXDIM 3
 
 typedef struct h5_data_file {
-    char filename[MAXFILENAME];
-    char dsetname[MAXFILENAME];
+    char *filename;
+    char *dsetname;
     hid_t file;
     hid_t dataset;
     size_t frames;
     size_t offset;
+    int direct_fd;        ///< O_DIRECT file descriptor, opened on first direct read
+    size_t base_address;  ///< Byte offset of HDF5 addresses (userblock size)
+    int lru_prev;         ///< Next more recently used open file, or -1
+    int lru_next;         ///< Next less recently used open file, or -1
 } h5_data_file;
 
 struct _h5read_handle {
     hid_t master_file;
     int data_file_count;
-    h5_data_file *data_files;
+    h5_data_file *data_files;  ///< Data files, sorted by frame offset
+    size_t uniform_frames;     ///< Frames in every data file, or 0 if they differ
+    int open_files;            ///< Number of data files currently open
+    int max_open_files;        ///< Most data files to keep open at once
+    int lru_head;              ///< Most recently used open data file, or -1
+    int lru_tail;              ///< Least recently used open data file, or -1
     size_t frames;  ///< Number of frames in this dataset
     size_t slow;    ///< Pixel dimension of images in the slow direction
     size_t fast;    ///< Pixel dimensions of images in the fast direction
@@ -43,19 +65,183 @@ struct _h5read_handle {
     uint8_t *mask;         ///< Shared image mask
     uint8_t *module_mask;  ///< Shared module mask
     size_t mask_size;      ///< Total size(in pixels) of mask
+
+    struct _buffer_pool *image_pool;    ///< Recycled buffers for h5read_get_image
+    struct _buffer_pool *modules_pool;  ///< Recycled h5read_get_image_modules buffers
+
+    struct _synthetic_data *synthetic;  ///< Generator, if this is synthetic data
 };
 
+static void _synthetic_free(struct _synthetic_data *synth);
+
+// Image buffer pools
+//
+// Every image read with h5read_get_image needs a large (35 MB for a 16M
+// detector) buffer. Rather than allocating and page-faulting a fresh one for
+// every image, buffers are taken from a pool on the handle and returned to
+// it when the image is freed. The buffers come from h5read_huge_alloc.
+/// Most unused buffers to keep in a pool; any more freed are released
+#define POOL_MAX_FREE 16
+
+/// A pooled buffer. The public struct is first, so the pointer handed out
+/// can be converted back to find the pool it must be returned to.
+typedef struct _pooled_buffer {
+    union {
+        image_t image;
+        image_modules_t modules;
+    } header;
+    struct _buffer_pool *pool;
+    struct _pooled_buffer *next;  ///< Next free buffer, when in the pool
+    void *data;
+} pooled_buffer;
+
+typedef struct _buffer_pool {
+    pthread_mutex_t mutex;
+    size_t data_size;      ///< Usable size of each buffer
+    size_t mapping_size;   ///< Size of each buffer mapping, including header
+    pooled_buffer *free;   ///< Buffers ready for reuse
+    size_t free_count;     ///< Number of buffers in the free list
+    size_t references;     ///< The handle, plus one per buffer handed out
+} buffer_pool;
+
+static buffer_pool *_pool_create(size_t data_size) {
+    buffer_pool *pool = calloc(1, sizeof(buffer_pool));
+    pthread_mutex_init(&pool->mutex, NULL);
+    pool->data_size = data_size;
+    // The header goes after the (cache-line rounded) data, so that the data
+    // starts at the start of a huge page
+    pool->mapping_size = ((data_size + 63) & ~(size_t)63) + sizeof(pooled_buffer);
+    pool->references = 1;
+    return pool;
+}
+
+/// Drop a reference to a pool, destroying it if there are none left.
+/// Must be called with the pool mutex held; it is released.
+static void _pool_release_locked(buffer_pool *pool) {
+    size_t references = --pool->references;
+    pthread_mutex_unlock(&pool->mutex);
+    if (references > 0) return;
+    while (pool->free) {
+        pooled_buffer *buffer = pool->free;
+        pool->free = buffer->next;
+        h5read_huge_free(buffer->data, pool->mapping_size);
+    }
+    pthread_mutex_destroy(&pool->mutex);
+    free(pool);
+}
+
+/// Take a buffer from the pool, allocating one if none are free
+static pooled_buffer *_pool_acquire(buffer_pool *pool) {
+    pthread_mutex_lock(&pool->mutex);
+    pool->references += 1;
+    pooled_buffer *buffer = pool->free;
+    if (buffer) {
+        pool->free = buffer->next;
+        pool->free_count -= 1;
+    }
+    pthread_mutex_unlock(&pool->mutex);
+    if (buffer) {
+        return buffer;
+    }
+
+    // This will be on the NUMA node of the first thread to need it
+    uint8_t *data = h5read_huge_alloc(pool->mapping_size, H5READ_NUMA_LOCAL);
+    if (data == NULL) {
+        fprintf(stderr, "Error: Could not allocate image buffer\n");
+        exit(1);
+    }
+    buffer = (pooled_buffer *)(data + ((pool->data_size + 63) & ~(size_t)63));
+    buffer->pool = pool;
+    buffer->data = data;
+    return buffer;
+}
+
+/// Return a buffer to the pool it came from
+static void _pool_return(pooled_buffer *buffer) {
+    buffer_pool *pool = buffer->pool;
+    pthread_mutex_lock(&pool->mutex);
+    if (pool->free_count < POOL_MAX_FREE) {
+        buffer->next = pool->free;
+        pool->free = buffer;
+        pool->free_count += 1;
+    } else {
+        h5read_huge_free(buffer->data, pool->mapping_size);
+    }
+    _pool_release_locked(pool);
+}
+
+/// Release the handle's hold on a pool. Buffers still in use keep it alive.
+static void _pool_free(buffer_pool *pool) {
+    if (pool == NULL) return;
+    pthread_mutex_lock(&pool->mutex);
+    _pool_release_locked(pool);
+}
+
+/// Number of modules in an image, in the fast and slow directions
+static void _module_layout(size_t image_slow, size_t *fast, size_t *slow) {
+    if (image_slow == E2XE_16M_SLOW) {
+        *fast = 4;
+        *slow = 8;
+    } else {
+        *fast = 2;
+        *slow = 4;
+    }
+}
+
+/// Create the image buffer pools, once the image size is known
+static void _create_pools(h5read_handle *obj) {
+    size_t fast, slow;
+    _module_layout(obj->slow, &fast, &slow);
+    obj->image_pool = _pool_create(sizeof(image_t_type) * obj->slow * obj->fast);
+    obj->modules_pool = _pool_create(sizeof(image_t_type) * fast * slow
+                                     * E2XE_MOD_SLOW * E2XE_MOD_FAST);
+}
+
+/// Exit with a message, for the read functions that can't return errors
+static void _exit_on_error(h5read_status status, size_t index) {
+    if (status != H5READ_OK) {
+        fprintf(stderr,
+                "Error: Reading frame %zu: %s\n",
+                index,
+                h5read_status_string(status));
+        exit(1);
+    }
+}
+
+/// As _exit_on_error, but report the number of frames if out of range
+static void _exit_on_image_error(h5read_handle *obj,
+                                 h5read_status status,
+                                 size_t index) {
+    if (status == H5READ_ERROR_OUT_OF_RANGE) {
+        fprintf(stderr,
+                "Error: image %ld greater than number of frames (%ld)\n",
+                index,
+                obj->frames);
+        exit(1);
+    }
+    _exit_on_error(status, index);
+}
+
 void h5read_free(h5read_handle *obj) {
 #ifdef HAVE_HDF5
     for (int i = 0; i < obj->data_file_count; i++) {
-        H5Dclose(obj->data_files[i].dataset);
-        H5Fclose(obj->data_files[i].file);
+        // Data files are only opened when first used
+        if (obj->data_files[i].dataset > 0) H5Dclose(obj->data_files[i].dataset);
+        if (obj->data_files[i].file > 0) H5Fclose(obj->data_files[i].file);
+        if (obj->data_files[i].direct_fd >= 0) close(obj->data_files[i].direct_fd);
     }
     if (obj->master_file) H5Fclose(obj->master_file);
 #endif
+    for (int i = 0; i < obj->data_file_count; i++) {
+        free(obj->data_files[i].filename);
+        free(obj->data_files[i].dsetname);
+    }
     if (obj->data_files) free(obj->data_files);
     free(obj->mask);
     free(obj->module_mask);
+    _pool_free(obj->image_pool);
+    _pool_free(obj->modules_pool);
+    _synthetic_free(obj->synthetic);
 
     free(obj);
 }
@@ -74,9 +260,9 @@ size_t h5read_get_image_fast(h5read_handle *obj) {
 }
 
 void h5read_free_image(image_t *i) {
-    free(i->data);
-    // Mask is a pointer to the file-global file mask so isn't freed
-    free(i);
+    // The image data goes back to the pool for the next image. The mask is a
+    // pointer to the file-global file mask so isn't freed.
+    _pool_return((pooled_buffer *)i);
 }
 
 uint8_t *h5read_get_mask(h5read_handle *obj) {
@@ -84,20 +270,14 @@ uint8_t *h5read_get_mask(h5read_handle *obj) {
 }
 
 /// blit the relevent pixel data across from a single image into a collection
-/// of image modules - will allocate the latter
+/// of image modules - the module data must already be allocated
 ///
 /// @param image    The image to blit from
 /// @param modules  The modules object to fill
 void _blit(image_t *image, image_modules_t *modules) {
     // Number of modules in fast, slow directions
     size_t fast, slow;
-    if (image->slow == E2XE_16M_SLOW) {
-        fast = 4;
-        slow = 8;
-    } else {
-        fast = 2;
-        slow = 4;
-    }
+    _module_layout(image->slow, &fast, &slow);
 
     modules->slow = E2XE_MOD_SLOW;
     modules->fast = E2XE_MOD_FAST;
@@ -105,8 +285,6 @@ void _blit(image_t *image, image_modules_t *modules) {
 
     size_t module_pixels = E2XE_MOD_SLOW * E2XE_MOD_FAST;
 
-    modules->data = (uint16_t *)malloc(sizeof(uint16_t) * slow * fast * module_pixels);
-
     for (size_t _slow = 0; _slow < slow; _slow++) {
         size_t row0 = _slow * (E2XE_MOD_SLOW + E2XE_GAP_SLOW) * image->fast;
         for (size_t _fast = 0; _fast < fast; _fast++) {
@@ -123,23 +301,37 @@ void _blit(image_t *image, image_modules_t *modules) {
     }
 }
 
-image_modules_t *h5read_get_image_modules(h5read_handle *obj, size_t n) {
-    image_t *image = h5read_get_image(obj, n);
-    image_modules_t *modules = malloc(sizeof(image_modules_t));
-    modules->data = NULL;
-    modules->mask = obj->module_mask;
-    modules->modules = -1;
-    modules->fast = -1;
-    modules->slow = -1;
-    _blit(image, modules);
+h5read_status h5read_try_get_image_modules(h5read_handle *obj,
+                                          size_t n,
+                                          image_modules_t **modules) {
+    *modules = NULL;
+    image_t *image = NULL;
+    h5read_status status = h5read_try_get_image(obj, n, &image);
+    if (status != H5READ_OK) {
+        return status;
+    }
+    pooled_buffer *buffer = _pool_acquire(obj->modules_pool);
+    image_modules_t *result = &buffer->header.modules;
+    result->data = buffer->data;
+    result->mask = obj->module_mask;
+    result->modules = -1;
+    result->fast = -1;
+    result->slow = -1;
+    _blit(image, result);
     h5read_free_image(image);
+    *modules = result;
+    return H5READ_OK;
+}
+
+image_modules_t *h5read_get_image_modules(h5read_handle *obj, size_t n) {
+    image_modules_t *modules = NULL;
+    _exit_on_image_error(obj, h5read_try_get_image_modules(obj, n, &modules), n);
     return modules;
 }
 
 void h5read_free_image_modules(image_modules_t *i) {
-    free(i->data);
     // Like image, mask is held on the central h5read_handle object
-    free(i);
+    _pool_return((pooled_buffer *)i);
 }
 
 // *Really* minimal PCG32 code / (c) 2014 M.E. O'Neill / pcg-random.org
@@ -233,113 +425,903 @@ void _generate_sample_image(h5read_handle *obj, size_t n, image_t_type *data) {
     }
 }
 
+// Synthetic data
+//
+// Rather than a fixed set of images, generate as many frames as asked for of
+// something resembling real diffraction data: a Poisson background that falls
+// off away from the beam centre, with Gaussian spots scattered over it, a set
+// of hot pixels and saturation. Every frame is generated from its index and
+// the seed alone, so frames can be generated on any thread, in any order,
+// and always come out the same. Each frame is split into bands of rows, each
+// with their own random stream, so that one frame can also be generated by
+// several threads at once without changing the result.
+
+/// Number of distinct background levels between the centre and corners
+#define SYNTHETIC_LEVELS 256
+/// Length of each background level cumulative distribution table
+#define SYNTHETIC_CDF_LENGTH 64
+/// Background above which a normal approximation is used instead of a table
+#define SYNTHETIC_MAX_TABLE_MEAN 30.0
+/// Rows in each band of a synthetic image
+#define SYNTHETIC_BAND_ROWS 64
+
+typedef struct _synthetic_spot {
+    double x, y;       ///< Spot centre, in pixels
+    double intensity;  ///< Total expected counts in the spot
+} synthetic_spot;
+
+typedef struct _synthetic_data {
+    h5read_synthetic_params params;
+    double level_mean[SYNTHETIC_LEVELS];  ///< Mean background at each level
+    /// P(X <= k) for a Poisson X at each background level, scaled to 2^32
+    uint32_t cdf[SYNTHETIC_LEVELS][SYNTHETIC_CDF_LENGTH];
+    uint8_t *level;      ///< Background level of every pixel
+    size_t *hot_pixels;  ///< Pixel index of every hot pixel
+    size_t num_hot_pixels;
+    int threads;  ///< Threads to generate each frame with
+} synthetic_data;
+
+/// Mix a value into a seed, to seed independent random streams (splitmix64)
+static uint64_t _mix_seed(uint64_t seed, uint64_t value) {
+    uint64_t z = seed + (value + 1) * 0x9e3779b97f4a7c15ull;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+}
+
+static pcg32_random_t _seed_stream(uint64_t seed, uint64_t frame, uint64_t stream) {
+    pcg32_random_t rng = {_mix_seed(_mix_seed(seed, frame), stream), stream * 2 + 1};
+    pcg32_random_r(&rng);
+    return rng;
+}
+
+/// Uniform random double in [0, 1)
+static double _uniform(pcg32_random_t *rng) {
+    return pcg32_random_r(rng) * (1.0 / 4294967296.0);
+}
+
+/// Standard normal random number (Box-Muller)
+static double _normal(pcg32_random_t *rng) {
+    double u = 1.0 - _uniform(rng);
+    return sqrt(-2.0 * log(u)) * cos(2 * M_PI * _uniform(rng));
+}
+
+/// Poisson random number with any mean, for when there is no table
+static uint32_t _poisson(pcg32_random_t *rng, double mean) {
+    if (mean <= 0) return 0;
+    if (mean > SYNTHETIC_MAX_TABLE_MEAN) {
+        double value = round(mean + sqrt(mean) * _normal(rng));
+        return value < 0 ? 0 : (uint32_t)value;
+    }
+    // Knuth's method
+    double limit = exp(-mean), product = _uniform(rng);
+    uint32_t count = 0;
+    while (product > limit) {
+        product *= _uniform(rng);
+        count += 1;
+    }
+    return count;
+}
+
+void h5read_synthetic_default_params(h5read_synthetic_params *params) {
+    params->detector = H5READ_EIGER2XE_16M;
+    params->frames = 1000;
+    params->background = 2.0;
+    params->background_edge = 0.2;
+    params->spots_per_frame = 500;
+    params->spot_intensity = 1000;
+    params->spot_sigma = 1.0;
+    params->hot_pixel_fraction = 1e-5;
+    params->saturation = 65534;
+    params->seed = 1;
+    params->threads = 0;
+}
+
+static synthetic_data *_synthetic_create(const h5read_synthetic_params *params,
+                                         const uint8_t *mask,
+                                         size_t slow,
+                                         size_t fast) {
+    synthetic_data *synth = calloc(1, sizeof(synthetic_data));
+    synth->params = *params;
+    synth->threads = params->threads;
+    if (synth->threads < 1) {
+        synth->threads = sysconf(_SC_NPROCESSORS_ONLN);
+        if (synth->threads < 1) synth->threads = 1;
+    }
+
+    // Cumulative distribution tables for every background level, so that
+    // each background pixel costs a single random number
+    for (int level = 0; level < SYNTHETIC_LEVELS; ++level) {
+        double mean =
+          params->background_edge
+          + (params->background - params->background_edge) * level
+              / (SYNTHETIC_LEVELS - 1);
+        synth->level_mean[level] = mean;
+        double probability = exp(-mean), total = 0;
+        for (int k = 0; k < SYNTHETIC_CDF_LENGTH; ++k) {
+            total += probability;
+            probability *= mean / (k + 1);
+            double scaled = total * 4294967296.0;
+            synth->cdf[level][k] = scaled >= 4294967295.0 ? UINT32_MAX : scaled;
+        }
+        synth->cdf[level][SYNTHETIC_CDF_LENGTH - 1] = UINT32_MAX;
+    }
+
+    // Background falls off as (1 - r)^2, from the centre to the corners
+    synth->level = malloc(slow * fast);
+    double centre_x = fast / 2.0, centre_y = slow / 2.0;
+    double max_radius = sqrt(centre_x * centre_x + centre_y * centre_y);
+    for (size_t y = 0; y < slow; ++y) {
+        for (size_t x = 0; x < fast; ++x) {
+            double r = hypot(x - centre_x, y - centre_y) / max_radius;
+            synth->level[y * fast + x] =
+              lround((SYNTHETIC_LEVELS - 1) * (1 - r) * (1 - r));
+        }
+    }
+
+    // Hot pixels are the same on every frame, and not masked
+    pcg32_random_t rng = _seed_stream(params->seed, UINT64_MAX, 0);
+    size_t num_hot_pixels = lround(params->hot_pixel_fraction * slow * fast);
+    synth->hot_pixels = malloc(sizeof(size_t) * (num_hot_pixels + 1));
+    // Give up on pixels that land on the mask after enough tries, so that a
+    // mostly (or fully) masked detector just gets fewer hot pixels
+    size_t max_attempts = 100 * num_hot_pixels;
+    synth->num_hot_pixels = 0;
+    for (size_t attempt = 0;
+         attempt < max_attempts && synth->num_hot_pixels < num_hot_pixels;
+         ++attempt) {
+        size_t k = (size_t)(_uniform(&rng) * slow * fast);
+        if (mask[k]) synth->hot_pixels[synth->num_hot_pixels++] = k;
+    }
+    return synth;
+}
+
+static void _synthetic_free(synthetic_data *synth) {
+    if (synth == NULL) return;
+    free(synth->level);
+    free(synth->hot_pixels);
+    free(synth);
+}
+
+/// Everything a thread needs to generate its bands of one frame
+typedef struct _synthetic_frame {
+    const synthetic_data *synth;
+    const uint8_t *mask;
+    size_t slow, fast;
+    size_t index;
+    const synthetic_spot *spots;
+    size_t num_spots;
+    image_t_type *data;
+    int first_band;  ///< Generate every `band_step`'th band from this one
+    int band_step;
+} synthetic_frame;
+
+static void _synthetic_generate_band(const synthetic_frame *frame, size_t band) {
+    const synthetic_data *synth = frame->synth;
+    const h5read_synthetic_params *params = &synth->params;
+    size_t fast = frame->fast;
+    size_t y0 = band * SYNTHETIC_BAND_ROWS;
+    size_t y1 = y0 + SYNTHETIC_BAND_ROWS < frame->slow ? y0 + SYNTHETIC_BAND_ROWS
+                                                       : frame->slow;
+    pcg32_random_t rng = _seed_stream(params->seed, frame->index, band + 1);
+    bool use_table = fmax(params->background, params->background_edge)
+                     <= SYNTHETIC_MAX_TABLE_MEAN;
+
+    // Background
+    for (size_t k = y0 * fast; k < y1 * fast; ++k) {
+        if (!frame->mask[k]) {
+            frame->data[k] = 0;
+            continue;
+        }
+        uint8_t level = synth->level[k];
+        if (use_table) {
+            uint32_t u = pcg32_random_r(&rng);
+            const uint32_t *cdf = synth->cdf[level];
+            // Count the first few without branches, as a search through
+            // these would mispredict on almost every pixel
+            int count = 0;
+            for (int i = 0; i < 8; ++i) {
+                count += u >= cdf[i];
+            }
+            while (count < SYNTHETIC_CDF_LENGTH - 1 && u >= cdf[count]) {
+                count += 1;
+            }
+            frame->data[k] = count;
+        } else {
+            uint32_t count = _poisson(&rng, synth->level_mean[level]);
+            frame->data[k] = count < params->saturation ? count : params->saturation;
+        }
+    }
+
+    // Spots, for the part of each that lands in this band
+    double sigma = params->spot_sigma > 0 ? params->spot_sigma : 1.0;
+    int radius = (int)ceil(3 * sigma);
+    double peak = 1.0 / (2 * M_PI * sigma * sigma);
+    for (size_t i = 0; i < frame->num_spots; ++i) {
+        const synthetic_spot *spot = &frame->spots[i];
+        long sy0 = (long)spot->y - radius, sy1 = (long)spot->y + radius;
+        if (sy1 < (long)y0 || sy0 >= (long)y1) continue;
+        if (sy0 < (long)y0) sy0 = y0;
+        if (sy1 >= (long)y1) sy1 = y1 - 1;
+        long sx0 = (long)spot->x - radius, sx1 = (long)spot->x + radius;
+        if (sx0 < 0) sx0 = 0;
+        if (sx1 >= (long)fast) sx1 = fast - 1;
+        for (long y = sy0; y <= sy1; ++y) {
+            for (long x = sx0; x <= sx1; ++x) {
+                size_t k = y * fast + x;
+                if (!frame->mask[k]) continue;
+                double dx = x + 0.5 - spot->x, dy = y + 0.5 - spot->y;
+                double expected = spot->intensity * peak
+                                  * exp(-(dx * dx + dy * dy) / (2 * sigma * sigma));
+                uint32_t value = frame->data[k] + _poisson(&rng, expected);
+                frame->data[k] =
+                  value < params->saturation ? value : params->saturation;
+            }
+        }
+    }
+
+    // Hot pixels
+    for (size_t i = 0; i < synth->num_hot_pixels; ++i) {
+        size_t k = synth->hot_pixels[i];
+        if (k >= y0 * fast && k < y1 * fast) {
+            frame->data[k] = params->saturation;
+        }
+    }
+}
+
+static void *_synthetic_generate_thread(void *arg) {
+    const synthetic_frame *frame = arg;
+    size_t bands = (frame->slow + SYNTHETIC_BAND_ROWS - 1) / SYNTHETIC_BAND_ROWS;
+    for (size_t band = frame->first_band; band < bands; band += frame->band_step) {
+        _synthetic_generate_band(frame, band);
+    }
+    return NULL;
+}
+
+/// Generate a synthetic frame
+static void _synthetic_generate(const synthetic_data *synth,
+                                const uint8_t *mask,
+                                size_t slow,
+                                size_t fast,
+                                size_t index,
+                                image_t_type *data) {
+    const h5read_synthetic_params *params = &synth->params;
+
+    // Place this frame's spots. Their intensities are exponentially
+    // distributed, like reflection intensities (Wilson statistics).
+    pcg32_random_t rng = _seed_stream(params->seed, index, 0);
+    size_t num_spots = _poisson(&rng, params->spots_per_frame);
+    synthetic_spot *spots = malloc(sizeof(synthetic_spot) * (num_spots + 1));
+    for (size_t i = 0; i < num_spots; ++i) {
+        spots[i].x = _uniform(&rng) * fast;
+        spots[i].y = _uniform(&rng) * slow;
+        spots[i].intensity = -params->spot_intensity * log(1.0 - _uniform(&rng));
+    }
+
+    // Split the bands over threads
+    int threads = synth->threads;
+    synthetic_frame frames[threads];
+    pthread_t thread_ids[threads];
+    for (int i = 0; i < threads; ++i) {
+        frames[i] = (synthetic_frame){
+          .synth = synth,
+          .mask = mask,
+          .slow = slow,
+          .fast = fast,
+          .index = index,
+          .spots = spots,
+          .num_spots = num_spots,
+          .data = data,
+          .first_band = i,
+          .band_step = threads,
+        };
+    }
+    int started = 0;
+    for (; started < threads - 1; ++started) {
+        if (pthread_create(
+              &thread_ids[started], NULL, _synthetic_generate_thread, &frames[started])
+            != 0) {
+            break;
+        }
+    }
+    // This thread does the last share, and any that couldn't be started
+    for (int i = started; i < threads; ++i) {
+        _synthetic_generate_thread(&frames[i]);
+    }
+    for (int i = 0; i < started; ++i) {
+        pthread_join(thread_ids[i], NULL);
+    }
+    free(spots);
+}
+
 /// Find the data file index for a particular image number.
 /// If the image isn't found on any data files, returns obj->data_file_count
 int _find_data_file_for_image(h5read_handle *obj, size_t index) {
     int data_file = 0;
-    for (; data_file < obj->data_file_count; data_file++) {
-        if ((index - obj->data_files[data_file].offset)
-            < obj->data_files[data_file].frames) {
-            break;
+    if (obj->uniform_frames) {
+        // Every file is the same size, so we can go straight there
+        size_t guess = index / obj->uniform_frames;
+        data_file = guess < (size_t)obj->data_file_count ? (int)guess
+                                                          : obj->data_file_count - 1;
+    } else {
+        // Binary search for the last data file starting at or before index
+        int low = 0, high = obj->data_file_count;
+        while (high - low > 1) {
+            int middle = low + (high - low) / 2;
+            if (obj->data_files[middle].offset <= index) {
+                low = middle;
+            } else {
+                high = middle;
+            }
         }
+        data_file = low;
+    }
+    if (data_file >= obj->data_file_count
+        || (index - obj->data_files[data_file].offset)
+             >= obj->data_files[data_file].frames) {
+        return obj->data_file_count;
     }
     return data_file;
 }
 
-size_t h5read_get_chunk_size(h5read_handle *obj, size_t index) {
-    if (obj->data_files == 0) {
-        fprintf(stderr, "Error: Cannot do direct chunk read with sample data\n", index);
-        exit(1);
+#ifdef HAVE_HDF5
+/// Unlink an open data file from the most-recently-used list
+static void _lru_remove(h5read_handle *obj, int index) {
+    h5_data_file *data_file = &obj->data_files[index];
+    if (data_file->lru_prev >= 0) {
+        obj->data_files[data_file->lru_prev].lru_next = data_file->lru_next;
+    } else {
+        obj->lru_head = data_file->lru_next;
+    }
+    if (data_file->lru_next >= 0) {
+        obj->data_files[data_file->lru_next].lru_prev = data_file->lru_prev;
+    } else {
+        obj->lru_tail = data_file->lru_prev;
+    }
+    data_file->lru_prev = data_file->lru_next = -1;
+}
+
+/// Mark an open data file as the most recently used
+static void _lru_push_front(h5read_handle *obj, int index) {
+    h5_data_file *data_file = &obj->data_files[index];
+    data_file->lru_prev = -1;
+    data_file->lru_next = obj->lru_head;
+    if (obj->lru_head >= 0) {
+        obj->data_files[obj->lru_head].lru_prev = index;
+    } else {
+        obj->lru_tail = index;
+    }
+    obj->lru_head = index;
+}
+
+/// Close an open data file, including any direct I/O descriptor
+static void _close_data_file(h5read_handle *obj, int index) {
+    h5_data_file *data_file = &obj->data_files[index];
+    _lru_remove(obj, index);
+    H5Dclose(data_file->dataset);
+    H5Fclose(data_file->file);
+    if (data_file->direct_fd >= 0) close(data_file->direct_fd);
+    data_file->dataset = 0;
+    data_file->file = 0;
+    data_file->direct_fd = -1;
+    obj->open_files -= 1;
+}
+
+/// Open a data file and its dataset, if this hasn't already been done.
+///
+/// Data files are opened on first use rather than all up front, so that
+/// opening datasets with many files (especially over the network) is fast.
+/// At most max_open_files are kept open; past that, the least recently used
+/// file is closed, so that large datasets don't run out of file descriptors.
+///
+/// @returns H5READ_ERROR_NOT_AVAILABLE if the file doesn't exist (yet), or
+///          H5READ_ERROR_OPEN if it does, but could not be opened
+h5read_status _open_data_file(h5read_handle *obj, int index) {
+    h5_data_file *data_file = &obj->data_files[index];
+    if (data_file->dataset > 0) {
+        if (obj->lru_head != index) {
+            _lru_remove(obj, index);
+            _lru_push_front(obj, index);
+        }
+        return H5READ_OK;
+    }
+    // Live datasets might not have created this file yet. Check first, to
+    // avoid HDF5 printing an error stack for this.
+    if (access(data_file->filename, R_OK) != 0) {
+        return H5READ_ERROR_NOT_AVAILABLE;
+    }
+    while (obj->open_files >= obj->max_open_files && obj->lru_tail >= 0) {
+        _close_data_file(obj, obj->lru_tail);
+    }
+    data_file->file =
+      H5Fopen(data_file->filename, H5F_ACC_RDONLY | H5F_ACC_SWMR_READ, H5P_DEFAULT);
+    if (data_file->file < 0) {
+        data_file->file = 0;
+        return H5READ_ERROR_OPEN;
+    }
+    data_file->dataset = H5Dopen(data_file->file, data_file->dsetname, H5P_DEFAULT);
+    if (data_file->dataset < 0) {
+        H5Fclose(data_file->file);
+        data_file->file = 0;
+        data_file->dataset = 0;
+        return H5READ_ERROR_OPEN;
+    }
+    obj->open_files += 1;
+    _lru_push_front(obj, index);
+    return H5READ_OK;
+}
+
+/// Find the data file for a particular image number, and make sure it is open
+h5read_status _get_data_file_for_image(h5read_handle *obj,
+                                       size_t index,
+                                       h5_data_file **data_file) {
+    int file_index = _find_data_file_for_image(obj, index);
+    if (file_index == obj->data_file_count) {
+        return H5READ_ERROR_OUT_OF_RANGE;
+    }
+    *data_file = &(obj->data_files[file_index]);
+    return _open_data_file(obj, file_index);
+}
+
+/// Get the storage size of an image chunk, refreshing live datasets if needed
+hsize_t _get_chunk_storage_size(h5_data_file *data_file, hsize_t *offset) {
+    hsize_t chunk_size = 0;
+    if (H5Dget_chunk_storage_size(data_file->dataset, offset, &chunk_size) < 0
+        || chunk_size == 0) {
+        // If this is a live (SWMR) dataset, the chunk may have been written
+        // since we last saw the extent. Refreshing is expensive, so only do
+        // it when the chunk looks to be missing.
+        H5Drefresh(data_file->dataset);
+        chunk_size = 0;
+        H5Dget_chunk_storage_size(data_file->dataset, offset, &chunk_size);
+    }
+    return chunk_size;
+}
+#endif
+
+const char *h5read_status_string(h5read_status status) {
+    switch (status) {
+    case H5READ_OK:
+        return "Success";
+    case H5READ_ERROR_SAMPLE_DATA:
+        return "Cannot do direct chunk read with sample data";
+    case H5READ_ERROR_OUT_OF_RANGE:
+        return "Could not find data file for frame";
+    case H5READ_ERROR_NOT_AVAILABLE:
+        return "Frame has not been written";
+    case H5READ_ERROR_OPEN:
+        return "Could not open data file";
+    case H5READ_ERROR_BUFFER_TOO_SMALL:
+        return "Not enough room to store compressed chunk";
+    case H5READ_ERROR_DATA_TYPE:
+        return "Unexpected data type";
+    case H5READ_ERROR_READ:
+        return "Failed to read data";
     }
+    return "Unknown error";
+}
+
+void h5read_set_max_open_files(h5read_handle *obj, int max_open_files) {
+    obj->max_open_files = max_open_files < 1 ? 1 : max_open_files;
 #ifdef HAVE_HDF5
-    int data_file = _find_data_file_for_image(obj, index);
-    if (data_file == obj->data_file_count) {
-        fprintf(stderr, "Error: Could not find data file for frame %ld\n", index);
-        exit(1);
+    while (obj->open_files > obj->max_open_files && obj->lru_tail >= 0) {
+        _close_data_file(obj, obj->lru_tail);
     }
-    h5_data_file *current = &(obj->data_files[data_file]);
+#endif
+}
 
+h5read_status h5read_try_get_chunk_size(h5read_handle *obj,
+                                        size_t index,
+                                        size_t *size) {
+    *size = 0;
+    if (obj->data_files == 0) {
+        return H5READ_ERROR_SAMPLE_DATA;
+    }
+#ifdef HAVE_HDF5
+    h5_data_file *current = NULL;
+    h5read_status status = _get_data_file_for_image(obj, index, &current);
+    if (status != H5READ_OK) {
+        return status;
+    }
     hsize_t offset[3] = {index - current->offset, 0, 0};
-    hsize_t chunk_size = 0;
-    // H5Drefresh(current->dataset);
-    H5Dget_chunk_storage_size(current->dataset, offset, &chunk_size);
+    *size = _get_chunk_storage_size(current, offset);
+    return *size > 0 ? H5READ_OK : H5READ_ERROR_NOT_AVAILABLE;
+#else
+    return H5READ_ERROR_READ;
 #endif
-    if (chunk_size < 0) {
+}
+
+size_t h5read_get_chunk_size(h5read_handle *obj, size_t index) {
+    size_t size = 0;
+    h5read_status status = h5read_try_get_chunk_size(obj, index, &size);
+    // Data that isn't written yet is allowed, as the size is then zero
+    if (status != H5READ_ERROR_NOT_AVAILABLE) {
+        _exit_on_error(status, index);
+    }
+    return size;
+}
+
+struct _h5read_watch {
+    int fd;  ///< inotify file descriptor
+};
+
+h5read_watch *h5read_watch_open(const char *directory) {
+    int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fd < 0) {
+        return NULL;
+    }
+    if (inotify_add_watch(
+          fd, directory, IN_CREATE | IN_MODIFY | IN_CLOSE_WRITE | IN_MOVED_TO)
+        < 0) {
+        close(fd);
+        return NULL;
+    }
+    h5read_watch *watch = malloc(sizeof(h5read_watch));
+    watch->fd = fd;
+    return watch;
+}
+
+int h5read_watch_wait(h5read_watch *watch, int timeout_ms) {
+    struct pollfd pfd = {.fd = watch->fd, .events = POLLIN};
+    int ready = poll(&pfd, 1, timeout_ms);
+    if (ready <= 0) {
         return 0;
     }
-    return (size_t)chunk_size;
+    // Drain the pending events; we only care that something happened
+    char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    while (read(watch->fd, events, sizeof(events)) > 0) {
+    }
+    return 1;
 }
 
-void h5read_get_raw_chunk(h5read_handle *obj,
-                          size_t index,
-                          size_t *size,
-                          uint8_t *data,
-                          size_t max_size) {
+void h5read_watch_free(h5read_watch *watch) {
+    close(watch->fd);
+    free(watch);
+}
+
+/// Milliseconds on the monotonic clock
+static double _monotonic_ms() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000.0 + now.tv_nsec / 1e6;
+}
+
+int h5read_wait_for_image(h5read_handle *obj, size_t index, int timeout_ms) {
     if (obj->data_files == 0) {
-        fprintf(stderr, "Error: Cannot do direct chunk read with sample data\n", index);
-        exit(1);
+        // Sample data is always available
+        return index < obj->frames;
     }
-#ifdef HAVE_HDF5
     int data_file = _find_data_file_for_image(obj, index);
     if (data_file == obj->data_file_count) {
-        fprintf(stderr, "Error: Could not find data file for frame %ld\n", index);
-        exit(1);
+        return 0;
+    }
+    // Fast path: Don't set up a watch if the image is already here
+    size_t size = 0;
+    if (h5read_try_get_chunk_size(obj, index, &size) == H5READ_OK) {
+        return 1;
+    }
+
+    // Watch the data file folder before checking again, so that we can't
+    // miss a write between checking and waiting
+    char *folder = strdup(obj->data_files[data_file].filename);
+    h5read_watch *watch = h5read_watch_open(dirname(folder));
+    free(folder);
+
+    double deadline = _monotonic_ms() + timeout_ms;
+    int available = 0;
+    while (!(available = h5read_try_get_chunk_size(obj, index, &size) == H5READ_OK)) {
+        int remaining = deadline - _monotonic_ms();
+        if (remaining <= 0) break;
+        if (watch) {
+            h5read_watch_wait(watch, remaining);
+        } else {
+            // Not able to watch, so fall back to polling
+            usleep(1000 * (remaining < 10 ? remaining : 10));
+        }
+    }
+    if (watch) h5read_watch_free(watch);
+    return available;
+}
+
+h5read_status h5read_try_get_raw_chunk(h5read_handle *obj,
+                                       size_t index,
+                                       size_t *size,
+                                       uint8_t *data,
+                                       size_t max_size) {
+    *size = 0;
+    if (obj->data_files == 0) {
+        return H5READ_ERROR_SAMPLE_DATA;
+    }
+#ifdef HAVE_HDF5
+    h5_data_file *current = NULL;
+    h5read_status status = _get_data_file_for_image(obj, index, &current);
+    if (status != H5READ_OK) {
+        return status;
     }
-    h5_data_file *current = &(obj->data_files[data_file]);
 
     hsize_t offset[3] = {index - current->offset, 0, 0};
-    hsize_t chunk_size = 0;
-    H5Dget_chunk_storage_size(current->dataset, offset, &chunk_size);
+    hsize_t chunk_size = _get_chunk_storage_size(current, offset);
     *size = chunk_size;
-
+    if (chunk_size == 0) {
+        return H5READ_ERROR_NOT_AVAILABLE;
+    }
+    // Report the size needed, so the caller can grow their buffer and retry
     if (chunk_size > max_size) {
-        fprintf(stderr, "Error: Not enough room to store compressed chunk\n");
-        exit(1);
+        return H5READ_ERROR_BUFFER_TOO_SMALL;
     }
 
     hid_t datatype = H5Dget_type(current->dataset);
     hsize_t datasize = H5Tget_size(datatype);
+    H5Tclose(datatype);
     if (datasize != 2) {
-        fprintf(stderr, "Error: Unexpected datasize\n");
-        exit(1);
+        return H5READ_ERROR_DATA_TYPE;
     }
 
     uint32_t filter = 0;
-    herr_t err = H5Dread_chunk(current->dataset, H5P_DEFAULT, offset, &filter, data);
-    if (err < 0) {
-        fprintf(stderr, "Error: Failed to read chunk\n");
-        exit(1);
+    if (H5Dread_chunk(current->dataset, H5P_DEFAULT, offset, &filter, data) < 0) {
+        return H5READ_ERROR_READ;
     }
+    return H5READ_OK;
+#else
+    return H5READ_ERROR_READ;
 #endif
 }
 
-void h5read_get_image_into(h5read_handle *obj, size_t index, image_t_type *data) {
+void h5read_get_raw_chunk(h5read_handle *obj,
+                          size_t index,
+                          size_t *size,
+                          uint8_t *data,
+                          size_t max_size) {
+    _exit_on_error(h5read_try_get_raw_chunk(obj, index, size, data, max_size), index);
+}
+
+/// Round a size up to the next multiple of the direct read alignment
+static size_t _direct_align_up(size_t size) {
+    const size_t align = H5READ_DIRECT_ALIGNMENT;
+    return (size + align - 1) & ~(align - 1);
+}
+
+void *h5read_direct_alloc(size_t size) {
+    void *buffer = NULL;
+    if (posix_memalign(&buffer, H5READ_DIRECT_ALIGNMENT, _direct_align_up(size))) {
+        return NULL;
+    }
+    return buffer;
+}
+
+// Huge page and NUMA placement. The NUMA calls are made directly, so that
+// there is no dependency on libnuma; without NUMA they just fail harmlessly.
+
+#define MPOL_PREFERRED 1
+
+/// Whether to use huge pages: -1 if not yet decided from the environment
+static int _use_huge_pages = -1;
+
+void h5read_set_huge_pages(int enable) {
+    _use_huge_pages = enable ? 1 : 0;
+}
+
+static bool _huge_pages_enabled(void) {
+    if (_use_huge_pages < 0) {
+        const char *env = getenv("H5READ_HUGE_PAGES");
+        _use_huge_pages = !(env && strcmp(env, "0") == 0);
+    }
+    return _use_huge_pages;
+}
+
+int h5read_current_numa_node(void) {
+    unsigned int cpu = 0, node = 0;
+    if (syscall(SYS_getcpu, &cpu, &node, NULL) != 0) {
+        return -1;
+    }
+    return node;
+}
+
+int h5read_pin_thread(int index) {
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+        return -1;
+    }
+    int count = CPU_COUNT(&allowed);
+    if (count == 0) return -1;
+    // Find the index'th allowed CPU
+    int target = index % count;
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+        if (CPU_ISSET(cpu, &allowed) && target-- == 0) {
+            cpu_set_t pinned;
+            CPU_ZERO(&pinned);
+            CPU_SET(cpu, &pinned);
+            return pthread_setaffinity_np(pthread_self(), sizeof(pinned), &pinned);
+        }
+    }
+    return -1;
+}
+
+/// Size of the mapping actually made for a h5read_huge_alloc buffer
+static size_t _huge_mapping_size(size_t size) {
+    const size_t align = H5READ_HUGE_PAGE_SIZE;
+    return (size + align - 1) & ~(align - 1);
+}
+
+void *h5read_huge_alloc(size_t size, int numa_node) {
+    size = _huge_mapping_size(size);
+    bool huge = _huge_pages_enabled();
+    uint8_t *data = MAP_FAILED;
+    if (huge) {
+        // Reserved huge pages are the best, but usually there are none
+        data = mmap(NULL,
+                    size,
+                    PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB,
+                    -1,
+                    0);
+    }
+    if (data == MAP_FAILED) {
+        // Otherwise, map normally. Transparent huge pages need an aligned
+        // region, so map extra and trim it down.
+        uint8_t *region = mmap(NULL,
+                               size + H5READ_HUGE_PAGE_SIZE,
+                               PROT_READ | PROT_WRITE,
+                               MAP_PRIVATE | MAP_ANONYMOUS,
+                               -1,
+                               0);
+        if (region == MAP_FAILED) {
+            return NULL;
+        }
+        data = (uint8_t *)(((uintptr_t)region + H5READ_HUGE_PAGE_SIZE - 1)
+                           & ~(uintptr_t)(H5READ_HUGE_PAGE_SIZE - 1));
+        if (data > region) munmap(region, data - region);
+        size_t tail = (region + size + H5READ_HUGE_PAGE_SIZE) - (data + size);
+        if (tail > 0) munmap(data + size, tail);
+        madvise(data, size, huge ? MADV_HUGEPAGE : MADV_NOHUGEPAGE);
+    }
+
+    // Place the memory before anything is faulted in
+    if (numa_node == H5READ_NUMA_LOCAL) {
+        numa_node = h5read_current_numa_node();
+    }
+    if (numa_node >= 0 && numa_node < 8 * (int)sizeof(unsigned long)) {
+        unsigned long nodes = 1ul << numa_node;
+        syscall(SYS_mbind, data, size, MPOL_PREFERRED, &nodes, 8 * sizeof(nodes), 0);
+    }
+
+    // Fault everything in now, instead of while it is first being used
+    for (size_t i = 0; i < size; i += 4096) {
+        data[i] = 0;
+    }
+    return data;
+}
+
+void h5read_huge_free(void *buffer, size_t size) {
+    if (buffer) {
+        munmap(buffer, _huge_mapping_size(size));
+    }
+}
+
+uint8_t *h5read_direct_pread(int fd,
+                             size_t offset,
+                             size_t size,
+                             uint8_t *buffer,
+                             size_t buffer_size) {
+    // O_DIRECT needs the file offset, length and memory all aligned
+    size_t start = offset & ~(size_t)(H5READ_DIRECT_ALIGNMENT - 1);
+    size_t end = _direct_align_up(offset + size);
+    if ((uintptr_t)buffer % H5READ_DIRECT_ALIGNMENT != 0
+        || end - start > buffer_size) {
+        return NULL;
+    }
+    size_t total = 0;
+    while (total < end - start) {
+        ssize_t count = pread(fd, buffer + total, end - start - total, start + total);
+        if (count < 0) {
+            if (errno == EINTR) continue;
+            return NULL;
+        }
+        total += count;
+        // A short, unaligned read means we hit the end of the file
+        if (count == 0 || (start + total) % H5READ_DIRECT_ALIGNMENT != 0) break;
+    }
+    if (total < offset - start + size) {
+        return NULL;
+    }
+    return buffer + (offset - start);
+}
+
+uint8_t *h5read_direct_read_file(const char *filename,
+                                 size_t *size,
+                                 uint8_t *buffer,
+                                 size_t buffer_size) {
+    int fd = open(filename, O_RDONLY | O_DIRECT);
+    if (fd < 0) {
+        return NULL;
+    }
+    struct stat info;
+    uint8_t *data = NULL;
+    if (fstat(fd, &info) == 0) {
+        *size = info.st_size;
+        data = h5read_direct_pread(fd, 0, info.st_size, buffer, buffer_size);
+    }
+    close(fd);
+    return data;
+}
+
+uint8_t *h5read_get_raw_chunk_direct(h5read_handle *obj,
+                                     size_t index,
+                                     size_t *size,
+                                     uint8_t *data,
+                                     size_t max_size) {
+    *size = 0;
+    if (obj->data_files == 0) {
+        return NULL;
+    }
+#if defined(HAVE_HDF5) && H5_VERSION_GE(1, 10, 5)
+    h5_data_file *current = NULL;
+    if (_get_data_file_for_image(obj, index, &current) != H5READ_OK) {
+        return NULL;
+    }
+
+    if (current->direct_fd < 0) {
+        // Chunk addresses are relative to the end of any userblock
+        hid_t plist = H5Fget_create_plist(current->file);
+        hsize_t userblock = 0;
+        H5Pget_userblock(plist, &userblock);
+        H5Pclose(plist);
+        current->base_address = userblock;
+        // This can fail if the filesystem doesn't support O_DIRECT
+        current->direct_fd = open(current->filename, O_RDONLY | O_DIRECT);
+        if (current->direct_fd < 0) {
+            return NULL;
+        }
+    }
+
+    hsize_t offset[3] = {index - current->offset, 0, 0};
+    unsigned filter_mask = 0;
+    haddr_t address = HADDR_UNDEF;
+    hsize_t chunk_size = 0;
+    if (H5Dget_chunk_info_by_coord(
+          current->dataset, offset, &filter_mask, &address, &chunk_size)
+          < 0
+        || address == HADDR_UNDEF) {
+        return NULL;
+    }
+    *size = chunk_size;
+    return h5read_direct_pread(current->direct_fd,
+                               current->base_address + address,
+                               chunk_size,
+                               data,
+                               max_size);
+#else
+    return NULL;
+#endif
+}
+
+h5read_status h5read_try_get_image_into(h5read_handle *obj,
+                                        size_t index,
+                                        image_t_type *data) {
     if (index >= obj->frames) {
-        fprintf(stderr,
-                "Error: image %ld greater than number of frames (%ld)\n",
-                index,
-                obj->frames);
-        exit(1);
+        return H5READ_ERROR_OUT_OF_RANGE;
+    }
+    if (obj->synthetic) {
+        _synthetic_generate(
+          obj->synthetic, obj->mask, obj->slow, obj->fast, index, data);
+        return H5READ_OK;
     }
     // Check if we are using sample data
     if (obj->data_files == 0) {
         // We are using autogenerated image data. Return that.
         _generate_sample_image(obj, index, data);
-        return;
+        return H5READ_OK;
     }
 
 #ifdef HAVE_HDF5
     /* first find the right data file - having to do this lookup is annoying
        but probably cheap */
-    int data_file = _find_data_file_for_image(obj, index);
-
-    if (data_file == obj->data_file_count) {
-        fprintf(stderr, "Error: Could not find data file for frame %ld\n", index);
-        exit(1);
+    h5_data_file *current = NULL;
+    h5read_status status = _get_data_file_for_image(obj, index, &current);
+    if (status != H5READ_OK) {
+        return status;
     }
 
-    h5_data_file *current = &(obj->data_files[data_file]);
-
     hid_t space = H5Dget_space(current->dataset);
     hid_t datatype = H5Dget_type(current->dataset);
 
@@ -351,30 +1333,102 @@ void h5read_get_image_into(h5read_handle *obj, size_t index, image_t_type *data)
     hid_t mem_space = H5Screate_simple(3, block, NULL);
 
     if (H5Dread(current->dataset, datatype, mem_space, space, H5P_DEFAULT, data) < 0) {
-        H5Eprint(H5E_DEFAULT, NULL);
-        exit(1);
+        status = H5READ_ERROR_READ;
     }
 
+    H5Tclose(datatype);
     H5Sclose(space);
     H5Sclose(mem_space);
+    return status;
+#else
+    return H5READ_ERROR_READ;
 #endif
 }
 
-image_t *h5read_get_image(h5read_handle *obj, size_t n) {
-    // Make an image_t to write into
-    image_t *result = malloc(sizeof(image_t));
+void h5read_get_image_into(h5read_handle *obj, size_t index, image_t_type *data) {
+    _exit_on_image_error(obj, h5read_try_get_image_into(obj, index, data), index);
+}
+
+h5read_status h5read_try_get_image(h5read_handle *obj, size_t n, image_t **image) {
+    // Make an image_t to write into. The buffer comes from the handle's
+    // pool, and goes back to it in h5read_free_image
+    pooled_buffer *buffer = _pool_acquire(obj->image_pool);
+    image_t *result = &buffer->header.image;
     result->mask = obj->mask;
     result->fast = obj->fast;
     result->slow = obj->slow;
-    // Create the buffer here. This will be freed by h5read_free_image
-    result->data = malloc(sizeof(image_t_type) * obj->slow * obj->fast);
+    result->data = buffer->data;
     // Use our read-into-buffer function to fill this
-    h5read_get_image_into(obj, n, result->data);
+    h5read_status status = h5read_try_get_image_into(obj, n, result->data);
+    if (status != H5READ_OK) {
+        h5read_free_image(result);
+        result = NULL;
+    }
+    *image = result;
+    return status;
+}
 
-    return result;
+image_t *h5read_get_image(h5read_handle *obj, size_t n) {
+    image_t *image = NULL;
+    _exit_on_image_error(obj, h5read_try_get_image(obj, n, &image), n);
+    return image;
 }
 
 #ifdef HAVE_HDF5
+// Pixels converted per inner loop. Fixed-size inner loops get vectorised
+// even at -O2, and the per-block count can't overflow a uint8_t.
+#define MASK_BLOCK 64
+
+/// Convert a raw 32-bit NXmx pixel_mask to a validity mask.
+///
+/// This is written without branches, so that it vectorises; the mask is
+/// converted on every open, before the first image can be read.
+///
+/// @returns The number of valid pixels
+static size_t _convert_mask_32(const uint32_t *restrict raw,
+                               uint8_t *restrict mask,
+                               size_t count) {
+    size_t valid = 0, j = 0;
+    for (; j + MASK_BLOCK <= count; j += MASK_BLOCK) {
+        uint8_t block_valid = 0;
+        for (int k = 0; k < MASK_BLOCK; k++) {
+            uint8_t is_valid = raw[j + k] == 0;
+            mask[j + k] = is_valid;
+            block_valid += is_valid;
+        }
+        valid += block_valid;
+    }
+    for (; j < count; j++) {
+        mask[j] = raw[j] == 0;
+        valid += mask[j];
+    }
+    return valid;
+}
+
+/// Convert a raw 64-bit NXmx pixel_mask to a validity mask.
+///
+/// The mask is handled as pairs of 32-bit words, because baseline x86-64
+/// has no vector 64-bit compare.
+static size_t _convert_mask_64(const uint32_t *restrict raw,
+                               uint8_t *restrict mask,
+                               size_t count) {
+    size_t valid = 0, j = 0;
+    for (; j + MASK_BLOCK <= count; j += MASK_BLOCK) {
+        uint8_t block_valid = 0;
+        for (int k = 0; k < MASK_BLOCK; k++) {
+            uint8_t is_valid = (raw[2 * (j + k)] | raw[2 * (j + k) + 1]) == 0;
+            mask[j + k] = is_valid;
+            block_valid += is_valid;
+        }
+        valid += block_valid;
+    }
+    for (; j < count; j++) {
+        mask[j] = (raw[2 * j] | raw[2 * j + 1]) == 0;
+        valid += mask[j];
+    }
+    return valid;
+}
+
 void read_mask(h5read_handle *obj) {
     char mask_path[] = "/entry/instrument/detector/pixel_mask";
 
@@ -406,47 +1460,21 @@ void read_mask(h5read_handle *obj) {
 
     printf("Mask has %ld elements\n", obj->mask_size);
 
-    void *buffer = NULL;
-
-    uint32_t *raw_mask = NULL;
-    uint64_t *raw_mask_64 = NULL;  // why?
-    if (mask_dsize == 4) {
-        raw_mask = (uint32_t *)malloc(sizeof(uint32_t) * obj->mask_size);
-        buffer = (void *)raw_mask;
-    } else {
-        raw_mask_64 = (uint64_t *)malloc(sizeof(uint64_t) * obj->mask_size);
-        buffer = (void *)raw_mask_64;
-    }
+    // Either one or two 32-bit words per pixel
+    uint32_t *raw_mask = (uint32_t *)malloc(mask_dsize * obj->mask_size);
 
-    if (H5Dread(mask_dataset, datatype, H5S_ALL, H5S_ALL, H5P_DEFAULT, buffer) < 0) {
+    if (H5Dread(mask_dataset, datatype, H5S_ALL, H5S_ALL, H5P_DEFAULT, raw_mask) < 0) {
         fprintf(stderr, "Error: While reading mask\n");
         exit(1);
     }
 
-    // count 0's
-
-    size_t zero = 0;
-
     obj->mask = (uint8_t *)malloc(sizeof(uint8_t) * obj->mask_size);
 
+    size_t zero = 0;
     if (mask_dsize == 4) {
-        for (size_t j = 0; j < obj->mask_size; j++) {
-            if (raw_mask[j] == 0) {
-                zero++;
-                obj->mask[j] = 1;
-            } else {
-                obj->mask[j] = 0;
-            }
-        }
+        zero = _convert_mask_32(raw_mask, obj->mask, obj->mask_size);
     } else {
-        for (size_t j = 0; j < obj->mask_size; j++) {
-            if (raw_mask_64[j] == 0) {
-                zero++;
-                obj->mask[j] = 1;
-            } else {
-                obj->mask[j] = 0;
-            }
-        }
+        zero = _convert_mask_64(raw_mask, obj->mask, obj->mask_size);
     }
 
     // blit mask over to module mask
@@ -484,11 +1512,18 @@ void read_mask(h5read_handle *obj) {
 
     // cleanup
 
-    if (raw_mask) free(raw_mask);
-    if (raw_mask_64) free(raw_mask_64);
+    free(raw_mask);
     H5Dclose(mask_dataset);
 }
 
+/// Join a folder and filename into a newly allocated path
+static char *_join_path(const char *root, const char *name) {
+    size_t size = strlen(root) + 1 + strlen(name) + 1;
+    char *path = malloc(size);
+    snprintf(path, size, "%s/%s", root, name);
+    return path;
+}
+
 /// Get number of VDS and read info about all the sub-files.
 ///
 /// @param master           HDF5 File object pointing to the master file
@@ -526,8 +1561,13 @@ int vds_info(char *root, hid_t master, hid_t dataset, h5_data_file **data_files_
         H5Sget_regular_hyperslab(vds_source, start, stride, count, block);
         H5Sclose(vds_source);
 
-        H5Pget_virtual_filename(plist, j, vds[j].filename, MAXFILENAME);
-        H5Pget_virtual_dsetname(plist, j, vds[j].dsetname, MAXFILENAME);
+        // Ask for the name lengths first, so that names are never truncated
+        size_t filename_size = H5Pget_virtual_filename(plist, j, NULL, 0) + 1;
+        vds[j].filename = malloc(filename_size);
+        H5Pget_virtual_filename(plist, j, vds[j].filename, filename_size);
+        size_t dsetname_size = H5Pget_virtual_dsetname(plist, j, NULL, 0) + 1;
+        vds[j].dsetname = malloc(dsetname_size);
+        H5Pget_virtual_dsetname(plist, j, vds[j].dsetname, dsetname_size);
 
         for (int k = 1; k < dims; k++) {
             if (start[k] != 0) {
@@ -551,11 +1591,12 @@ int vds_info(char *root, hid_t master, hid_t dataset, h5_data_file **data_files_
             /* if the data file points to an external source, dereference */
 
             if (info.type == H5L_TYPE_EXTERNAL) {
-                char buffer[MAXFILENAME], scr[MAXFILENAME];
+                char *buffer = malloc(info.u.val_size);
                 unsigned flags;
                 const char *nameptr, *dsetptr;
 
-                H5Lget_val(master, vds[j].dsetname, buffer, MAXFILENAME, H5P_DEFAULT);
+                H5Lget_val(
+                  master, vds[j].dsetname, buffer, info.u.val_size, H5P_DEFAULT);
                 H5Lunpack_elink_val(
                   buffer, info.u.val_size, &flags, &nameptr, &dsetptr);
 
@@ -566,23 +1607,24 @@ int vds_info(char *root, hid_t master, hid_t dataset, h5_data_file **data_files_
                    so manually assemble...
                  */
 
-                strcpy(scr, root);
-                scr[strlen(root)] = '/';
-                strcpy(scr + strlen(root) + 1, nameptr);
-
-                strcpy(vds[j].filename, scr);
-                strcpy(vds[j].dsetname, dsetptr);
+                free(vds[j].filename);
+                free(vds[j].dsetname);
+                vds[j].filename = _join_path(root, nameptr);
+                vds[j].dsetname = strdup(dsetptr);
+                free(buffer);
             }
         } else {
-            char scr[MAXFILENAME];
-            assert(snprintf(scr, MAXFILENAME, "%s/%s", root, vds[j].filename)
-                   < MAXFILENAME);
-            strcpy(vds[j].filename, scr);
+            char *filename = _join_path(root, vds[j].filename);
+            free(vds[j].filename);
+            vds[j].filename = filename;
         }
 
         // do I want to open these here? Or when they are needed...
         vds[j].file = 0;
         vds[j].dataset = 0;
+        vds[j].direct_fd = -1;
+        vds[j].lru_prev = -1;
+        vds[j].lru_next = -1;
     }
 
     status = H5Pclose(plist);
@@ -614,22 +1656,43 @@ int unpack_vds(const char *filename, h5_data_file **data_files) {
     }
 
     /* always set the absolute path to file information */
-    char rootpath[MAXFILENAME];
-    strncpy(rootpath, filename, MAXFILENAME);
+    char *rootpath = strdup(filename);
     char *root = dirname(rootpath);
-    char cwd[MAXFILENAME];
+    char *cwd = NULL;
     if ((strlen(root) == 1) && (root[0] == '.')) {
-        root = getcwd(cwd, MAXFILENAME);
+        root = cwd = getcwd(NULL, 0);
     }
 
     int vds_count = vds_info(root, file, dataset, data_files);
 
+    free(cwd);
+    free(rootpath);
+
     H5Dclose(dataset);
     H5Fclose(file);
 
     return vds_count;
 }
 
+static int _compare_data_file_offsets(const void *a, const void *b) {
+    size_t offset_a = ((const h5_data_file *)a)->offset;
+    size_t offset_b = ((const h5_data_file *)b)->offset;
+    return (offset_a > offset_b) - (offset_a < offset_b);
+}
+
+/// Keep up to a quarter of our file descriptor limit open as data files.
+/// Each open file can use two descriptors, if reading with O_DIRECT.
+static int _default_max_open_files() {
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) != 0 || limit.rlim_cur == RLIM_INFINITY) {
+        return H5READ_DEFAULT_MAX_OPEN_FILES;
+    }
+    rlim_t files = limit.rlim_cur / 4;
+    if (files < 4) return 4;
+    if (files > H5READ_DEFAULT_MAX_OPEN_FILES) return H5READ_DEFAULT_MAX_OPEN_FILES;
+    return files;
+}
+
 void setup_data(h5read_handle *obj) {
     hid_t dataset = obj->data_files[0].dataset;
     hid_t datatype = H5Dget_type(dataset);
@@ -678,68 +1741,83 @@ h5read_handle *h5read_open(const char *master_filename) {
         return NULL;
     }
 
-    // open up the actual data files, count all the frames
+    // Sort the data files so that they can be searched by frame
+    qsort(file->data_files,
+          file->data_file_count,
+          sizeof(h5_data_file),
+          _compare_data_file_offsets);
+
+    // Count all the frames, and check if every file has the same number
     file->frames = 0;
-    h5_data_file *data_files = file->data_files;
+    file->uniform_frames = file->data_file_count ? file->data_files[0].frames : 0;
     for (int j = 0; j < file->data_file_count; j++) {
-        data_files[j].file = H5Fopen(
-          data_files[j].filename, H5F_ACC_RDONLY | H5F_ACC_SWMR_READ, H5P_DEFAULT);
-        if (data_files[j].file < 0) {
-            fprintf(stderr, "Error: Opening child file %s\n", data_files[j].filename);
-            H5Fclose(master_file);
-            free(file);
-            return NULL;
-        }
-        data_files[j].dataset =
-          H5Dopen(data_files[j].file, data_files[j].dsetname, H5P_DEFAULT);
-        if (data_files[j].dataset < 0) {
-            fprintf(stderr,
-                    "Error: Reading datasets of child file %s\n",
-                    data_files[j].filename);
-            H5Fclose(data_files[j].file);
-            H5Fclose(master_file);
-            free(file);
-            return NULL;
+        h5_data_file *data_file = &file->data_files[j];
+        file->frames += data_file->frames;
+        // The last file is allowed to be short
+        if (data_file->offset != j * file->uniform_frames
+            || (data_file->frames != file->uniform_frames
+                && j != file->data_file_count - 1)) {
+            file->uniform_frames = 0;
         }
-        file->frames += data_files[j].frames;
+    }
+
+    file->lru_head = file->lru_tail = -1;
+    file->max_open_files = _default_max_open_files();
+
+    // The data files are opened when first used, apart from the first,
+    // which we need to read the image shape from.
+    if (file->data_file_count == 0 || _open_data_file(file, 0) != H5READ_OK) {
+        fprintf(stderr,
+                "Error: Opening child file %s\n",
+                file->data_file_count ? file->data_files[0].filename : "(none)");
+        h5read_free(file);
+        return NULL;
     }
 
     read_mask(file);
 
     setup_data(file);
+    _create_pools(file);
 
     return file;
 }
 #endif
 
-// Generate a mask with just module bounds masked off
-uint8_t *_generate_e2xe_16m_mask() {
-    assert(E2XE_MOD_SLOW * E2XE_16M_NSLOW + E2XE_GAP_SLOW * (E2XE_16M_NSLOW - 1)
-           == E2XE_16M_SLOW);
-    assert(E2XE_MOD_FAST * E2XE_16M_NFAST + E2XE_GAP_FAST * (E2XE_16M_NFAST - 1)
-           == E2XE_16M_FAST);
-    uint8_t *mask = calloc(E2XE_16M_SLOW * E2XE_16M_SLOW, sizeof(uint8_t));
-    for (size_t i = 0; i < E2XE_16M_SLOW * E2XE_16M_SLOW; ++i) {
+// Generate a mask with just module bounds masked off, for a detector of
+// nslow x nfast modules
+uint8_t *_generate_e2xe_mask(size_t nslow, size_t nfast) {
+    size_t slow = E2XE_MOD_SLOW * nslow + E2XE_GAP_SLOW * (nslow - 1);
+    size_t fast = E2XE_MOD_FAST * nfast + E2XE_GAP_FAST * (nfast - 1);
+    uint8_t *mask = calloc(slow * fast, sizeof(uint8_t));
+    for (size_t i = 0; i < slow * fast; ++i) {
         mask[i] = 1;
     }
     // Horizontal gaps
-    for (int gap = 1; gap < E2XE_16M_NSLOW; ++gap) {
+    for (int gap = 1; gap < nslow; ++gap) {
         // First gap has 1 module 0 gap, second gap has 2 modules 1 gap etc
         size_t y = gap * E2XE_MOD_SLOW + (gap - 1) * E2XE_GAP_SLOW;
         // Horizontal gaps can just be bulk memset for each gap
-        memset(mask + y * E2XE_16M_FAST, 0, E2XE_GAP_SLOW * E2XE_16M_FAST);
+        memset(mask + y * fast, 0, E2XE_GAP_SLOW * fast);
     }
     // Vertical gaps
-    for (int gap = 1; gap < E2XE_16M_NFAST; ++gap) {
+    for (int gap = 1; gap < nfast; ++gap) {
         // First gap has 1 module 0 gap, second gap has 2 modules 1 gap etc
         size_t x = gap * E2XE_MOD_FAST + (gap - 1) * E2XE_GAP_FAST;
-        for (int y = 0; y < E2XE_16M_SLOW; ++y) {
-            memset(mask + y * E2XE_16M_FAST + x, 0, E2XE_GAP_FAST);
+        for (int y = 0; y < slow; ++y) {
+            memset(mask + y * fast + x, 0, E2XE_GAP_FAST);
         }
     }
     return mask;
 }
 
+uint8_t *_generate_e2xe_16m_mask() {
+    assert(E2XE_MOD_SLOW * E2XE_16M_NSLOW + E2XE_GAP_SLOW * (E2XE_16M_NSLOW - 1)
+           == E2XE_16M_SLOW);
+    assert(E2XE_MOD_FAST * E2XE_16M_NFAST + E2XE_GAP_FAST * (E2XE_16M_NFAST - 1)
+           == E2XE_16M_FAST);
+    return _generate_e2xe_mask(E2XE_16M_NSLOW, E2XE_16M_NFAST);
+}
+
 h5read_handle *h5read_generate_samples() {
     h5read_handle *file = calloc(1, sizeof(h5read_handle));
 
@@ -762,6 +1840,30 @@ h5read_handle *h5read_generate_samples() {
     // fclose(fo);
 
     file->frames = NUM_SAMPLE_IMAGES;
+    _create_pools(file);
+    return file;
+}
+
+h5read_handle *h5read_generate_synthetic(const h5read_synthetic_params *params) {
+    h5read_handle *file = calloc(1, sizeof(h5read_handle));
+
+    size_t nslow = E2XE_4M_NSLOW, nfast = E2XE_4M_NFAST;
+    file->slow = E2XE_4M_SLOW;
+    file->fast = E2XE_4M_FAST;
+    if (params->detector == H5READ_EIGER2XE_16M) {
+        nslow = E2XE_16M_NSLOW;
+        nfast = E2XE_16M_NFAST;
+        file->slow = E2XE_16M_SLOW;
+        file->fast = E2XE_16M_FAST;
+    }
+    file->mask = _generate_e2xe_mask(nslow, nfast);
+    size_t module_pixels = nslow * nfast * E2XE_MOD_FAST * E2XE_MOD_SLOW;
+    file->module_mask = malloc(module_pixels);
+    memset(file->module_mask, 1, module_pixels);
+
+    file->frames = params->frames;
+    file->synthetic = _synthetic_create(params, file->mask, file->slow, file->fast);
+    _create_pools(file);
     return file;
 }
 
@@ -772,8 +1874,10 @@ h5read_handle *h5read_parse_standard_args(int argc, char **argv) {
     implicit_sample = true;
 #endif
     const char *USAGE = implicit_sample
-                          ? "Usage: %s [-h|--help] [-v] [FILE.nxs | --sample]\n"
-                          : "Usage: %s [-h|--help] [-v] (FILE.nxs | --sample)\n";
+                          ? "Usage: %s [-h|--help] [-v] [FILE.nxs | --sample | "
+                            "--synthetic]\n"
+                          : "Usage: %s [-h|--help] [-v] (FILE.nxs | --sample | "
+                            "--synthetic)\n";
     const char *HELP =
       "Options:\n\
   FILE.nxs      Path to the Nexus file to parse\n\
@@ -781,10 +1885,12 @@ h5read_handle *h5read_parse_standard_args(int argc, char **argv) {
   -v            Verbose HDF5 message output\n\
   --sample      Don't load a data file, instead use generated test data.\n\
                 If H5READ_IMPLICIT_SAMPLE is set, then this is assumed,\n\
-                if a file is not provided.";
+                if a file is not provided.\n\
+  --synthetic   Use 1000 frames of generated, realistic 16M data.";
 
     bool verbose = false;
     bool sample_data = false;
+    bool synthetic_data = false;
 
     // Handle simple case of -h or --help
     for (int i = 1; i < argc; ++i) {
@@ -795,20 +1901,21 @@ h5read_handle *h5read_parse_standard_args(int argc, char **argv) {
         }
         if (!strcmp(argv[i], "-v")) {
             verbose = true;
-            // Shift the rest over this one so that we only have positionals
-            for (int j = i; j < argc; j++) {
-                argv[i] = argv[j];
-            }
-            argc -= 1;
-        }
-        if (!strcmp(argv[i], "--sample")) {
+        } else if (!strcmp(argv[i], "--sample")) {
             sample_data = true;
-            // Shift the rest over this one so that we only have positionals
-            for (int j = i; j < argc; j++) {
-                argv[i] = argv[j];
-            }
-            argc -= 1;
+        } else if (!strcmp(argv[i], "--synthetic")) {
+            sample_data = true;
+            synthetic_data = true;
+        } else {
+            continue;
+        }
+        // Shift the rest over this one so that we only have positionals,
+        // and look at the argument that is now in its place
+        for (int j = i; j < argc - 1; j++) {
+            argv[j] = argv[j + 1];
         }
+        argc -= 1;
+        --i;
     }
 #ifdef HAVE_HDF5
     if (!verbose) {
@@ -841,7 +1948,12 @@ h5read_handle *h5read_parse_standard_args(int argc, char **argv) {
     }
 
     h5read_handle *handle = 0;
-    if (sample_data) {
+    if (synthetic_data) {
+        fprintf(stderr, "Using SYNTHETIC dataset\n");
+        h5read_synthetic_params params;
+        h5read_synthetic_default_params(&params);
+        handle = h5read_generate_synthetic(&params);
+    } else if (sample_data) {
         fprintf(stderr, "Using SAMPLE dataset\n");
         handle = h5read_generate_samples();
     } else {
@@ -15,6 +15,11 @@ H5Read::H5Read() {
     _handle = std::shared_ptr<h5read_handle>(h5read_generate_samples(), h5read_freeer);
 }
 
+H5Read::H5Read(const h5read_synthetic_params &params) {
+    _handle =
+      std::shared_ptr<h5read_handle>(h5read_generate_synthetic(&params), h5read_freeer);
+}
+
 H5Read::H5Read(const std::string &filename) {
 #ifdef HAVE_HDF5
     auto obj = h5read_open(filename.c_str());
@@ -32,22 +37,27 @@ H5Read::H5Read(int argc, char **argv) noexcept {
 }
 
 Image::Image(std::shared_ptr<h5read_handle> handle, size_t i) noexcept
+    : Image(handle, h5read_get_image(handle.get(), i)) {}
+
+Image::Image(std::shared_ptr<h5read_handle> handle, image_t *image) noexcept
     : _handle(handle),
-      _image{std::shared_ptr<image_t>(h5read_get_image(_handle.get(), i),
-                                      h5read_image_freeer)},
+      _image{std::shared_ptr<image_t>(image, h5read_image_freeer)},
       data{_image->data, _image->slow * _image->fast},
       mask{_image->mask, _image->slow * _image->fast},
       slow{_image->slow},
       fast{_image->fast} {
-    // Currently h5read_get_image guarantees that it will never return invalid
+    // h5read_get_image exits rather than return an invalid image, and
+    // h5read_try_get_image only gives us the images it read
     assert(_image);
 }
 
 ImageModules::ImageModules(std::shared_ptr<h5read_handle> handle, size_t i) noexcept
+    : ImageModules(handle, h5read_get_image_modules(handle.get(), i)) {}
+
+ImageModules::ImageModules(std::shared_ptr<h5read_handle> handle,
+                           image_modules_t *modules) noexcept
     : _handle{handle},
-      _modules{
-        std::shared_ptr<image_modules_t>(h5read_get_image_modules(_handle.get(), i),
-                                         h5read_image_modules_freeer)},
+      _modules{std::shared_ptr<image_modules_t>(modules, h5read_image_modules_freeer)},
       _modules_data{_modules->modules},
       _modules_masks{_modules->modules},
       data{_modules->data, _modules->slow * _modules->fast * _modules->modules},
@@ -22,8 +22,8 @@ int main(int argc, char **argv) {
     image_t_type *buffer_manual = malloc(
       h5read_get_image_fast(obj) * h5read_get_image_slow(obj) * sizeof(image_t_type));
 
-    size_t max_compressed_bytes =
-      h5read_get_image_fast(obj) * h5read_get_image_slow(obj) * sizeof(image_t_type);
+    // Start small, and grow the buffer if we find a chunk that doesn't fit
+    size_t max_compressed_bytes = 1024 * 1024;
     uint8_t *chunk_data = malloc(max_compressed_bytes);
 
     // printf("               %8s / %s\n", "Image", "Module");
@@ -31,7 +31,21 @@ int main(int argc, char **argv) {
         // image_t *image = h5read_get_image(obj, j);
         // h5read_get_image_into(obj, j, buffer);
         size_t data_size = 0;
-        h5read_get_raw_chunk(obj, j, &data_size, chunk_data, max_compressed_bytes);
+        h5read_status status = h5read_try_get_raw_chunk(
+          obj, j, &data_size, chunk_data, max_compressed_bytes);
+        if (status == H5READ_ERROR_BUFFER_TOO_SMALL) {
+            max_compressed_bytes = data_size;
+            chunk_data = realloc(chunk_data, max_compressed_bytes);
+            status = h5read_try_get_raw_chunk(
+              obj, j, &data_size, chunk_data, max_compressed_bytes);
+        }
+        if (status != H5READ_OK) {
+            fprintf(stderr,
+                    "Error: Reading image %zu: %s\n",
+                    j,
+                    h5read_status_string(status));
+            continue;
+        }
         printf("Read Image %d chunk in %zu KBytes\n", j, data_size / 1024);
 
         bool success = true;
@@ -2,25 +2,46 @@
 
 #include <chrono>
 #include <cstdio>
+#include <cstring>
 #include <vector>
 
 #include "h5read.h"
 
 int main(int argc, char **argv) {
+    // Pull out our own --direct flag before the standard argument parsing
+    bool direct_io = false;
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "--direct")) {
+            direct_io = true;
+            for (int j = i; j < argc - 1; ++j) {
+                argv[j] = argv[j + 1];
+            }
+            argc -= 1;
+            break;
+        }
+    }
     auto reader = H5Read(argc, argv);
+    if (direct_io) {
+        printf("Reading chunks with O_DIRECT\n");
+        reader.set_direct_io(true);
+    }
 
     size_t n_images = reader.get_number_of_images();
     size_t num_pixels = reader.get_image_slow() * reader.get_image_fast();
 
-    auto buffer = std::vector<uint8_t>(num_pixels * 2);
+    // Room for an uncompressed chunk, plus the widening of direct reads
+    size_t buffer_size = num_pixels * 2 + 2 * H5READ_DIRECT_ALIGNMENT;
+    auto buffer = make_direct_buffer(buffer_size);
     auto image = std::vector<H5Read::image_type>(num_pixels);
 
+    size_t total_bytes = 0;
     auto start_time = std::chrono::high_resolution_clock::now();
     for (size_t j = 0; j < n_images; j++) {
-        auto data = reader.get_raw_chunk(j, buffer);
+        auto data = reader.get_raw_chunk(j, {buffer.get(), buffer_size});
+        total_bytes += data.size();
 
         // Decompress this
-        bshuf_decompress_lz4(buffer.data() + 12, image.data(), num_pixels, 2, 0);
+        bshuf_decompress_lz4(data.data() + 12, image.data(), num_pixels, 2, 0);
 
         printf("Read Image %d chunk of %zu KBytes\n", j, data.size() / 1024);
     }
@@ -30,5 +51,8 @@ int main(int argc, char **argv) {
     float total_time =
       std::chrono::duration_cast<std::chrono::duration<double>>(end_time - start_time)
         .count();
-    printf("\nTook %.2f s (%.0f im/s)\n", total_time, n_images / total_time);
+    printf("\nTook %.2f s (%.0f im/s, %.2f GB/s compressed)\n",
+           total_time,
+           n_images / total_time,
+           total_bytes / total_time / 1e9);
 }
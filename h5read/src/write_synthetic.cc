@@ -0,0 +1,432 @@
+/**
+ * Write synthetic data as an Eiger-style Nexus dataset, for testing the
+ * reading paths without a detector.
+ *
+ * Writes PREFIX_master.h5, with a /entry/data/data virtual dataset and a
+ * pixel_mask, and PREFIX_data_NNNNNN.h5 data files of bitshuffle-LZ4
+ * compressed frames, one chunk per frame. Frames are generated and
+ * compressed on worker threads, and written in order. With --swmr, the data
+ * files are written in SWMR mode and flushed after every frame, so that
+ * they can be read while they are being written; with --fps, frames are
+ * written at a fixed rate, as a detector would.
+ */
+#include <bitshuffle.h>
+#include <hdf5.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "h5read.h"
+
+using clock_type = std::chrono::steady_clock;
+
+/// HDF5 filter ID registered for bitshuffle
+constexpr H5Z_filter_t BITSHUFFLE_FILTER = 32008;
+/// Bitshuffle filter compression setting for LZ4
+constexpr unsigned int BITSHUFFLE_LZ4 = 2;
+
+const char *USAGE =
+  "Usage: %s [-h|--help] [--4m|--16m] [-n NUM] [--per-file NUM] [--spots NUM]\n"
+  "       [--seed SEED] [-j THREADS] [--swmr] [--fps RATE] PREFIX\n";
+const char *HELP =
+  "Options:\n\
+  PREFIX          Write PREFIX_master.h5 and PREFIX_data_NNNNNN.h5\n\
+  --4m, --16m     Detector size (default 4M)\n\
+  -n NUM          Number of frames to write (default 100)\n\
+  --per-file NUM  Frames in each data file (default 100)\n\
+  --spots NUM     Mean number of spots on each frame (default 500)\n\
+  --seed SEED     Synthetic data seed (default 1)\n\
+  -j THREADS      Threads to generate and compress frames with\n\
+  --swmr          Write the data files in SWMR mode, flushing every frame\n\
+  --fps RATE      Write frames at this rate (default as fast as possible)";
+
+/// Compress an image into a bitshuffle-LZ4 chunk, as written by the
+/// HDF5 filter: a big-endian header of the uncompressed size in bytes and
+/// block size in bytes, then the compressed blocks.
+static auto compress_chunk(const std::vector<uint16_t> &image) -> std::vector<uint8_t> {
+    const size_t elem_size = sizeof(uint16_t);
+    auto chunk =
+      std::vector<uint8_t>(12 + bshuf_compress_lz4_bound(image.size(), elem_size, 0));
+    uint64_t total_size = image.size() * elem_size;
+    uint32_t block_size = bshuf_default_block_size(elem_size) * elem_size;
+    for (int i = 0; i < 8; ++i) {
+        chunk[i] = (total_size >> (8 * (7 - i))) & 0xFF;
+    }
+    for (int i = 0; i < 4; ++i) {
+        chunk[8 + i] = (block_size >> (8 * (3 - i))) & 0xFF;
+    }
+    int64_t size =
+      bshuf_compress_lz4(image.data(), chunk.data() + 12, image.size(), elem_size, 0);
+    if (size < 0) {
+        fprintf(stderr, "Error: Compressing frame failed (%ld)\n", (long)size);
+        exit(1);
+    }
+    chunk.resize(12 + size);
+    return chunk;
+}
+
+static void write_string_attribute(hid_t location,
+                                   const char *name,
+                                   const char *value) {
+    hid_t type = H5Tcopy(H5T_C_S1);
+    H5Tset_size(type, strlen(value));
+    hid_t space = H5Screate(H5S_SCALAR);
+    hid_t attribute = H5Acreate(location, name, type, space, H5P_DEFAULT, H5P_DEFAULT);
+    H5Awrite(attribute, type, value);
+    H5Aclose(attribute);
+    H5Sclose(space);
+    H5Tclose(type);
+}
+
+/// Create a group, and set its NeXus class
+static void create_group(hid_t file, const char *path, const char *nx_class) {
+    hid_t group = H5Gcreate(file, path, H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT);
+    if (group < 0) {
+        fprintf(stderr, "Error: Could not create group %s\n", path);
+        exit(1);
+    }
+    write_string_attribute(group, "NX_class", nx_class);
+    H5Gclose(group);
+}
+
+/// Name of the n'th (from 0) data file, without any folder
+static auto data_file_name(const std::string &prefix, size_t n) -> std::string {
+    auto slash = prefix.rfind('/');
+    auto base = slash == std::string::npos ? prefix : prefix.substr(slash + 1);
+    char suffix[32];
+    snprintf(suffix, sizeof(suffix), "_data_%06zu.h5", n + 1);
+    return base + suffix;
+}
+
+/// Folder part of the prefix, with a trailing slash, or empty
+static auto prefix_folder(const std::string &prefix) -> std::string {
+    auto slash = prefix.rfind('/');
+    return slash == std::string::npos ? "" : prefix.substr(0, slash + 1);
+}
+
+/// Write the master file: the pixel mask, and a virtual dataset of all the
+/// frames in the data files
+static void write_master(const std::string &prefix,
+                         const uint8_t *mask,
+                         size_t num_images,
+                         size_t per_file,
+                         size_t slow,
+                         size_t fast) {
+    auto filename = prefix + "_master.h5";
+    hid_t fapl = H5Pcreate(H5P_FILE_ACCESS);
+    H5Pset_libver_bounds(fapl, H5F_LIBVER_LATEST, H5F_LIBVER_LATEST);
+    hid_t file = H5Fcreate(filename.c_str(), H5F_ACC_TRUNC, H5P_DEFAULT, fapl);
+    H5Pclose(fapl);
+    if (file < 0) {
+        fprintf(stderr, "Error: Could not create %s\n", filename.c_str());
+        exit(1);
+    }
+    create_group(file, "/entry", "NXentry");
+    create_group(file, "/entry/data", "NXdata");
+    create_group(file, "/entry/instrument", "NXinstrument");
+    create_group(file, "/entry/instrument/detector", "NXdetector");
+
+    // Eiger pixel masks flag gaps with bit 0, and 0 is a good pixel
+    auto pixel_mask = std::vector<uint32_t>(slow * fast);
+    for (size_t i = 0; i < pixel_mask.size(); ++i) {
+        pixel_mask[i] = mask[i] ? 0 : 1;
+    }
+    hsize_t mask_dims[2] = {slow, fast};
+    hid_t mask_space = H5Screate_simple(2, mask_dims, NULL);
+    hid_t mask_dataset = H5Dcreate(file,
+                                   "/entry/instrument/detector/pixel_mask",
+                                   H5T_NATIVE_UINT32,
+                                   mask_space,
+                                   H5P_DEFAULT,
+                                   H5P_DEFAULT,
+                                   H5P_DEFAULT);
+    H5Dwrite(mask_dataset,
+             H5T_NATIVE_UINT32,
+             H5S_ALL,
+             H5S_ALL,
+             H5P_DEFAULT,
+             pixel_mask.data());
+    H5Dclose(mask_dataset);
+    H5Sclose(mask_space);
+
+    // Map each data file into the virtual dataset. The data files are
+    // named relative to the master, so the dataset can be moved.
+    hsize_t virtual_dims[3] = {num_images, slow, fast};
+    hid_t virtual_space = H5Screate_simple(3, virtual_dims, NULL);
+    hid_t dcpl = H5Pcreate(H5P_DATASET_CREATE);
+    for (size_t n = 0; n * per_file < num_images; ++n) {
+        size_t frames = std::min(per_file, num_images - n * per_file);
+        hsize_t source_dims[3] = {frames, slow, fast};
+        hid_t source_space = H5Screate_simple(3, source_dims, NULL);
+        hsize_t start[3] = {n * per_file, 0, 0};
+        hsize_t count[3] = {1, 1, 1};
+        H5Sselect_hyperslab(
+          virtual_space, H5S_SELECT_SET, start, NULL, count, source_dims);
+        H5Pset_virtual(dcpl,
+                       virtual_space,
+                       data_file_name(prefix, n).c_str(),
+                       "/entry/data/data",
+                       source_space);
+        H5Sclose(source_space);
+    }
+    H5Sselect_all(virtual_space);
+    hid_t dataset = H5Dcreate(file,
+                              "/entry/data/data",
+                              H5T_NATIVE_UINT16,
+                              virtual_space,
+                              H5P_DEFAULT,
+                              dcpl,
+                              H5P_DEFAULT);
+    if (dataset < 0) {
+        fprintf(stderr, "Error: Could not create virtual dataset\n");
+        exit(1);
+    }
+    H5Dclose(dataset);
+    H5Pclose(dcpl);
+    H5Sclose(virtual_space);
+    H5Fclose(file);
+}
+
+/// An open data file, being written to
+struct DataFile {
+    hid_t file = -1;
+    hid_t dataset = -1;
+
+    /// Create the data file. It is set up under a temporary name and moved
+    /// into place, so that a reader following the dataset never finds a
+    /// file that it can't open yet.
+    DataFile(const std::string &prefix,
+             size_t n,
+             size_t frames,
+             size_t slow,
+             size_t fast,
+             bool swmr) {
+        auto filename = prefix_folder(prefix) + data_file_name(prefix, n);
+        auto temporary = prefix_folder(prefix) + "." + data_file_name(prefix, n);
+        hid_t fapl = H5Pcreate(H5P_FILE_ACCESS);
+        H5Pset_libver_bounds(fapl, H5F_LIBVER_LATEST, H5F_LIBVER_LATEST);
+        file = H5Fcreate(temporary.c_str(), H5F_ACC_TRUNC, H5P_DEFAULT, fapl);
+        H5Pclose(fapl);
+        if (file < 0) {
+            fprintf(stderr, "Error: Could not create %s\n", temporary.c_str());
+            exit(1);
+        }
+        create_group(file, "/entry", "NXentry");
+        create_group(file, "/entry/data", "NXdata");
+
+        hsize_t dims[3] = {frames, slow, fast};
+        hsize_t chunk[3] = {1, slow, fast};
+        hid_t space = H5Screate_simple(3, dims, NULL);
+        hid_t dcpl = H5Pcreate(H5P_DATASET_CREATE);
+        H5Pset_chunk(dcpl, 3, chunk);
+        // Chunks are written already compressed, so the filter only needs
+        // to be available to readers
+        unsigned int filter_values[] = {
+          BSHUF_VERSION_MAJOR, BSHUF_VERSION_MINOR, 2, 0, BITSHUFFLE_LZ4};
+        H5Pset_filter(dcpl, BITSHUFFLE_FILTER, H5Z_FLAG_OPTIONAL, 5, filter_values);
+        dataset = H5Dcreate(file,
+                            "/entry/data/data",
+                            H5T_NATIVE_UINT16,
+                            space,
+                            H5P_DEFAULT,
+                            dcpl,
+                            H5P_DEFAULT);
+        H5Pclose(dcpl);
+        H5Sclose(space);
+        if (dataset < 0) {
+            fprintf(
+              stderr, "Error: Could not create dataset in %s\n", filename.c_str());
+            exit(1);
+        }
+        if (swmr && H5Fstart_swmr_write(file) < 0) {
+            fprintf(
+              stderr, "Error: Could not start SWMR writing %s\n", filename.c_str());
+            exit(1);
+        }
+        if (rename(temporary.c_str(), filename.c_str()) != 0) {
+            fprintf(stderr, "Error: Could not rename %s\n", temporary.c_str());
+            exit(1);
+        }
+    }
+    ~DataFile() {
+        H5Dclose(dataset);
+        H5Fclose(file);
+    }
+    DataFile(const DataFile &) = delete;
+    DataFile &operator=(const DataFile &) = delete;
+};
+
+int main(int argc, char **argv) {
+    h5read_synthetic_params params;
+    h5read_synthetic_default_params(&params);
+    params.detector = H5READ_EIGER2XE_4M;
+    params.frames = 100;
+    params.threads = 1;
+    size_t per_file = 100;
+    int num_threads = std::max(1u, std::thread::hardware_concurrency());
+    bool swmr = false;
+    float fps = 0;
+    std::string prefix;
+
+    for (int i = 1; i < argc; ++i) {
+        auto arg = std::string(argv[i]);
+        // Options that take a value
+        auto value = [&]() -> const char * {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Error: %s needs a value\n", arg.c_str());
+                exit(1);
+            }
+            return argv[++i];
+        };
+        if (arg == "-h" || arg == "--help") {
+            fprintf(stderr, USAGE, argv[0]);
+            fprintf(stderr, "\n%s\n", HELP);
+            exit(0);
+        } else if (arg == "--4m") {
+            params.detector = H5READ_EIGER2XE_4M;
+        } else if (arg == "--16m") {
+            params.detector = H5READ_EIGER2XE_16M;
+        } else if (arg == "-n") {
+            params.frames = strtoul(value(), NULL, 10);
+        } else if (arg == "--per-file") {
+            per_file = strtoul(value(), NULL, 10);
+        } else if (arg == "--spots") {
+            params.spots_per_frame = atof(value());
+        } else if (arg == "--seed") {
+            params.seed = strtoull(value(), NULL, 10);
+        } else if (arg == "-j") {
+            num_threads = atoi(value());
+        } else if (arg == "--swmr") {
+            swmr = true;
+        } else if (arg == "--fps") {
+            fps = atof(value());
+        } else if (arg[0] == '-' || !prefix.empty()) {
+            fprintf(stderr, "Error: Unrecognised argument %s\n", arg.c_str());
+            fprintf(stderr, USAGE, argv[0]);
+            exit(1);
+        } else {
+            prefix = arg;
+        }
+    }
+    if (prefix.empty() || params.frames == 0 || per_file == 0 || num_threads < 1) {
+        fprintf(stderr, USAGE, argv[0]);
+        exit(1);
+    }
+    size_t num_images = params.frames;
+
+    auto reader = H5Read(params);
+    size_t slow = reader.get_image_slow();
+    size_t fast = reader.get_image_fast();
+    write_master(
+      prefix, reader.get_mask().value().data(), num_images, per_file, slow, fast);
+
+    // Workers generate and compress frames, a little way ahead of writing
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::map<size_t, std::vector<uint8_t>> ready;
+    size_t next_to_write = 0;
+    const size_t lookahead = 2 * num_threads;
+    std::atomic<size_t> next_to_generate = 0;
+    std::vector<std::jthread> workers;
+    for (int t = 0; t < num_threads; ++t) {
+        workers.emplace_back([&]() {
+            auto image = std::vector<uint16_t>(slow * fast);
+            while (true) {
+                size_t index = next_to_generate.fetch_add(1);
+                if (index >= num_images) break;
+                {
+                    std::unique_lock lock(mutex);
+                    changed.wait(lock,
+                                 [&]() { return index < next_to_write + lookahead; });
+                }
+                reader.get_image_into(index, image.data());
+                auto chunk = compress_chunk(image);
+                {
+                    std::scoped_lock lock(mutex);
+                    ready[index] = std::move(chunk);
+                }
+                changed.notify_all();
+            }
+        });
+    }
+
+    char rate[32] = "full speed";
+    if (fps > 0) {
+        snprintf(rate, sizeof(rate), "%g fps", fps);
+    }
+    printf("Writing %zu %zux%zu frames to %s_master.h5 at %s%s\n",
+           num_images,
+           fast,
+           slow,
+           prefix.c_str(),
+           rate,
+           swmr ? " (SWMR)" : "");
+
+    auto period = std::chrono::duration_cast<clock_type::duration>(
+      std::chrono::duration<double>(fps > 0 ? 1.0 / fps : 0));
+    std::unique_ptr<DataFile> data_file;
+    size_t total_bytes = 0, late_frames = 0;
+    auto start_time = clock_type::now();
+    for (size_t index = 0; index < num_images; ++index) {
+        std::vector<uint8_t> chunk;
+        {
+            std::unique_lock lock(mutex);
+            changed.wait(lock, [&]() { return ready.contains(index); });
+            chunk = std::move(ready[index]);
+            ready.erase(index);
+            next_to_write = index + 1;
+        }
+        changed.notify_all();
+
+        if (index % per_file == 0) {
+            data_file.reset();
+            size_t frames = std::min(per_file, num_images - index);
+            data_file = std::make_unique<DataFile>(
+              prefix, index / per_file, frames, slow, fast, swmr);
+        }
+        if (fps > 0) {
+            auto due = start_time + index * period;
+            if (clock_type::now() > due + period) {
+                late_frames += 1;
+            }
+            std::this_thread::sleep_until(due);
+        }
+        hsize_t offset[3] = {index % per_file, 0, 0};
+        if (H5Dwrite_chunk(
+              data_file->dataset, H5P_DEFAULT, 0, offset, chunk.size(), chunk.data())
+            < 0) {
+            fprintf(stderr, "Error: Writing frame %zu\n", index);
+            exit(1);
+        }
+        if (swmr) {
+            H5Dflush(data_file->dataset);
+        }
+        total_bytes += chunk.size();
+    }
+    data_file.reset();
+
+    float total_time =
+      std::chrono::duration<double>(clock_type::now() - start_time).count();
+    printf("Wrote %zu frames in %.2f s (%.0f fps, %.2f GB/s compressed)\n",
+           num_images,
+           total_time,
+           num_images / total_time,
+           total_bytes / total_time / 1e9);
+    printf("Compression ratio %.1f",
+           (double)num_images * slow * fast * sizeof(uint16_t) / total_bytes);
+    if (fps > 0) {
+        printf("; %zu frames late", late_frames);
+    }
+    printf("\n");
+}